@@ -0,0 +1,98 @@
+/* -*- mode: c++ -*- */
+
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Timing and a benchmark harness shared by the C++ benchmarks.
+ *
+ * timestamp() reads a monotonic clock.  benchRun() runs a function
+ * BENCH_WARMUP times untimed and then BENCH_REPS times timed, and prints one
+ * line of JSON with summary statistics and the samples, in milliseconds:
+ *
+ *   {"benchmark":"mandel","variant":"AVX2","threads":1,"warmup":3,"reps":10,
+ *    "min":...,"median":...,"mean":...,"stddev":...,"p95":...,"samples":[...]}
+ *
+ * bench.js is the same harness for the js shell benchmarks.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#ifndef BENCH_WARMUP
+#  define BENCH_WARMUP 3
+#endif
+
+#ifndef BENCH_REPS
+#  define BENCH_REPS 10
+#endif
+
+#if BENCH_REPS < 1
+#  error "BENCH_REPS must be at least 1"
+#endif
+
+// Microseconds since an arbitrary point, never going backwards.
+static inline uint64_t timestamp() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct BenchStats {
+    double min, median, mean, stddev, p95;
+};
+
+static inline BenchStats benchStats(std::vector<double> samples) {
+    BenchStats s;
+    size_t n = samples.size();
+    std::sort(samples.begin(), samples.end());
+    s.min = samples[0];
+    s.median = n % 2 ? samples[n/2] : (samples[n/2-1] + samples[n/2]) / 2;
+    double sum = 0;
+    for ( double x : samples )
+        sum += x;
+    s.mean = sum / n;
+    double var = 0;
+    for ( double x : samples )
+        var += (x - s.mean) * (x - s.mean);
+    s.stddev = n > 1 ? sqrt(var / (n - 1)) : 0;
+    // Nearest rank
+    s.p95 = samples[size_t(ceil(0.95 * n)) - 1];
+    return s;
+}
+
+template<typename F>
+static BenchStats benchRun(const char* benchmark, const char* variant, unsigned threads, F run) {
+    typedef std::chrono::duration<double, std::milli> ms;
+
+    for ( unsigned i=0 ; i < BENCH_WARMUP ; i++ )
+        run();
+
+    std::vector<double> samples;
+    for ( unsigned i=0 ; i < BENCH_REPS ; i++ ) {
+        std::chrono::steady_clock::time_point then = std::chrono::steady_clock::now();
+        run();
+        samples.push_back(ms(std::chrono::steady_clock::now() - then).count());
+    }
+
+    BenchStats s = benchStats(samples);
+    printf("{\"benchmark\":\"%s\",\"variant\":\"%s\",\"threads\":%u,\"warmup\":%u,\"reps\":%u,"
+           "\"min\":%.3f,\"median\":%.3f,\"mean\":%.3f,\"stddev\":%.3f,\"p95\":%.3f,\"samples\":[",
+           benchmark, variant, threads, unsigned(BENCH_WARMUP), unsigned(BENCH_REPS),
+           s.min, s.median, s.mean, s.stddev, s.p95);
+    for ( size_t i=0 ; i < samples.size() ; i++ )
+        printf("%s%.3f", i ? "," : "", samples[i]);
+    printf("]}\n");
+    fflush(stdout);
+    return s;
+}
+
+#endif // BENCH_H
@@ -0,0 +1,72 @@
+// Benchmark harness for the js shell benchmarks, the counterpart of bench.h.
+//
+// bench(benchmark, variant, fn) calls fn `warmup` times untimed and then
+// `reps` times timed, and prints one line of JSON with summary statistics and
+// the samples, in milliseconds.  The defaults (3 and 10) can be changed per
+// call, eg {reps: 5}, and both are overridden on the command line after the
+// script:
+//
+//   js sumcols.js warmup=5 reps=30
+
+var benchArgs = {};
+
+if (typeof scriptArgs != "undefined") {
+    for ( let arg of scriptArgs ) {
+        let m = /^(warmup|reps)=(\d+)$/.exec(arg);
+        if (!m)
+            throw new Error("Bad argument: " + arg);
+        benchArgs[m[1]] = Number(m[2]);
+    }
+}
+
+// Monotonic and sub-millisecond where available.
+var benchNow = typeof performance != "undefined" ? () => performance.now() : () => Date.now();
+
+function bench(benchmark, variant, fn, opts) {
+    let warmup = benchOption("warmup", opts, 3);
+    let reps = benchOption("reps", opts, 10);
+    if (reps < 1)
+        throw new Error("reps must be at least 1");
+
+    for ( let i=0 ; i < warmup ; i++ )
+        fn();
+
+    let samples = [];
+    for ( let i=0 ; i < reps ; i++ ) {
+        let then = benchNow();
+        fn();
+        samples.push(benchNow() - then);
+    }
+
+    let s = benchStats(samples);
+    // The same record as bench.h's; the js shell benchmarks are single-threaded
+    print(JSON.stringify({ benchmark, variant, threads: 1, warmup, reps,
+                           min: s.min, median: s.median, mean: s.mean, stddev: s.stddev, p95: s.p95,
+                           samples: samples.map(round3) }));
+    return s;
+}
+
+function benchStats(samples) {
+    let xs = samples.slice().sort((a, b) => a - b);
+    let n = xs.length;
+    let mean = xs.reduce((a, b) => a + b, 0) / n;
+    let variance = n > 1 ? xs.reduce((a, x) => a + (x - mean) * (x - mean), 0) / (n - 1) : 0;
+    return { min: round3(xs[0]),
+             median: round3(n % 2 ? xs[n >> 1] : (xs[n/2 - 1] + xs[n/2]) / 2),
+             mean: round3(mean),
+             stddev: round3(Math.sqrt(variance)),
+             // Nearest rank
+             p95: round3(xs[Math.ceil(0.95 * n) - 1]) };
+}
+
+function benchOption(name, opts, dflt) {
+    if (name in benchArgs)
+        return benchArgs[name];
+    if (opts && name in opts)
+        return opts[name];
+    return dflt;
+}
+
+function round3(x) {
+    return Math.round(x * 1000) / 1000;
+}
@@ -1,6 +1,7 @@
+load("bench.js");
+
 let bin = os.file.readFile("const.wasm", "binary");
 let ins = new WebAssembly.Instance(new WebAssembly.Module(bin));
 
-let then = Date.now();
-ins.exports.run_ffoo(1000000000);
-print("constant " + (Date.now() - then));
+// A single run is long, so use fewer repetitions than the default.
+bench("const", "constant", () => ins.exports.run_ffoo(1000000000), { warmup: 1, reps: 5 });
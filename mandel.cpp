@@ -1,18 +1,49 @@
 #include <cstdio>
-#include <sys/time.h>
-#include <emscripten.h>
-#include <wasm_simd128.h>
-#include <SDL/SDL.h>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#ifdef __EMSCRIPTEN__
+#  include <emscripten.h>
+#endif
+#ifdef USE_SIMD
+#  include "simd.h"
+#endif
+// Natively on x86, wider kernels are compiled in too and chosen at run time.
+#if defined(USE_SIMD) && !defined(__wasm__) && (defined(__x86_64__) || defined(__i386__))
+#  define X86_KERNELS
+#  include <immintrin.h>
+#endif
+#ifdef SDL_BROWSER
+#  include <SDL/SDL.h>
+#endif
+#if defined(PPM_STDOUT)
+#  define IMAGE_FORMAT PPM
+#elif defined(PPM64_STDOUT)
+#  define IMAGE_FORMAT PPM64
+#elif defined(PPMX_STDOUT)
+#  define IMAGE_FORMAT PPMX
+#endif
+#ifdef IMAGE_FORMAT
+#  include "ppm.h"
+#endif
+#ifdef THREADS
+#  include <thread>
+#  include <atomic>
+#  include <mutex>
+#endif
+#if defined(RUNTIME) || defined(THREADS) || defined(BENCH)
+#  include "bench.h"
+#endif
 
-#if !defined(RUNTIME) && !defined(PPMX_STDOUT) && !defined(SDL_BROWSER)
+#if !defined(RUNTIME) && !defined(BENCH) && !defined(IMAGE_FORMAT) && !defined(SDL_BROWSER)
   #error "Make up your mind"
 #endif
 
 #define ROUNDUP4(x) (((x)+3)&~3)
 
-#define SCALE(v, range, min, max) \
-    float(min) + float(v) * (float((max) - (min)) / float(range))
-
+// Defaults, which can be changed on the command line, see usage()
 #define WIDTH ROUNDUP4(unsigned(400*3.5))
 #define HEIGHT (400*2)
 
@@ -23,76 +54,1527 @@
 #define MINX -2.5
 #define MAXX 1
 
-unsigned iterations[HEIGHT][WIDTH];
+#ifdef THREADS
+// Number of threads, 0 means one per hardware thread
+#  ifndef NTHREADS
+#    define NTHREADS 0
+#  endif
+// Rows handed out at a time
+#  ifndef CHUNK_ROWS
+#    define CHUNK_ROWS 1
+#  endif
+#endif
 
-#ifdef USE_SIMD
-static void mandel() {
-    v128_t* addr = (v128_t*)&iterations[0][0];
-    for ( float Py=0.0 ; Py < HEIGHT; Py++ ) {
-        v128_t y0 = wasm_f32x4_splat(SCALE(Py, HEIGHT, MINY, MAXY));
-        for ( float Px=0.0 ; Px < WIDTH; Px+=4 ) {
-            v128_t x0 = wasm_f32x4_make(SCALE(Px,   WIDTH, MINX, MAXX),
-                                        SCALE(Px+1, WIDTH, MINX, MAXX),
-                                        SCALE(Px+2, WIDTH, MINX, MAXX),
-                                        SCALE(Px+3, WIDTH, MINX, MAXX));
-            v128_t x = wasm_f32x4_const(0, 0, 0, 0);
-            v128_t y = wasm_f32x4_const(0, 0, 0, 0);
-            v128_t active = wasm_i32x4_const(-1, -1, -1, -1);
-            v128_t counter = wasm_i32x4_const(CUTOFF, CUTOFF, CUTOFF, CUTOFF);
-            for(;;) {
-                v128_t x_sq = wasm_f32x4_mul(x, x);
-                v128_t y_sq = wasm_f32x4_mul(y, y);
-                v128_t sum_sq = wasm_f32x4_add(x_sq, y_sq);
-                active = wasm_v128_and(active, wasm_f32x4_le(sum_sq, wasm_f32x4_const(4, 4, 4, 4)));
-                active = wasm_v128_and(active, wasm_i32x4_gt(counter, wasm_i32x4_const(0,0,0,0)));
-                if (!wasm_i32x4_any_true(active))
-                    break;
-                v128_t tmp = wasm_f32x4_add(wasm_f32x4_sub(x_sq, y_sq), x0);
-                v128_t xy = wasm_f32x4_mul(x, y);
-                y = wasm_f32x4_add(wasm_f32x4_add(xy, xy), y0);
-                x = tmp;
-                counter = wasm_i32x4_add(counter, active);
-            }
-            counter = wasm_i32x4_sub(wasm_i32x4_const(CUTOFF, CUTOFF, CUTOFF, CUTOFF), counter);
-            *addr++ = counter;
+// Double-double arithmetic, hi + lo with |lo| at most half an ulp of hi, for
+// about 106 bits.  The error-free transformations are Dekker's and Knuth's, and
+// need -ffp-contract=off like the kernels.
+
+struct DD {
+    double hi, lo;
+};
+
+static inline DD quickTwoSum(double a, double b) {
+    double s = a + b;
+    DD r = { s, b - (s - a) };
+    return r;
+}
+
+static inline DD twoSum(double a, double b) {
+    double s = a + b;
+    double bb = s - a;
+    DD r = { s, (a - (s - bb)) + (b - bb) };
+    return r;
+}
+
+static inline DD twoProd(double a, double b) {
+    const double split = 134217729.0;   // 2^27 + 1
+    double p = a * b;
+    double ta = split * a, a_hi = ta - (ta - a), a_lo = a - a_hi;
+    double tb = split * b, b_hi = tb - (tb - b), b_lo = b - b_hi;
+    DD r = { p, ((a_hi*b_hi - p) + a_hi*b_lo + a_lo*b_hi) + a_lo*b_lo };
+    return r;
+}
+
+static inline DD operator+(DD a, DD b) {
+    DD s = twoSum(a.hi, b.hi);
+    DD t = twoSum(a.lo, b.lo);
+    s = quickTwoSum(s.hi, s.lo + t.hi);
+    return quickTwoSum(s.hi, s.lo + t.lo);
+}
+
+static inline DD operator-(DD a) {
+    DD r = { -a.hi, -a.lo };
+    return r;
+}
+
+static inline DD operator-(DD a, DD b) {
+    return a + -b;
+}
+
+static inline DD operator*(DD a, DD b) {
+    DD p = twoProd(a.hi, b.hi);
+    return quickTwoSum(p.hi, p.lo + (a.hi*b.lo + a.lo*b.hi));
+}
+
+static inline DD operator/(DD a, double b) {
+    double q1 = a.hi / b;
+    DD p = twoProd(q1, b);
+    DD r = a - p;
+    return quickTwoSum(q1, r.hi / b);
+}
+
+static inline DD dd(double a) {
+    DD r = { a, 0 };
+    return r;
+}
+
+// Decimal s to double-double, so that a view center can have more digits than
+// a double holds.  Returns false if s is not a number.
+static bool parseDD(const char* s, DD* v) {
+    const char* p = s;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+')
+        p++;
+    DD m = dd(0);
+    int exponent = 0;
+    bool digits = false;
+    for ( bool fraction = false ; ; p++ ) {
+        if (*p == '.' && !fraction) {
+            fraction = true;
+        } else if (*p >= '0' && *p <= '9') {
+            m = m * dd(10) + dd(*p - '0');
+            exponent -= fraction;
+            digits = true;
+        } else {
+            break;
         }
     }
+    if (!digits)
+        return false;
+    if (*p == 'e' || *p == 'E') {
+        char* end;
+        long e = strtol(p+1, &end, 10);
+        if (end == p+1 || e < -400 || e > 400)
+            return false;
+        exponent += e;
+        p = end;
+    }
+    if (*p)
+        return false;
+    for ( ; exponent > 0 ; exponent-- )
+        m = m * dd(10);
+    for ( ; exponent < 0 ; exponent++ )
+        m = m / 10;
+    *v = negative ? -m : m;
+    return true;
+}
+
+static unsigned width = WIDTH;
+static unsigned height = HEIGHT;
+static unsigned cutoff = CUTOFF;
+
+// The view is given by its center and by a zoom factor relative to the
+// classical view, and pixels are square, so a change of image size changes the
+// extent of the view but not its scale.  The center is kept in double-double
+// for the perturbation kernel, the other kernels use its high part.
+static DD center_x = { (MINX + MAXX) / 2.0, 0 };
+static DD center_y = { (MINY + MAXY) / 2.0, 0 };
+static double zoom = 1;
+
+// Pixel (px, py) is the point minx + px*step + (miny + py*step)i.  The float
+// kernels compute it in float, from the float copies.
+static double minx, miny, step;
+static float minx_f, miny_f, step_f;
+
+static void setView() {
+    step = (MAXY - MINY) / (zoom * height);
+    minx = center_x.hi - step * width / 2;
+    miny = center_y.hi - step * height / 2;
+    minx_f = float(minx);
+    miny_f = float(miny);
+    step_f = float(step);
+}
+
+static inline float xCoord(unsigned px) {
+    return minx_f + float(px) * step_f;
+}
+
+static inline float yCoord(unsigned py) {
+    return miny_f + float(py) * step_f;
+}
+
+static inline double xCoord64(unsigned px) {
+    return minx + px * step;
+}
+
+static inline double yCoord64(unsigned py) {
+    return miny + py * step;
+}
+
+// Iteration counts, row by row.  Rows are padded to a multiple of 16 pixels,
+// and the kernels may store whole vectors into the padding.
+static unsigned* iterations;
+static unsigned stride;
+
+// With --smooth the kernels also record, in the same layout, |z|^2 at escape
+// for the smooth colouring, see colour().  It is only meaningful for pixels
+// that escaped.
+static bool smooth = false;
+static float* escapes;
+
+static void allocateIterations() {
+    stride = (width + 15) & ~15u;
+    iterations = (unsigned*)aligned_alloc(64, size_t(stride) * height * sizeof(unsigned));
+    if (smooth)
+        escapes = (float*)aligned_alloc(64, size_t(stride) * height * sizeof(float));
+    if (!iterations || (smooth && !escapes)) {
+        printf("Failed to allocate %ux%u image\n", width, height);
+        exit(1);
+    }
+}
+
+static inline unsigned* row(unsigned y) {
+    return iterations + size_t(y) * stride;
+}
+
+static inline float* escapeRow(unsigned y) {
+    return escapes + size_t(y) * stride;
+}
+
+// With --interior, points in the main cardioid and the period-2 bulb are not
+// iterated at all, and other orbits stop when they are seen to have become
+// periodic.  Either way the point is in the set and gets the count cutoff, so
+// the image does not change.
+static bool interior = false;
+
+// Whether c = x+yi is in the main cardioid or the period-2 bulb.
+static inline bool inCardioidOrBulb(float x, float y) {
+    float q = (x - 0.25f)*(x - 0.25f) + y*y;
+    return q*(q + (x - 0.25f)) <= 0.25f*y*y || (x + 1)*(x + 1) + y*y <= 0.0625f;
+}
+
+// Periodicity checking after Brent: the orbit is compared at every iteration
+// with the point saved at the last power of two.  The comparison is exact, and
+// an orbit that returns exactly to an earlier point repeats itself forever
+// without escaping.
+static inline bool checkpoint(unsigned iteration) {
+    return (iteration & (iteration - 1)) == 0;
+}
+
+// The kernels compute rows [ymin, ylim) of the image, or a list of pixels.
+
+struct Pixel {
+    uint16_t y, x;
+};
+
+#ifdef USE_SIMD
+// Lane-iterations of the 128-bit kernels, all of them and those of lanes that
+// were working, for the lane utilisation.
+# ifdef THREADS
+static std::atomic<uint64_t> lane_trips;
+static std::atomic<uint64_t> lane_work;
+# else
+static uint64_t lane_trips;
+static uint64_t lane_work;
+# endif
+
+static inline v128_t inCardioidOrBulb4(v128_t x, v128_t y) {
+    v128_t x_q = wasm_f32x4_sub(x, wasm_f32x4_splat(0.25f));
+    v128_t x_b = wasm_f32x4_add(x, wasm_f32x4_splat(1));
+    v128_t y_sq = wasm_f32x4_mul(y, y);
+    v128_t q = wasm_f32x4_add(wasm_f32x4_mul(x_q, x_q), y_sq);
+    v128_t cardioid = wasm_f32x4_le(wasm_f32x4_mul(q, wasm_f32x4_add(q, x_q)), wasm_f32x4_mul(wasm_f32x4_splat(0.25f), y_sq));
+    v128_t bulb = wasm_f32x4_le(wasm_f32x4_add(wasm_f32x4_mul(x_b, x_b), y_sq), wasm_f32x4_splat(0.0625f));
+    return wasm_v128_or(cardioid, bulb);
 }
+
+// The loops over the N vectors below must be unrolled for the vectors to stay
+// in registers, which gcc does not do by itself at -O2.
+#if defined(__clang__)
+#  define UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#  define UNROLL _Pragma("GCC unroll 4")
 #else
-static void mandel() {
-    for ( unsigned Py=0 ; Py < HEIGHT; Py++ ) {
-        float y0 = SCALE(Py, HEIGHT, MINY, MAXY);
-        for ( unsigned Px=0 ; Px < WIDTH; Px++ ) {
-            float x0 = SCALE(Px, WIDTH, MINX, MAXX);
-            float x = 0;
-            float y = 0;
-            unsigned iteration = 0;
-            while (x*x + y*y <= 4 && iteration < CUTOFF) {
-                float tmp = x*x - y*y + x0;
-                y = 2*x*y + y0;
-                x = tmp;
-                iteration++;
+#  define UNROLL
+#endif
+
+// Iteration counts of the points x0[j] + y0[j] i, for N vectors of points at
+// once.  Their orbits are independent, and interleaving them hides the latency
+// of one vector's arithmetic behind that of the others.  *trips is set to the
+// number of times around the loop, and work[j] to the number of those in which
+// each lane of vector j was working.  With --smooth, escape[j] is set to |z|^2
+// where each lane escaped; lanes that have stopped keep iterating, so it is
+// caught on the trip where the lane stops.
+template<unsigned N>
+static inline void mandelSIMD(const v128_t* x0, const v128_t* y0, v128_t* counts, unsigned* trips, v128_t* work,
+                              v128_t* escape) {
+    v128_t x[N], y[N], saved_x[N], saved_y[N], active[N], counter[N], in_set[N];
+    v128_t limit = wasm_i32x4_splat(cutoff);
+    UNROLL
+    for ( unsigned j=0 ; j < N ; j++ ) {
+        x[j] = y[j] = saved_x[j] = saved_y[j] = escape[j] = wasm_f32x4_const(0, 0, 0, 0);
+        active[j] = wasm_i32x4_const(-1, -1, -1, -1);
+        counter[j] = limit;
+        in_set[j] = wasm_i32x4_const(0, 0, 0, 0);    // Known to be in the set
+        if (interior) {
+            in_set[j] = inCardioidOrBulb4(x0[j], y0[j]);
+            active[j] = wasm_v128_andnot(active[j], in_set[j]);
+        }
+    }
+    unsigned iteration = 0;
+    unsigned n = 0;
+    for(;;) {
+        v128_t x_sq[N], y_sq[N];
+        v128_t any = wasm_i32x4_const(0, 0, 0, 0);
+        UNROLL
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            x_sq[j] = wasm_f32x4_mul(x[j], x[j]);
+            y_sq[j] = wasm_f32x4_mul(y[j], y[j]);
+            v128_t sum_sq = wasm_f32x4_add(x_sq[j], y_sq[j]);
+            v128_t was = active[j];
+            active[j] = wasm_v128_and(active[j], wasm_f32x4_le(sum_sq, wasm_f32x4_const(4, 4, 4, 4)));
+            active[j] = wasm_v128_and(active[j], wasm_i32x4_gt(counter[j], wasm_i32x4_const(0, 0, 0, 0)));
+            if (smooth)
+                escape[j] = wasm_v128_bitselect(sum_sq, escape[j], wasm_v128_andnot(was, active[j]));
+            any = wasm_v128_or(any, active[j]);
+        }
+        if (!wasm_i32x4_any_true(any))
+            break;
+        UNROLL
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            v128_t tmp = wasm_f32x4_add(wasm_f32x4_sub(x_sq[j], y_sq[j]), x0[j]);
+            v128_t xy = wasm_f32x4_mul(x[j], y[j]);
+            y[j] = wasm_f32x4_add(wasm_f32x4_add(xy, xy), y0[j]);
+            x[j] = tmp;
+            counter[j] = wasm_i32x4_add(counter[j], active[j]);
+        }
+        ++n;
+        if (interior) {
+            // Lanes that have stopped keep iterating, and may repeat too once
+            // they overflow
+            UNROLL
+            for ( unsigned j=0 ; j < N ; j++ ) {
+                v128_t cycle = wasm_v128_and(active[j], wasm_v128_and(wasm_f32x4_eq(x[j], saved_x[j]), wasm_f32x4_eq(y[j], saved_y[j])));
+                in_set[j] = wasm_v128_or(in_set[j], cycle);
+                active[j] = wasm_v128_andnot(active[j], cycle);
             }
-            iterations[Py][Px] = iteration;
+            if (checkpoint(++iteration)) {
+                UNROLL
+                for ( unsigned j=0 ; j < N ; j++ ) {
+                    saved_x[j] = x[j];
+                    saved_y[j] = y[j];
+                }
+            }
+        }
+    }
+    *trips = n;
+    UNROLL
+    for ( unsigned j=0 ; j < N ; j++ ) {
+        work[j] = wasm_i32x4_sub(limit, counter[j]);
+        counts[j] = wasm_v128_bitselect(limit, work[j], in_set[j]);
+    }
+}
+
+// The sum of the first n lanes of v.
+static inline uint64_t sum(v128_t v, unsigned n) {
+    alignas(16) uint32_t lanes[4];
+    wasm_v128_store(lanes, v);
+    uint64_t s = 0;
+    for ( unsigned i=0 ; i < n && i < 4 ; i++ )
+        s += lanes[i];
+    return s;
+}
+
+// Lanes past the end of the row compute points outside the image, into the
+// padding, and their work is not counted.
+template<unsigned N>
+static void mandelRowsSIMD(unsigned ymin, unsigned ylim) {
+    uint64_t trips = 0;
+    uint64_t work = 0;
+    for ( unsigned Py=ymin ; Py < ylim; Py++ ) {
+        v128_t y0[N];
+        for ( unsigned j=0 ; j < N ; j++ )
+            y0[j] = wasm_f32x4_splat(yCoord(Py));
+        for ( unsigned Px=0 ; Px < width; Px+=4*N ) {
+            v128_t x0[N], counts[N], w[N], e[N];
+            for ( unsigned j=0 ; j < N ; j++ ) {
+                unsigned p = Px + 4*j;
+                x0[j] = wasm_f32x4_make(xCoord(p), xCoord(p+1), xCoord(p+2), xCoord(p+3));
+            }
+            unsigned t;
+            mandelSIMD<N>(x0, y0, counts, &t, w, e);
+            trips += t;
+            for ( unsigned j=0 ; j < N ; j++ ) {
+                unsigned p = Px + 4*j;
+                wasm_v128_store(row(Py) + p, counts[j]);
+                if (smooth)
+                    wasm_v128_store(escapeRow(Py) + p, e[j]);
+                work += p + 4 <= width ? sum(w[j], 4) : p < width ? sum(w[j], width - p) : 0;
+            }
+        }
+    }
+    lane_trips += 4*N*trips;
+    lane_work += work;
+}
+
+// Lanes past the end of the list repeat the last pixel.
+template<unsigned N>
+static void mandelPixelsSIMD(const Pixel* p, unsigned n) {
+    uint64_t trips = 0;
+    uint64_t work = 0;
+    for ( unsigned i=0 ; i < n ; i+=4*N ) {
+        alignas(16) float xs[4*N];
+        alignas(16) float ys[4*N];
+        alignas(16) unsigned counts[4*N];
+        alignas(16) unsigned works[4*N];
+        alignas(16) float mags[4*N];
+        for ( unsigned j=0 ; j < 4*N ; j++ ) {
+            const Pixel& q = p[i+j < n ? i+j : n-1];
+            xs[j] = xCoord(q.x);
+            ys[j] = yCoord(q.y);
+        }
+        v128_t x0[N], y0[N], c[N], w[N], e[N];
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            x0[j] = wasm_v128_load(xs + 4*j);
+            y0[j] = wasm_v128_load(ys + 4*j);
+        }
+        unsigned t;
+        mandelSIMD<N>(x0, y0, c, &t, w, e);
+        trips += t;
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            wasm_v128_store(counts + 4*j, c[j]);
+            wasm_v128_store(works + 4*j, w[j]);
+            wasm_v128_store(mags + 4*j, e[j]);
+        }
+        for ( unsigned j=0 ; j < 4*N && i+j < n ; j++ ) {
+            row(p[i+j].y)[p[i+j].x] = counts[j];
+            if (smooth)
+                escapeRow(p[i+j].y)[p[i+j].x] = mags[j];
+            work += works[j];
         }
     }
+    lane_trips += 4*N*trips;
+    lane_work += work;
+}
+
+// SIMD with lane refill.  In mandelSIMD the lanes whose points have escaped
+// idle until the last of the four is done, which at the edge of the set can
+// be thousands of iterations later.  Here a lane that is done stores its count
+// and takes the next pixel from the queue straight away, so lanes only idle
+// when the queue runs dry.  The counts are those of the other kernels.
+
+// Pixels of rows [ymin, ylim) in order.
+struct RowQueue {
+    unsigned next, lim;
+
+    bool take(unsigned* y, unsigned* x) {
+        if (next == lim)
+            return false;
+        *y = next / width;
+        *x = next % width;
+        next++;
+        return true;
+    }
+};
+
+struct ListQueue {
+    const Pixel* p;
+    unsigned next, lim;
+
+    bool take(unsigned* y, unsigned* x) {
+        if (next == lim)
+            return false;
+        *y = p[next].y;
+        *x = p[next].x;
+        next++;
+        return true;
+    }
+};
+
+// The lane state while lanes are being retired and refilled.
+struct RefillLanes {
+    alignas(16) float x0[4], y0[4], x[4], y[4], saved_x[4], saved_y[4];
+    alignas(16) int32_t counter[4], live[4];
+    unsigned* result[4];
+    float* escape[4];           // With --smooth
+    uint64_t started[4];        // Trip at which the pixel was taken
+    unsigned nlive;
+
+    // Put the next pixel that needs iterating into lane j, or retire the lane.
+    template<typename Queue>
+    void refill(Queue* queue, unsigned j, uint64_t trips) {
+        unsigned py, px;
+        while (queue->take(&py, &px)) {
+            float cx = xCoord(px);
+            float cy = yCoord(py);
+            if (interior && inCardioidOrBulb(cx, cy)) {
+                row(py)[px] = cutoff;
+                continue;
+            }
+            x0[j] = cx;
+            y0[j] = cy;
+            x[j] = y[j] = saved_x[j] = saved_y[j] = 0;
+            counter[j] = cutoff;
+            live[j] = -1;
+            result[j] = &row(py)[px];
+            escape[j] = smooth ? &escapeRow(py)[px] : nullptr;
+            started[j] = trips;
+            return;
+        }
+        // A dead lane iterates 0 + 0i, which stays put
+        x0[j] = y0[j] = x[j] = y[j] = 0;
+        counter[j] = 0;
+        if (live[j])
+            nlive--;
+        live[j] = 0;
+    }
+};
+
+template<typename Queue>
+static void mandelRefill(Queue* queue) {
+    RefillLanes lanes;
+    lanes.nlive = 4;
+    uint64_t trips = 0;
+    uint64_t work = 0;
+    for ( unsigned j=0 ; j < 4 ; j++ ) {
+        lanes.live[j] = -1;
+        lanes.refill(queue, j, trips);
+    }
+    if (!lanes.nlive)
+        return;
+
+    v128_t x0 = wasm_v128_load(lanes.x0);
+    v128_t y0 = wasm_v128_load(lanes.y0);
+    v128_t x = wasm_v128_load(lanes.x);
+    v128_t y = wasm_v128_load(lanes.y);
+    v128_t saved_x = wasm_v128_load(lanes.saved_x);
+    v128_t saved_y = wasm_v128_load(lanes.saved_y);
+    v128_t counter = wasm_v128_load(lanes.counter);
+    v128_t live = wasm_v128_load(lanes.live);
+    v128_t limit = wasm_i32x4_splat(cutoff);
+    for(;;) {
+        v128_t sum_sq = wasm_f32x4_add(wasm_f32x4_mul(x, x), wasm_f32x4_mul(y, y));
+        v128_t going = wasm_v128_and(wasm_f32x4_le(sum_sq, wasm_f32x4_const(4, 4, 4, 4)),
+                                     wasm_i32x4_gt(counter, wasm_i32x4_const(0, 0, 0, 0)));
+        v128_t done = wasm_v128_andnot(live, going);
+        if (wasm_i32x4_any_true(done)) {
+            alignas(16) int32_t retire[4];
+            alignas(16) float mag[4];
+            wasm_v128_store(retire, done);
+            wasm_v128_store(mag, sum_sq);
+            wasm_v128_store(lanes.x0, x0);
+            wasm_v128_store(lanes.y0, y0);
+            wasm_v128_store(lanes.x, x);
+            wasm_v128_store(lanes.y, y);
+            wasm_v128_store(lanes.saved_x, saved_x);
+            wasm_v128_store(lanes.saved_y, saved_y);
+            wasm_v128_store(lanes.counter, counter);
+            for ( unsigned j=0 ; j < 4 ; j++ ) {
+                if (retire[j]) {
+                    *lanes.result[j] = cutoff - lanes.counter[j];
+                    if (smooth)
+                        *lanes.escape[j] = mag[j];
+                    work += trips - lanes.started[j];
+                    lanes.refill(queue, j, trips);
+                }
+            }
+            if (!lanes.nlive)
+                break;
+            x0 = wasm_v128_load(lanes.x0);
+            y0 = wasm_v128_load(lanes.y0);
+            x = wasm_v128_load(lanes.x);
+            y = wasm_v128_load(lanes.y);
+            saved_x = wasm_v128_load(lanes.saved_x);
+            saved_y = wasm_v128_load(lanes.saved_y);
+            counter = wasm_v128_load(lanes.counter);
+            live = wasm_v128_load(lanes.live);
+        }
+        v128_t x_sq = wasm_f32x4_mul(x, x);
+        v128_t y_sq = wasm_f32x4_mul(y, y);
+        v128_t tmp = wasm_f32x4_add(wasm_f32x4_sub(x_sq, y_sq), x0);
+        v128_t xy = wasm_f32x4_mul(x, y);
+        y = wasm_f32x4_add(wasm_f32x4_add(xy, xy), y0);
+        x = tmp;
+        counter = wasm_i32x4_add(counter, live);
+        trips++;
+        if (interior) {
+            // A repeating lane gets a zero counter, and so the count cutoff
+            // when it is retired on the next trip.  Each lane saves its orbit
+            // at its own powers of two.
+            v128_t cycle = wasm_v128_and(live, wasm_v128_and(wasm_f32x4_eq(x, saved_x), wasm_f32x4_eq(y, saved_y)));
+            counter = wasm_v128_andnot(counter, cycle);
+            v128_t n = wasm_i32x4_sub(limit, counter);
+            v128_t pow2 = wasm_i32x4_eq(wasm_v128_and(n, wasm_i32x4_sub(n, wasm_i32x4_const(1, 1, 1, 1))),
+                                        wasm_i32x4_const(0, 0, 0, 0));
+            saved_x = wasm_v128_bitselect(x, saved_x, pow2);
+            saved_y = wasm_v128_bitselect(y, saved_y, pow2);
+        }
+    }
+    lane_trips += 4*trips;
+    lane_work += work;
+}
+
+static void mandelRowsRefill(unsigned ymin, unsigned ylim) {
+    RowQueue queue = { ymin * width, ylim * width };
+    mandelRefill(&queue);
+}
+
+static void mandelPixelsRefill(const Pixel* p, unsigned n) {
+    ListQueue queue = { p, 0, n };
+    mandelRefill(&queue);
+}
+
+// Double precision, for zooms where the pixels are too small for float: past
+// a zoom of about 10^4 neighbouring pixels get the same float coordinates, and
+// the image breaks up into blocks.  Half the lanes, with N vectors interleaved
+// as for mandelSIMD.  All lanes go around the loop the same number of times,
+// so the cutoff is applied to the trip count, and the counters count up.
+
+static inline v128_t inCardioidOrBulb2(v128_t x, v128_t y) {
+    v128_t x_q = wasm_f64x2_sub(x, wasm_f64x2_splat(0.25));
+    v128_t x_b = wasm_f64x2_add(x, wasm_f64x2_splat(1));
+    v128_t y_sq = wasm_f64x2_mul(y, y);
+    v128_t q = wasm_f64x2_add(wasm_f64x2_mul(x_q, x_q), y_sq);
+    v128_t cardioid = wasm_f64x2_le(wasm_f64x2_mul(q, wasm_f64x2_add(q, x_q)), wasm_f64x2_mul(wasm_f64x2_splat(0.25), y_sq));
+    v128_t bulb = wasm_f64x2_le(wasm_f64x2_add(wasm_f64x2_mul(x_b, x_b), y_sq), wasm_f64x2_splat(0.0625));
+    return wasm_v128_or(cardioid, bulb);
+}
+
+// Iteration counts (i64x2) of the points x0[j] + y0[j] i.  *trips, work[j] and
+// escape[j] (f64x2) are as for mandelSIMD.
+template<unsigned N>
+static inline void mandelSIMD64(const v128_t* x0, const v128_t* y0, v128_t* counts, unsigned* trips, v128_t* work,
+                                v128_t* escape) {
+    v128_t x[N], y[N], saved_x[N], saved_y[N], active[N], counter[N], in_set[N];
+    UNROLL
+    for ( unsigned j=0 ; j < N ; j++ ) {
+        x[j] = y[j] = saved_x[j] = saved_y[j] = escape[j] = wasm_f64x2_splat(0);
+        active[j] = wasm_i64x2_splat(-1);
+        counter[j] = wasm_i64x2_splat(0);
+        in_set[j] = wasm_i64x2_splat(0);
+        if (interior) {
+            in_set[j] = inCardioidOrBulb2(x0[j], y0[j]);
+            active[j] = wasm_v128_andnot(active[j], in_set[j]);
+        }
+    }
+    unsigned n = 0;
+    while (n < cutoff) {
+        v128_t x_sq[N], y_sq[N];
+        v128_t any = wasm_i64x2_splat(0);
+        UNROLL
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            x_sq[j] = wasm_f64x2_mul(x[j], x[j]);
+            y_sq[j] = wasm_f64x2_mul(y[j], y[j]);
+            v128_t sum_sq = wasm_f64x2_add(x_sq[j], y_sq[j]);
+            v128_t was = active[j];
+            active[j] = wasm_v128_and(active[j], wasm_f64x2_le(sum_sq, wasm_f64x2_splat(4)));
+            if (smooth)
+                escape[j] = wasm_v128_bitselect(sum_sq, escape[j], wasm_v128_andnot(was, active[j]));
+            any = wasm_v128_or(any, active[j]);
+        }
+        if (!wasm_i32x4_any_true(any))
+            break;
+        UNROLL
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            v128_t tmp = wasm_f64x2_add(wasm_f64x2_sub(x_sq[j], y_sq[j]), x0[j]);
+            v128_t xy = wasm_f64x2_mul(x[j], y[j]);
+            y[j] = wasm_f64x2_add(wasm_f64x2_add(xy, xy), y0[j]);
+            x[j] = tmp;
+            counter[j] = wasm_i64x2_sub(counter[j], active[j]);
+        }
+        ++n;
+        if (interior) {
+            UNROLL
+            for ( unsigned j=0 ; j < N ; j++ ) {
+                v128_t cycle = wasm_v128_and(active[j], wasm_v128_and(wasm_f64x2_eq(x[j], saved_x[j]), wasm_f64x2_eq(y[j], saved_y[j])));
+                in_set[j] = wasm_v128_or(in_set[j], cycle);
+                active[j] = wasm_v128_andnot(active[j], cycle);
+            }
+            if (checkpoint(n)) {
+                UNROLL
+                for ( unsigned j=0 ; j < N ; j++ ) {
+                    saved_x[j] = x[j];
+                    saved_y[j] = y[j];
+                }
+            }
+        }
+    }
+    *trips = n;
+    UNROLL
+    for ( unsigned j=0 ; j < N ; j++ ) {
+        work[j] = counter[j];
+        counts[j] = wasm_v128_bitselect(wasm_i64x2_splat(cutoff), counter[j], in_set[j]);
+    }
+}
+
+// Lanes past the end of the row are as for mandelRowsSIMD.
+template<unsigned N>
+static void mandelRowsSIMD64(unsigned ymin, unsigned ylim) {
+    uint64_t trips = 0;
+    uint64_t work = 0;
+    for ( unsigned Py=ymin ; Py < ylim; Py++ ) {
+        v128_t y0[N];
+        for ( unsigned j=0 ; j < N ; j++ )
+            y0[j] = wasm_f64x2_splat(yCoord64(Py));
+        unsigned* r = row(Py);
+        for ( unsigned Px=0 ; Px < width; Px+=2*N ) {
+            v128_t x0[N], counts[N], w[N], e[N];
+            for ( unsigned j=0 ; j < N ; j++ )
+                x0[j] = wasm_f64x2_make(xCoord64(Px + 2*j), xCoord64(Px + 2*j + 1));
+            unsigned t;
+            mandelSIMD64<N>(x0, y0, counts, &t, w, e);
+            trips += t;
+            for ( unsigned j=0 ; j < N ; j++ ) {
+                unsigned p = Px + 2*j;
+                r[p] = wasm_i64x2_extract_lane(counts[j], 0);
+                r[p+1] = wasm_i64x2_extract_lane(counts[j], 1);
+                if (smooth) {
+                    escapeRow(Py)[p] = wasm_f64x2_extract_lane(e[j], 0);
+                    escapeRow(Py)[p+1] = wasm_f64x2_extract_lane(e[j], 1);
+                }
+                if (p < width)
+                    work += wasm_i64x2_extract_lane(w[j], 0);
+                if (p+1 < width)
+                    work += wasm_i64x2_extract_lane(w[j], 1);
+            }
+        }
+    }
+    lane_trips += 2*N*trips;
+    lane_work += work;
+}
+
+// Lanes past the end of the list repeat the last pixel.
+template<unsigned N>
+static void mandelPixelsSIMD64(const Pixel* p, unsigned n) {
+    uint64_t trips = 0;
+    uint64_t work = 0;
+    for ( unsigned i=0 ; i < n ; i+=2*N ) {
+        v128_t x0[N], y0[N], counts[N], w[N], e[N];
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            const Pixel& a = p[i+2*j < n ? i+2*j : n-1];
+            const Pixel& b = p[i+2*j+1 < n ? i+2*j+1 : n-1];
+            x0[j] = wasm_f64x2_make(xCoord64(a.x), xCoord64(b.x));
+            y0[j] = wasm_f64x2_make(yCoord64(a.y), yCoord64(b.y));
+        }
+        unsigned t;
+        mandelSIMD64<N>(x0, y0, counts, &t, w, e);
+        trips += t;
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            unsigned k = i + 2*j;
+            if (k < n) {
+                row(p[k].y)[p[k].x] = wasm_i64x2_extract_lane(counts[j], 0);
+                if (smooth)
+                    escapeRow(p[k].y)[p[k].x] = wasm_f64x2_extract_lane(e[j], 0);
+                work += wasm_i64x2_extract_lane(w[j], 0);
+            }
+            if (k+1 < n) {
+                row(p[k+1].y)[p[k+1].x] = wasm_i64x2_extract_lane(counts[j], 1);
+                if (smooth)
+                    escapeRow(p[k+1].y)[p[k+1].x] = wasm_f64x2_extract_lane(e[j], 1);
+                work += wasm_i64x2_extract_lane(w[j], 1);
+            }
+        }
+    }
+    lane_trips += 2*N*trips;
+    lane_work += work;
+}
+
+// Perturbation, for zooms past about 10^13, where double runs out.  One
+// reference orbit Z_n is computed in double-double, and each pixel's orbit is
+// iterated in f64x2 as its difference z_n from the reference orbit,
+//
+//   z_{n+1} = (2 Z_n + z_n) z_n + dc
+//
+// where dc is the pixel's offset from the reference point.  Double holds the
+// differences well, but where Z_n + z_n comes close to zero they lose their
+// precision relative to the orbit and the pixel is glitched (Pauldelbrot's
+// test, |Z_n + z_n|^2 < PERTURB_GLITCH |Z_n|^2).  A pixel that outlives the
+// reference orbit is glitched too.  Glitched pixels are rebased on a new
+// reference, the glitched pixel that came closest to zero, and iterated again,
+// until none are left.  After PERTURB_REFERENCES new references in one pass
+// the rest keep the count at which they were found to be glitched.
+//
+// The references are made for the whole image and kept in a pool.  The rows
+// kernel leaves its glitched pixels for the end of the image, when they are
+// fixed together in one pass, so that neither the references nor their number
+// depend on how the rows were handed out.  The pixels kernel, for --subdivide,
+// needs its counts straight away and fixes its glitches itself, first with the
+// references already in the pool and then with new ones, so its references do
+// depend on the order the pixels come in.
+//
+// Errors in the reference orbit grow along it, and double-double is good to
+// zooms of about 10^20.  --interior does not apply, its tests need the full
+// precision of the point.
+
+#define PERTURB_GLITCH 1e-6
+#define PERTURB_REFERENCES 64
+
+# ifdef THREADS
+static std::atomic<uint64_t> perturb_glitches;
+static std::atomic<uint64_t> perturb_references;
+# else
+static uint64_t perturb_glitches;
+static uint64_t perturb_references;
+# endif
+
+struct Reference {
+    double px, py;                  // The reference point, in pixels
+    std::vector<double> x, y;       // Z_n in double, up to where it escapes
+    std::vector<double> tolerance;  // PERTURB_GLITCH |Z_n|^2
+};
+
+static void computeReference(double px, double py, Reference* ref) {
+    DD cx = center_x + dd((px - width / 2.0) * step);
+    DD cy = center_y + dd((py - height / 2.0) * step);
+    DD x = dd(0);
+    DD y = dd(0);
+    ref->px = px;
+    ref->py = py;
+    ref->x.clear();
+    ref->y.clear();
+    ref->tolerance.clear();
+    for ( unsigned n=0 ; n < cutoff ; n++ ) {
+        double mag = x.hi*x.hi + y.hi*y.hi;
+        ref->x.push_back(x.hi);
+        ref->y.push_back(y.hi);
+        ref->tolerance.push_back(PERTURB_GLITCH * mag);
+        if (mag > 4)
+            break;
+        DD tmp = x*x - y*y + cx;
+        y = dd(2)*x*y + cy;
+        x = tmp;
+    }
+}
+
+// Iteration counts (i64x2) of the pixels at dx[j] + dy[j] i from the reference
+// point.  The lanes set in glitched[j] are glitched, and for those mag[j] is
+// |Z_n + z_n|^2 when that was found.  *trips and escape[j] are as for
+// mandelSIMD64.
+template<unsigned N>
+static inline void mandelPerturb(const Reference& ref, const v128_t* dx, const v128_t* dy, v128_t* counts,
+                                 v128_t* glitched, v128_t* mag, unsigned* trips, v128_t* escape) {
+    v128_t x[N], y[N], active[N], full_mag[N];
+    UNROLL
+    for ( unsigned j=0 ; j < N ; j++ ) {
+        x[j] = y[j] = full_mag[j] = mag[j] = escape[j] = wasm_f64x2_splat(0);
+        active[j] = wasm_i64x2_splat(-1);
+        counts[j] = glitched[j] = wasm_i64x2_splat(0);
+    }
+    unsigned length = ref.x.size();
+    unsigned n = 0;
+    for ( ; n < cutoff ; n++ ) {
+        if (n == length) {
+            UNROLL
+            for ( unsigned j=0 ; j < N ; j++ ) {
+                glitched[j] = wasm_v128_or(glitched[j], active[j]);
+                mag[j] = wasm_v128_bitselect(full_mag[j], mag[j], active[j]);
+            }
+            break;
+        }
+        v128_t ref_x = wasm_f64x2_splat(ref.x[n]);
+        v128_t ref_y = wasm_f64x2_splat(ref.y[n]);
+        v128_t tolerance = wasm_f64x2_splat(ref.tolerance[n]);
+        v128_t any = wasm_i64x2_splat(0);
+        UNROLL
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            v128_t full_x = wasm_f64x2_add(ref_x, x[j]);
+            v128_t full_y = wasm_f64x2_add(ref_y, y[j]);
+            full_mag[j] = wasm_f64x2_add(wasm_f64x2_mul(full_x, full_x), wasm_f64x2_mul(full_y, full_y));
+            v128_t was = active[j];
+            active[j] = wasm_v128_and(active[j], wasm_f64x2_le(full_mag[j], wasm_f64x2_splat(4)));
+            if (smooth)
+                escape[j] = wasm_v128_bitselect(full_mag[j], escape[j], wasm_v128_andnot(was, active[j]));
+            v128_t glitch = wasm_v128_and(active[j], wasm_f64x2_lt(full_mag[j], tolerance));
+            glitched[j] = wasm_v128_or(glitched[j], glitch);
+            mag[j] = wasm_v128_bitselect(full_mag[j], mag[j], glitch);
+            active[j] = wasm_v128_andnot(active[j], glitch);
+            any = wasm_v128_or(any, active[j]);
+        }
+        if (!wasm_i32x4_any_true(any))
+            break;
+        v128_t ref_x2 = wasm_f64x2_add(ref_x, ref_x);
+        v128_t ref_y2 = wasm_f64x2_add(ref_y, ref_y);
+        UNROLL
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            v128_t tx = wasm_f64x2_add(ref_x2, x[j]);
+            v128_t ty = wasm_f64x2_add(ref_y2, y[j]);
+            v128_t tmp = wasm_f64x2_add(wasm_f64x2_sub(wasm_f64x2_mul(x[j], tx), wasm_f64x2_mul(y[j], ty)), dx[j]);
+            y[j] = wasm_f64x2_add(wasm_f64x2_add(wasm_f64x2_mul(x[j], ty), wasm_f64x2_mul(y[j], tx)), dy[j]);
+            x[j] = tmp;
+            counts[j] = wasm_i64x2_sub(counts[j], active[j]);
+        }
+    }
+    *trips = n;
+}
+
+struct Glitch {
+    Pixel p;
+    double mag;
+};
+
+// Two vectors are interleaved, as for SIMD-f64-x2.  Lanes past the end of the
+// list repeat the last pixel.
+static void perturbPixels(const Reference& ref, const Pixel* p, unsigned n, std::vector<Glitch>* glitches) {
+    const unsigned N = 2;
+    uint64_t trips = 0;
+    uint64_t work = 0;
+    for ( unsigned i=0 ; i < n ; i+=2*N ) {
+        v128_t dx[N], dy[N], counts[N], glitched[N], mag[N], e[N];
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            const Pixel& a = p[i+2*j < n ? i+2*j : n-1];
+            const Pixel& b = p[i+2*j+1 < n ? i+2*j+1 : n-1];
+            dx[j] = wasm_f64x2_make((a.x - ref.px) * step, (b.x - ref.px) * step);
+            dy[j] = wasm_f64x2_make((a.y - ref.py) * step, (b.y - ref.py) * step);
+        }
+        unsigned t;
+        mandelPerturb<N>(ref, dx, dy, counts, glitched, mag, &t, e);
+        trips += t;
+        alignas(16) int64_t c[2*N], g[2*N];
+        alignas(16) double m[2*N], esc[2*N];
+        for ( unsigned j=0 ; j < N ; j++ ) {
+            wasm_v128_store(c + 2*j, counts[j]);
+            wasm_v128_store(g + 2*j, glitched[j]);
+            wasm_v128_store(m + 2*j, mag[j]);
+            wasm_v128_store(esc + 2*j, e[j]);
+        }
+        for ( unsigned k=0 ; k < 2*N && i+k < n ; k++ ) {
+            row(p[i+k].y)[p[i+k].x] = unsigned(c[k]);
+            if (smooth)
+                escapeRow(p[i+k].y)[p[i+k].x] = esc[k];
+            work += c[k];
+            if (g[k]) {
+                Glitch glitch = { p[i+k], m[k] };
+                glitches->push_back(glitch);
+            }
+        }
+    }
+    lane_trips += 2*N*trips;
+    lane_work += work;
+}
+
+// The references of the image, and the glitched pixels left by the rows
+// kernel.  References are not changed once they are in the pool.
+static std::vector<Reference*> pool;
+static std::vector<Glitch> pending_glitches;
+# ifdef THREADS
+static std::mutex pool_lock;
+#  define POOL_LOCK std::lock_guard<std::mutex> guard(pool_lock)
+# else
+#  define POOL_LOCK
+# endif
+
+// The references in the pool.
+static std::vector<Reference*> poolReferences() {
+    POOL_LOCK;
+    return pool;
+}
+
+// A new reference at pixel (px, py), added to the pool.
+static Reference* addReference(double px, double py) {
+    Reference* ref = new Reference;
+    computeReference(px, py, ref);
+    POOL_LOCK;
+    pool.push_back(ref);
+    perturb_references++;
+    return ref;
+}
+
+// Rebase the glitched pixels until none are left.  The reference in the pool
+// nearest the glitched pixel that came closest to zero is tried first, and
+// once one of those fixes nothing a new reference is made at that pixel.
+static void fixGlitches(std::vector<Glitch>* glitches) {
+    std::vector<Pixel> pixels;
+    std::vector<Reference*> refs = poolReferences();
+    std::vector<bool> tried(refs.size());
+    unsigned references = 0;
+    bool reuse = true;
+    perturb_glitches += glitches->size();
+    while (!glitches->empty()) {
+        const Glitch* best = &(*glitches)[0];
+        for ( const Glitch& g : *glitches ) {
+            if (g.mag < best->mag)
+                best = &g;
+        }
+        Reference* ref = nullptr;
+        size_t nearest = 0;
+        double distance = INFINITY;
+        for ( size_t i=0 ; reuse && i < refs.size() ; i++ ) {
+            double dx = refs[i]->px - best->p.x, dy = refs[i]->py - best->p.y;
+            if (!tried[i] && dx*dx + dy*dy < distance) {
+                nearest = i;
+                distance = dx*dx + dy*dy;
+            }
+        }
+        if (distance < INFINITY) {
+            ref = refs[nearest];
+            tried[nearest] = true;
+        } else if (references < PERTURB_REFERENCES) {
+            ref = addReference(best->p.x, best->p.y);
+            references++;
+        } else {
+            break;
+        }
+        size_t before = glitches->size();
+        pixels.clear();
+        for ( const Glitch& g : *glitches )
+            pixels.push_back(g.p);
+        glitches->clear();
+        perturbPixels(*ref, pixels.data(), pixels.size(), glitches);
+        if (distance < INFINITY && glitches->size() == before)
+            reuse = false;
+    }
+}
+
+// The primary reference is the center of the view, computed once per image.
+static Reference primary;
+
+static void preparePerturb() {
+    computeReference(width / 2.0, height / 2.0, &primary);
+    for ( Reference* ref : pool )
+        delete ref;
+    pool.clear();
+    pending_glitches.clear();
+}
+
+static void finishPerturb() {
+    fixGlitches(&pending_glitches);
+}
+
+static void mandelRowsPerturb(unsigned ymin, unsigned ylim) {
+    std::vector<Pixel> pixels(width);
+    std::vector<Glitch> glitches;
+    for ( unsigned Py=ymin ; Py < ylim; Py++ ) {
+        for ( unsigned Px=0 ; Px < width; Px++ ) {
+            pixels[Px].y = Py;
+            pixels[Px].x = Px;
+        }
+        perturbPixels(primary, pixels.data(), width, &glitches);
+    }
+    POOL_LOCK;
+    pending_glitches.insert(pending_glitches.end(), glitches.begin(), glitches.end());
+}
+
+static void mandelPixelsPerturb(const Pixel* p, unsigned n) {
+    std::vector<Glitch> glitches;
+    perturbPixels(primary, p, n, &glitches);
+    fixGlitches(&glitches);
 }
 #endif
 
-#ifdef RUNTIME
-static uint64_t timestamp() {
-    struct timeval tp;
-    gettimeofday(&tp, nullptr);
-    return uint64_t(tp.tv_sec)*1000000 + tp.tv_usec;
+// *escape is set to |z|^2 at the end, which is where the point escaped if it did.
+static inline unsigned mandelScalar(float x0, float y0, float* escape) {
+    float x = 0;
+    float y = 0;
+    float saved_x = 0;
+    float saved_y = 0;
+    unsigned iteration = 0;
+    if (interior && inCardioidOrBulb(x0, y0))
+        iteration = cutoff;
+    while (x*x + y*y <= 4 && iteration < cutoff) {
+        float tmp = x*x - y*y + x0;
+        y = 2*x*y + y0;
+        x = tmp;
+        iteration++;
+        if (interior) {
+            if (x == saved_x && y == saved_y) {
+                iteration = cutoff;
+                break;
+            }
+            if (checkpoint(iteration)) {
+                saved_x = x;
+                saved_y = y;
+            }
+        }
+    }
+    *escape = x*x + y*y;
+    return iteration;
+}
+
+static void mandelRowsScalar(unsigned ymin, unsigned ylim) {
+    for ( unsigned Py=ymin ; Py < ylim; Py++ ) {
+        float y0 = yCoord(Py);
+        for ( unsigned Px=0 ; Px < width; Px++ ) {
+            float e;
+            row(Py)[Px] = mandelScalar(xCoord(Px), y0, &e);
+            if (smooth)
+                escapeRow(Py)[Px] = e;
+        }
+    }
+}
+
+static void mandelPixelsScalar(const Pixel* p, unsigned n) {
+    for ( unsigned i=0 ; i < n ; i++ ) {
+        float e;
+        row(p[i].y)[p[i].x] = mandelScalar(xCoord(p[i].x), yCoord(p[i].y), &e);
+        if (smooth)
+            escapeRow(p[i].y)[p[i].x] = e;
+    }
+}
+
+#ifdef X86_KERNELS
+// 8 and 16 lanes, written directly with the x86 intrinsics since simd.h is
+// 128-bit only.  The width need not be a multiple of the lane count, lanes past
+// the end of the row start out inactive and are not stored.
+//
+// Compile with -ffp-contract=off: AVX-512 implies FMA, and fused multiply-adds
+// would change the iteration counts relative to the other kernels.
+
+// Iteration counts of the points x0 + y0 i, in the lanes set in active.
+// *escape is as for mandelSIMD.
+__attribute__((target("avx2")))
+static inline __m256i mandelAVX2(__m256 x0, __m256 y0, __m256i active, __m256* escape) {
+    __m256 x = _mm256_setzero_ps();
+    __m256 y = _mm256_setzero_ps();
+    __m256 e = _mm256_setzero_ps();
+    __m256i counter = _mm256_set1_epi32(cutoff);
+    __m256 saved_x = x;
+    __m256 saved_y = y;
+    unsigned iteration = 0;
+    if (interior) {
+        __m256 x_q = _mm256_sub_ps(x0, _mm256_set1_ps(0.25f));
+        __m256 x_b = _mm256_add_ps(x0, _mm256_set1_ps(1));
+        __m256 y_sq = _mm256_mul_ps(y0, y0);
+        __m256 q = _mm256_add_ps(_mm256_mul_ps(x_q, x_q), y_sq);
+        __m256 cardioid = _mm256_cmp_ps(_mm256_mul_ps(q, _mm256_add_ps(q, x_q)), _mm256_mul_ps(_mm256_set1_ps(0.25f), y_sq), _CMP_LE_OQ);
+        __m256 bulb = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(x_b, x_b), y_sq), _mm256_set1_ps(0.0625f), _CMP_LE_OQ);
+        __m256i inside = _mm256_castps_si256(_mm256_or_ps(cardioid, bulb));
+        active = _mm256_andnot_si256(inside, active);
+        counter = _mm256_andnot_si256(inside, counter);
+    }
+    for(;;) {
+        __m256 x_sq = _mm256_mul_ps(x, x);
+        __m256 y_sq = _mm256_mul_ps(y, y);
+        __m256 sum_sq = _mm256_add_ps(x_sq, y_sq);
+        __m256i was = active;
+        active = _mm256_and_si256(active, _mm256_castps_si256(_mm256_cmp_ps(sum_sq, _mm256_set1_ps(4), _CMP_LE_OQ)));
+        active = _mm256_and_si256(active, _mm256_cmpgt_epi32(counter, _mm256_setzero_si256()));
+        if (smooth)
+            e = _mm256_blendv_ps(e, sum_sq, _mm256_castsi256_ps(_mm256_andnot_si256(active, was)));
+        if (_mm256_testz_si256(active, active))
+            break;
+        __m256 tmp = _mm256_add_ps(_mm256_sub_ps(x_sq, y_sq), x0);
+        __m256 xy = _mm256_mul_ps(x, y);
+        y = _mm256_add_ps(_mm256_add_ps(xy, xy), y0);
+        x = tmp;
+        counter = _mm256_add_epi32(counter, active);
+        if (interior) {
+            __m256 same = _mm256_and_ps(_mm256_cmp_ps(x, saved_x, _CMP_EQ_OQ), _mm256_cmp_ps(y, saved_y, _CMP_EQ_OQ));
+            counter = _mm256_andnot_si256(_mm256_and_si256(active, _mm256_castps_si256(same)), counter);
+            if (checkpoint(++iteration)) {
+                saved_x = x;
+                saved_y = y;
+            }
+        }
+    }
+    *escape = e;
+    return _mm256_sub_epi32(_mm256_set1_epi32(cutoff), counter);
+}
+
+__attribute__((target("avx2")))
+static void mandelRowsAVX2(unsigned ymin, unsigned ylim) {
+    for ( unsigned Py=ymin ; Py < ylim; Py++ ) {
+        __m256 y0 = _mm256_set1_ps(yCoord(Py));
+        for ( unsigned Px=0 ; Px < width; Px+=8 ) {
+            alignas(32) float xs[8];
+            alignas(32) int32_t valid[8];
+            for ( unsigned i=0 ; i < 8 ; i++ ) {
+                xs[i] = xCoord(Px+i);
+                valid[i] = Px+i < width ? -1 : 0;
+            }
+            __m256i store = _mm256_load_si256((const __m256i*)valid);
+            __m256 e;
+            __m256i counts = mandelAVX2(_mm256_load_ps(xs), y0, store, &e);
+            _mm256_maskstore_epi32((int*)(row(Py) + Px), store, counts);
+            if (smooth)
+                _mm256_maskstore_ps(escapeRow(Py) + Px, store, e);
+        }
+    }
+}
+
+// Lanes past the end of the list repeat the last pixel.
+__attribute__((target("avx2")))
+static void mandelPixelsAVX2(const Pixel* p, unsigned n) {
+    for ( unsigned i=0 ; i < n ; i+=8 ) {
+        alignas(32) float xs[8];
+        alignas(32) float ys[8];
+        alignas(32) unsigned counts[8];
+        alignas(32) float mags[8];
+        for ( unsigned j=0 ; j < 8 ; j++ ) {
+            const Pixel& q = p[i+j < n ? i+j : n-1];
+            xs[j] = xCoord(q.x);
+            ys[j] = yCoord(q.y);
+        }
+        __m256 e;
+        _mm256_store_si256((__m256i*)counts, mandelAVX2(_mm256_load_ps(xs), _mm256_load_ps(ys), _mm256_set1_epi32(-1), &e));
+        _mm256_store_ps(mags, e);
+        for ( unsigned j=0 ; j < 8 && i+j < n ; j++ ) {
+            row(p[i+j].y)[p[i+j].x] = counts[j];
+            if (smooth)
+                escapeRow(p[i+j].y)[p[i+j].x] = mags[j];
+        }
+    }
+}
+
+// Iteration counts of the points x0 + y0 i, in the lanes set in active.
+// *escape is as for mandelSIMD.
+__attribute__((target("avx512f")))
+static inline __m512i mandelAVX512(__m512 x0, __m512 y0, __mmask16 active, __m512* escape) {
+    __m512 x = _mm512_setzero_ps();
+    __m512 y = _mm512_setzero_ps();
+    __m512 e = _mm512_setzero_ps();
+    __m512i counter = _mm512_set1_epi32(cutoff);
+    __m512 saved_x = x;
+    __m512 saved_y = y;
+    unsigned iteration = 0;
+    if (interior) {
+        __m512 x_q = _mm512_sub_ps(x0, _mm512_set1_ps(0.25f));
+        __m512 x_b = _mm512_add_ps(x0, _mm512_set1_ps(1));
+        __m512 y_sq = _mm512_mul_ps(y0, y0);
+        __m512 q = _mm512_add_ps(_mm512_mul_ps(x_q, x_q), y_sq);
+        __mmask16 inside = _mm512_cmp_ps_mask(_mm512_mul_ps(q, _mm512_add_ps(q, x_q)), _mm512_mul_ps(_mm512_set1_ps(0.25f), y_sq), _CMP_LE_OQ) |
+                           _mm512_cmp_ps_mask(_mm512_add_ps(_mm512_mul_ps(x_b, x_b), y_sq), _mm512_set1_ps(0.0625f), _CMP_LE_OQ);
+        active &= ~inside;
+        counter = _mm512_mask_mov_epi32(counter, inside, _mm512_setzero_si512());
+    }
+    for(;;) {
+        __m512 x_sq = _mm512_mul_ps(x, x);
+        __m512 y_sq = _mm512_mul_ps(y, y);
+        __m512 sum_sq = _mm512_add_ps(x_sq, y_sq);
+        __mmask16 was = active;
+        active &= _mm512_cmp_ps_mask(sum_sq, _mm512_set1_ps(4), _CMP_LE_OQ);
+        active &= _mm512_cmpgt_epi32_mask(counter, _mm512_setzero_si512());
+        if (smooth)
+            e = _mm512_mask_mov_ps(e, was & ~active, sum_sq);
+        if (!active)
+            break;
+        __m512 tmp = _mm512_add_ps(_mm512_sub_ps(x_sq, y_sq), x0);
+        __m512 xy = _mm512_mul_ps(x, y);
+        y = _mm512_add_ps(_mm512_add_ps(xy, xy), y0);
+        x = tmp;
+        counter = _mm512_mask_sub_epi32(counter, active, counter, _mm512_set1_epi32(1));
+        if (interior) {
+            __mmask16 cycle = active & _mm512_cmp_ps_mask(x, saved_x, _CMP_EQ_OQ) & _mm512_cmp_ps_mask(y, saved_y, _CMP_EQ_OQ);
+            counter = _mm512_mask_mov_epi32(counter, cycle, _mm512_setzero_si512());
+            if (checkpoint(++iteration)) {
+                saved_x = x;
+                saved_y = y;
+            }
+        }
+    }
+    *escape = e;
+    return _mm512_sub_epi32(_mm512_set1_epi32(cutoff), counter);
+}
+
+__attribute__((target("avx512f")))
+static void mandelRowsAVX512(unsigned ymin, unsigned ylim) {
+    for ( unsigned Py=ymin ; Py < ylim; Py++ ) {
+        __m512 y0 = _mm512_set1_ps(yCoord(Py));
+        for ( unsigned Px=0 ; Px < width; Px+=16 ) {
+            alignas(64) float xs[16];
+            for ( unsigned i=0 ; i < 16 ; i++ )
+                xs[i] = xCoord(Px+i);
+            __mmask16 store = width-Px >= 16 ? 0xFFFF : (1 << (width-Px)) - 1;
+            __m512 e;
+            __m512i counts = mandelAVX512(_mm512_load_ps(xs), y0, store, &e);
+            _mm512_mask_storeu_epi32(row(Py) + Px, store, counts);
+            if (smooth)
+                _mm512_mask_storeu_ps(escapeRow(Py) + Px, store, e);
+        }
+    }
+}
+
+// Lanes past the end of the list repeat the last pixel.
+__attribute__((target("avx512f")))
+static void mandelPixelsAVX512(const Pixel* p, unsigned n) {
+    for ( unsigned i=0 ; i < n ; i+=16 ) {
+        alignas(64) float xs[16];
+        alignas(64) float ys[16];
+        alignas(64) unsigned counts[16];
+        alignas(64) float mags[16];
+        for ( unsigned j=0 ; j < 16 ; j++ ) {
+            const Pixel& q = p[i+j < n ? i+j : n-1];
+            xs[j] = xCoord(q.x);
+            ys[j] = yCoord(q.y);
+        }
+        __m512 e;
+        _mm512_store_si512(counts, mandelAVX512(_mm512_load_ps(xs), _mm512_load_ps(ys), 0xFFFF, &e));
+        _mm512_store_ps(mags, e);
+        for ( unsigned j=0 ; j < 16 && i+j < n ; j++ ) {
+            row(p[i+j].y)[p[i+j].x] = counts[j];
+            if (smooth)
+                escapeRow(p[i+j].y)[p[i+j].x] = mags[j];
+        }
+    }
+}
+
+static bool hasAVX2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool hasAVX512() {
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+// Kernel dispatch table, best first.  The first kernel supported by the CPU is
+// used unless one is named on the command line.
+
+static bool always() {
+    return true;
+}
+
+struct Kernel {
+    const char* name;
+    unsigned lanes;
+    bool (*supported)();
+    void (*rows)(unsigned ymin, unsigned ylim);
+    void (*pixels)(const Pixel* p, unsigned n);
+    const char* baseline;       // Kernel to compare against, if any
+    void (*prepare)();          // Called before each image, if not null
+    void (*finish)();           // Called after each image, if not null
+};
+
+static const Kernel kernels[] = {
+#ifdef X86_KERNELS
+    { "AVX512",       16, hasAVX512, mandelRowsAVX512,    mandelPixelsAVX512,    nullptr,    nullptr,        nullptr },
+    { "AVX2",          8, hasAVX2,   mandelRowsAVX2,      mandelPixelsAVX2,      nullptr,    nullptr,        nullptr },
+#endif
+#ifdef USE_SIMD
+    { "SIMD",          4, always,    mandelRowsSIMD<1>,   mandelPixelsSIMD<1>,   nullptr,    nullptr,        nullptr },
+    { "SIMD-x2",       8, always,    mandelRowsSIMD<2>,   mandelPixelsSIMD<2>,   "SIMD",     nullptr,        nullptr },
+    { "SIMD-x4",      16, always,    mandelRowsSIMD<4>,   mandelPixelsSIMD<4>,   "SIMD",     nullptr,        nullptr },
+    { "SIMD-refill",   4, always,    mandelRowsRefill,    mandelPixelsRefill,    "SIMD",     nullptr,        nullptr },
+    { "SIMD-f64",      2, always,    mandelRowsSIMD64<1>, mandelPixelsSIMD64<1>, "SIMD",     nullptr,        nullptr },
+    { "SIMD-f64-x2",   4, always,    mandelRowsSIMD64<2>, mandelPixelsSIMD64<2>, "SIMD-f64", nullptr,        nullptr },
+    { "SIMD-perturb",  4, always,    mandelRowsPerturb,   mandelPixelsPerturb,   "SIMD-f64", preparePerturb, finishPerturb },
+#endif
+    { "scalar",        1, always,    mandelRowsScalar,    mandelPixelsScalar,    nullptr,    nullptr,        nullptr },
+};
+
+static const Kernel* kernel;
+
+// The named kernel, or the best one if name is null, if the CPU supports it.
+static const Kernel* findKernel(const char* name) {
+    for ( const Kernel& k : kernels ) {
+        if ((!name || !strcmp(name, k.name)) && k.supported())
+            return &k;
+    }
+    return nullptr;
+}
+
+static void selectKernel(const char* name) {
+    kernel = findKernel(name);
+    if (kernel)
+        return;
+    printf("Kernel not available: %s\nAvailable:", name);
+    for ( const Kernel& k : kernels ) {
+        if (k.supported())
+            printf(" %s", k.name);
+    }
+    printf("\n");
+    exit(1);
+}
+
+// Mariani-Silver subdivision, with --subdivide.  The border of a rectangle is
+// computed first, and if all of it has the same iteration count then so has
+// the inside, which is filled in without being computed.  Otherwise the
+// rectangle is split in two across its longer side, and the halves, which
+// share the pixels on the split line, are done the same way.  The border
+// pixels go to the kernel together, so that its lanes are used.
+//
+// This is exact for the set itself, which is connected and has no holes, but
+// elsewhere a feature that is smaller than a rectangle and does not touch its
+// border can be lost; as for --interior the image is checked against the
+// brute-force one.
+
+static bool subdivide = false;
+
+// The image is subdivided in bands of this many rows, which are also what the
+// threads take at a time.  Rectangles this small in either direction are
+// computed outright.
+#define SUBDIVIDE_ROWS 100
+#define SUBDIVIDE_MIN 6
+
+static const unsigned UNKNOWN = ~0u;
+
+struct Subdivision {
+    std::vector<Pixel> pending;     // Pixels to compute
+    unsigned computed;              // Pixels computed so far
+};
+
+static inline void addUnknown(Subdivision* sub, unsigned y, unsigned x) {
+    if (row(y)[x] == UNKNOWN) {
+        Pixel p = { uint16_t(y), uint16_t(x) };
+        sub->pending.push_back(p);
+    }
+}
+
+static void computePending(Subdivision* sub) {
+    if (sub->pending.empty())
+        return;
+    kernel->pixels(sub->pending.data(), sub->pending.size());
+    sub->computed += sub->pending.size();
+    sub->pending.clear();
+}
+
+static void subdivideRect(unsigned ymin, unsigned ylim, unsigned xmin, unsigned xlim, Subdivision* sub) {
+    unsigned h = ylim - ymin;
+    unsigned w = xlim - xmin;
+    if (h <= SUBDIVIDE_MIN || w <= SUBDIVIDE_MIN) {
+        for ( unsigned y=ymin ; y < ylim ; y++ ) {
+            for ( unsigned x=xmin ; x < xlim ; x++ )
+                addUnknown(sub, y, x);
+        }
+        computePending(sub);
+        return;
+    }
+
+    for ( unsigned x=xmin ; x < xlim ; x++ ) {
+        addUnknown(sub, ymin, x);
+        addUnknown(sub, ylim-1, x);
+    }
+    for ( unsigned y=ymin+1 ; y < ylim-1 ; y++ ) {
+        addUnknown(sub, y, xmin);
+        addUnknown(sub, y, xlim-1);
+    }
+    computePending(sub);
+
+    unsigned c = row(ymin)[xmin];
+    bool same = true;
+    for ( unsigned x=xmin ; x < xlim && same ; x++ )
+        same = row(ymin)[x] == c && row(ylim-1)[x] == c;
+    for ( unsigned y=ymin+1 ; y < ylim-1 && same ; y++ )
+        same = row(y)[xmin] == c && row(y)[xlim-1] == c;
+    // With --smooth the colour of a pixel outside the set depends on where its
+    // orbit escaped and not just on its count, so only the set is filled in
+    if (same && (!smooth || c == cutoff)) {
+        for ( unsigned y=ymin+1 ; y < ylim-1 ; y++ ) {
+            for ( unsigned x=xmin+1 ; x < xlim-1 ; x++ )
+                row(y)[x] = c;
+        }
+        return;
+    }
+
+    if (w >= h) {
+        unsigned mid = xmin + w/2;
+        subdivideRect(ymin, ylim, xmin, mid+1, sub);
+        subdivideRect(ymin, ylim, mid, xlim, sub);
+    } else {
+        unsigned mid = ymin + h/2;
+        subdivideRect(ymin, mid+1, xmin, xlim, sub);
+        subdivideRect(mid, ylim, xmin, xlim, sub);
+    }
+}
+
+// Compute rows [ymin, ylim) with the kernel, or by subdivision.
+static void renderRows(unsigned ymin, unsigned ylim, Subdivision* sub) {
+    if (!subdivide) {
+        kernel->rows(ymin, ylim);
+        sub->computed += (ylim - ymin) * width;
+        return;
+    }
+    for ( unsigned y=ymin ; y < ylim ; y+=SUBDIVIDE_ROWS ) {
+        unsigned band_lim = y + SUBDIVIDE_ROWS < ylim ? y + SUBDIVIDE_ROWS : ylim;
+        // The escape values are cleared so that any not computed show up
+        // when the image is checked
+        for ( unsigned i=y ; i < band_lim ; i++ ) {
+            for ( unsigned x=0 ; x < width ; x++ ) {
+                row(i)[x] = UNKNOWN;
+                if (smooth)
+                    escapeRow(i)[x] = 0;
+            }
+        }
+        subdivideRect(y, band_lim, 0, width, sub);
+    }
+}
+
+#ifdef THREADS
+// Rows are handed out CHUNK_ROWS at a time from a shared counter, so a thread
+// that gets cheap rows (outside the set) just takes more of them.  Each thread
+// records how long it spent computing and how many rows it did.
+
+struct ThreadStats {
+    uint64_t busy;              // Microseconds
+    unsigned rows;
+    unsigned computed;          // Pixels computed rather than filled in
+};
+
+static std::atomic<unsigned> next_row;
+
+static void mandelWorker(ThreadStats* stats) {
+    // With subdivision a chunk is a band, so the result does not depend on the
+    // number of threads
+    unsigned chunk = subdivide ? SUBDIVIDE_ROWS : CHUNK_ROWS;
+    Subdivision sub;
+    sub.computed = 0;
+    stats->busy = 0;
+    stats->rows = 0;
+    for (;;) {
+        unsigned ymin = next_row.fetch_add(chunk);
+        if (ymin >= height)
+            break;
+        unsigned ylim = ymin + chunk < height ? ymin + chunk : height;
+        uint64_t then = timestamp();
+        renderRows(ymin, ylim, &sub);
+        stats->busy += timestamp() - then;
+        stats->rows += ylim - ymin;
+    }
+    stats->computed = sub.computed;
+}
+
+static unsigned numThreads() {
+    unsigned n = NTHREADS ? NTHREADS : std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Returns the number of pixels computed.
+static unsigned mandel(std::vector<ThreadStats>& stats) {
+    if (kernel->prepare)
+        kernel->prepare();
+    next_row = 0;
+    std::vector<std::thread> threads;
+    for ( unsigned i=1 ; i < stats.size() ; i++ )
+        threads.push_back(std::thread(mandelWorker, &stats[i]));
+    mandelWorker(&stats[0]);
+    for ( std::thread& t : threads )
+        t.join();
+    if (kernel->finish)
+        kernel->finish();
+    unsigned computed = 0;
+    for ( const ThreadStats& s : stats )
+        computed += s.computed;
+    return computed;
+}
+#else
+// Returns the number of pixels computed.
+static unsigned mandel() {
+    if (kernel->prepare)
+        kernel->prepare();
+    Subdivision sub;
+    sub.computed = 0;
+    renderRows(0, height, &sub);
+    if (kernel->finish)
+        kernel->finish();
+    return sub.computed;
 }
 #endif
 
-#if defined(SDL_BROWSER) || defined(PPMX_STDOUT)
+// Colouring, into packed RGB rows of width pixels.  Points in the set are
+// black, and the others take their colour from a palette of 16 by their
+// iteration count n.  With --smooth the count is made continuous by how far
+// past the escape radius the orbit got,
+//
+//   nu = n + 1 - log2(log2 |z_n|) = n + 2 - log2(log2 |z_n|^2)
+//
+// which goes from n+1 to n as |z_n| goes from 2 to 4, and the colour is
+// interpolated between the entries on either side of nu.  That takes away the
+// bands of the plain palette.
+//
 // Supposedly the gradients used by the Wikipedia mandelbrot page
 
 #define C(r,g,b) ((r << 16) | (g << 8) | b)
 #define R(rgb) (rgb >> 16)
-#define G(rgb) ((rgb >> 8) & 255);
+#define G(rgb) ((rgb >> 8) & 255)
 #define B(rgb) (rgb & 255)
 
 static int32_t mapping[16] = {
@@ -113,61 +1595,530 @@ static int32_t mapping[16] = {
     C(153, 87, 0),
     C(106, 52, 3)
 };
+
+// log2 x for x a positive normal float: the exponent plus a polynomial in the
+// mantissa, good to about 1e-4 and continuous across powers of two.  The SIMD
+// colouring uses the same arithmetic, so that the two give the same image.
+static inline float fastLog2(float x) {
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int32_t mbits = (bits & 0x7FFFFF) | 0x3F800000;
+    float m;
+    memcpy(&m, &mbits, sizeof(m));
+    float f = m - 1;
+    float e = float((bits >> 23) - 127);
+    return e + f*(1.43837933f + f*(-0.675880655f + f*(0.318154484f + f*-0.0806531585f)));
+}
+
+// The continuous count of a pixel that escaped with |z|^2 = mag.  Anything that
+// was not caught at escape (mag up to 4) is taken to be at the radius.
+static inline float smoothCount(unsigned n, float mag) {
+    float nu = float(n) + (2 - fastLog2(fastLog2(mag > 4 ? mag : 4)));
+    return nu > 0 ? nu : 0;
+}
+
+static inline void colourPixel(unsigned y, unsigned x, uint8_t* rgb) {
+    unsigned n = row(y)[x];
+    uint8_t r = 0, g = 0, b = 0;
+    if (n < cutoff && !smooth) {
+        r = R(mapping[n % 16]);
+        g = G(mapping[n % 16]);
+        b = B(mapping[n % 16]);
+    } else if (n < cutoff) {
+        float nu = smoothCount(n, escapeRow(y)[x]);
+        unsigned i = unsigned(nu);
+        float t = nu - float(i);
+        int32_t c0 = mapping[i % 16], c1 = mapping[(i + 1) % 16];
+        r = uint8_t(float(R(c0)) + (float(R(c1)) - float(R(c0))) * t + 0.5f);
+        g = uint8_t(float(G(c0)) + (float(G(c1)) - float(G(c0))) * t + 0.5f);
+        b = uint8_t(float(B(c0)) + (float(B(c1)) - float(B(c0))) * t + 0.5f);
+    }
+    rgb[0] = r;
+    rgb[1] = g;
+    rgb[2] = b;
+}
+
+#ifdef USE_SIMD
+// 16 pixels at a time.  The palette is looked up a channel at a time with a
+// swizzle, so there is no gather, and the channels, as bytes, are interleaved
+// into 48 bytes of RGB with more swizzles.  A swizzle index with the high bit
+// set looks up zero, which is how pixels in the set become black.
+
+struct ColourTables {
+    v128_t palette[3];          // Channel c of entry i in byte i
+    v128_t interleave[3][3];    // Output vector, channel
+};
+
+static void colourTables(ColourTables* tables) {
+    alignas(16) uint8_t bytes[16];
+    for ( unsigned c=0 ; c < 3 ; c++ ) {
+        for ( unsigned i=0 ; i < 16 ; i++ )
+            bytes[i] = (mapping[i] >> (16 - 8*c)) & 255;
+        tables->palette[c] = wasm_v128_load(bytes);
+    }
+    for ( unsigned v=0 ; v < 3 ; v++ ) {
+        for ( unsigned c=0 ; c < 3 ; c++ ) {
+            for ( unsigned i=0 ; i < 16 ; i++ ) {
+                unsigned k = 16*v + i;
+                bytes[i] = k % 3 == c ? k / 3 : 0x80;
+            }
+            tables->interleave[v][c] = wasm_v128_load(bytes);
+        }
+    }
+}
+
+static inline v128_t fastLog2x4(v128_t x) {
+    v128_t m = wasm_v128_or(wasm_v128_and(x, wasm_i32x4_splat(0x7FFFFF)), wasm_i32x4_splat(0x3F800000));
+    v128_t f = wasm_f32x4_sub(m, wasm_f32x4_splat(1));
+    v128_t e = wasm_f32x4_convert_i32x4(wasm_i32x4_sub(wasm_i32x4_shr(x, 23), wasm_i32x4_splat(127)));
+    v128_t p = wasm_f32x4_add(wasm_f32x4_splat(0.318154484f), wasm_f32x4_mul(f, wasm_f32x4_splat(-0.0806531585f)));
+    p = wasm_f32x4_add(wasm_f32x4_splat(-0.675880655f), wasm_f32x4_mul(f, p));
+    p = wasm_f32x4_add(wasm_f32x4_splat(1.43837933f), wasm_f32x4_mul(f, p));
+    return wasm_f32x4_add(e, wasm_f32x4_mul(f, p));
+}
+
+// Channel c of the smooth colour of 4 pixels, as i32x4, given the palette
+// indices on either side of nu as swizzle indices and the fraction between.
+static inline v128_t smoothChannel(const ColourTables& tables, unsigned c, v128_t i0, v128_t i1, v128_t t) {
+    v128_t c0 = wasm_f32x4_convert_i32x4(wasm_v8x16_swizzle(tables.palette[c], i0));
+    v128_t c1 = wasm_f32x4_convert_i32x4(wasm_v8x16_swizzle(tables.palette[c], i1));
+    v128_t v = wasm_f32x4_add(wasm_f32x4_add(c0, wasm_f32x4_mul(wasm_f32x4_sub(c1, c0), t)), wasm_f32x4_splat(0.5f));
+    return wasm_i32x4_trunc_saturate_f32x4(v);
+}
+
+// The 16 pixels at counts (and mags) to 48 bytes at rgb.
+static inline void colour16(const ColourTables& tables, const unsigned* counts, const float* mags, uint8_t* rgb) {
+    v128_t limit = wasm_i32x4_splat(cutoff - 1);
+    v128_t channel[3];
+    if (!smooth) {
+        v128_t index[4];
+        UNROLL
+        for ( unsigned k=0 ; k < 4 ; k++ ) {
+            v128_t n = wasm_v128_load(counts + 4*k);
+            index[k] = wasm_v128_bitselect(wasm_i32x4_splat(0x80), wasm_v128_and(n, wasm_i32x4_splat(15)),
+                                           wasm_i32x4_gt(n, limit));
+        }
+        v128_t bytes = wasm_u8x16_narrow_i16x8(wasm_i16x8_narrow_i32x4(index[0], index[1]),
+                                               wasm_i16x8_narrow_i32x4(index[2], index[3]));
+        for ( unsigned c=0 ; c < 3 ; c++ )
+            channel[c] = wasm_v8x16_swizzle(tables.palette[c], bytes);
+    } else {
+        // Indices are looked up per i32 lane, with the high bit set in the
+        // upper three bytes so that the lane gets just the entry
+        v128_t lanes[3][4];
+        UNROLL
+        for ( unsigned k=0 ; k < 4 ; k++ ) {
+            v128_t n = wasm_v128_load(counts + 4*k);
+            v128_t mag = wasm_f32x4_max(wasm_v128_load(mags + 4*k), wasm_f32x4_splat(4));
+            v128_t nu = wasm_f32x4_add(wasm_f32x4_convert_i32x4(n),
+                                       wasm_f32x4_sub(wasm_f32x4_splat(2), fastLog2x4(fastLog2x4(mag))));
+            nu = wasm_f32x4_max(nu, wasm_f32x4_splat(0));
+            v128_t i = wasm_i32x4_trunc_saturate_f32x4(nu);
+            v128_t t = wasm_f32x4_sub(nu, wasm_f32x4_convert_i32x4(i));
+            v128_t in_set = wasm_i32x4_gt(n, limit);
+            v128_t high = wasm_i32x4_splat(0x80808000);
+            v128_t i0 = wasm_v128_or(wasm_v128_or(wasm_v128_and(i, wasm_i32x4_splat(15)), high), in_set);
+            v128_t i1 = wasm_v128_or(wasm_v128_or(wasm_v128_and(wasm_i32x4_add(i, wasm_i32x4_splat(1)), wasm_i32x4_splat(15)), high), in_set);
+            UNROLL
+            for ( unsigned c=0 ; c < 3 ; c++ )
+                lanes[c][k] = smoothChannel(tables, c, i0, i1, t);
+        }
+        for ( unsigned c=0 ; c < 3 ; c++ ) {
+            channel[c] = wasm_u8x16_narrow_i16x8(wasm_i16x8_narrow_i32x4(lanes[c][0], lanes[c][1]),
+                                                 wasm_i16x8_narrow_i32x4(lanes[c][2], lanes[c][3]));
+        }
+    }
+    for ( unsigned v=0 ; v < 3 ; v++ ) {
+        v128_t out = wasm_v128_or(wasm_v128_or(wasm_v8x16_swizzle(channel[0], tables.interleave[v][0]),
+                                               wasm_v8x16_swizzle(channel[1], tables.interleave[v][1])),
+                                  wasm_v8x16_swizzle(channel[2], tables.interleave[v][2]));
+        wasm_v128_store(rgb + 16*v, out);
+    }
+}
+
+#endif
+
+// Without USE_SIMD, or with scalar set, a pixel at a time; otherwise 16 at a
+// time, and the last few of each row a pixel at a time.
+static void colour(uint8_t* rgb, bool scalar) {
+#ifdef USE_SIMD
+    ColourTables tables;
+    colourTables(&tables);
+#else
+    (void)scalar;
+#endif
+    for ( unsigned y=0 ; y < height ; y++ ) {
+        unsigned x = 0;
+#ifdef USE_SIMD
+        for ( ; !scalar && x + 16 <= width ; x += 16, rgb += 48 )
+            colour16(tables, row(y) + x, smooth ? escapeRow(y) + x : nullptr, rgb);
 #endif
+        for ( ; x < width ; x++, rgb += 3 )
+            colourPixel(y, x, rgb);
+    }
+}
+
+#if defined(RUNTIME) || defined(BENCH)
+// The lane utilisation of the 128-bit kernels since the last call, or 0 if
+// none has run.
+static double laneUtilisation() {
+# ifdef USE_SIMD
+    double u = lane_trips ? double(lane_work) / double(lane_trips) : 0;
+    lane_trips = 0;
+    lane_work = 0;
+    return u;
+# else
+    return 0;
+# endif
+}
+
+// The image, to check another rendering against: the iteration counts without
+// the padding, and with --smooth the colours, which also depend on where each
+// orbit escaped.
+struct Snapshot {
+    std::vector<unsigned> counts;
+    std::vector<uint8_t> colours;
+};
+
+static Snapshot snapshot() {
+    Snapshot s;
+    s.counts.reserve(size_t(width) * height);
+    for ( unsigned y=0 ; y < height ; y++ )
+        s.counts.insert(s.counts.end(), row(y), row(y) + width);
+    if (smooth) {
+        s.colours.resize(size_t(width) * height * 3);
+        colour(s.colours.data(), false);
+    }
+    return s;
+}
+
+#ifdef RUNTIME
+// Pixels found glitched by the perturbation kernel, and the references made for
+// them, since the last call.
+static void glitchStats(uint64_t* glitches, uint64_t* references) {
+# ifdef USE_SIMD
+    *glitches = perturb_glitches;
+    *references = perturb_references;
+    perturb_glitches = 0;
+    perturb_references = 0;
+# else
+    *glitches = *references = 0;
+# endif
+}
+#endif
+
+// Pixels whose iteration count, or with --smooth colour, differs from
+// reference.
+static unsigned differing(const Snapshot& reference) {
+    Snapshot image = snapshot();
+    unsigned n = 0;
+    for ( size_t i=0 ; i < image.counts.size() ; i++ ) {
+        n += image.counts[i] != reference.counts[i] ||
+             (smooth && memcmp(&image.colours[3*i], &reference.colours[3*i], 3) != 0);
+    }
+    return n;
+}
+#endif
+
+
+// Command line: options and then optionally the kernel name, eg
+//
+//   mandel --zoom=1e5 --center-x=-0.743643887 --center-y=0.131825904 --cutoff=20000 SIMD-f64
+
+static void usage(const char* prog) {
+    printf("Usage: %s [option ...] [kernel]\n"
+           "  --width=n          image width (default %u)\n"
+           "  --height=n         image height (default %u)\n"
+           "  --cutoff=n         iterations after which a point is taken to be in the set (default %u)\n"
+           "  --center-x=x       real part of the center of the view (default %g)\n"
+           "  --center-y=y       imaginary part of the center of the view (default %g)\n"
+           "  --zoom=z           magnification relative to the classical view (default 1)\n"
+           "  --interior         skip the cardioid and the period-2 bulb, stop periodic orbits\n"
+           "  --subdivide        fill in rectangles with uniform borders (Mariani-Silver)\n"
+           "  --smooth           colour continuously rather than in bands of the iteration count\n"
+           "Kernels:",
+           prog, unsigned(WIDTH), unsigned(HEIGHT), unsigned(CUTOFF), (MINX + MAXX) / 2.0, (MINY + MAXY) / 2.0);
+    for ( const Kernel& k : kernels ) {
+        if (k.supported())
+            printf(" %s", k.name);
+    }
+    printf("\n");
+    exit(1);
+}
+
+// If arg is --name=value, parse value into *v, which must be in [min, max].
+static bool option(const char* prog, const char* arg, const char* name, unsigned min, unsigned max, unsigned* v) {
+    size_t len = strlen(name);
+    if (strncmp(arg, "--", 2) != 0 || strncmp(arg+2, name, len) != 0 || arg[2+len] != '=')
+        return false;
+    const char* s = arg + 3 + len;
+    char* end;
+    unsigned long n = strtoul(s, &end, 10);
+    if (*s < '0' || *s > '9' || *end != 0 || n < min || n > max) {
+        printf("Bad value for --%s: %s\n", name, s);
+        usage(prog);
+    }
+    *v = unsigned(n);
+    return true;
+}
+
+static bool option(const char* prog, const char* arg, const char* name, DD* v) {
+    size_t len = strlen(name);
+    if (strncmp(arg, "--", 2) != 0 || strncmp(arg+2, name, len) != 0 || arg[2+len] != '=')
+        return false;
+    const char* s = arg + 3 + len;
+    if (!parseDD(s, v) || !std::isfinite(v->hi)) {
+        printf("Bad value for --%s: %s\n", name, s);
+        usage(prog);
+    }
+    return true;
+}
+
+static bool option(const char* prog, const char* arg, const char* name, double* v) {
+    DD d;
+    if (!option(prog, arg, name, &d))
+        return false;
+    *v = d.hi;
+    return true;
+}
 
 int main(int argc, char** argv) {
+    const char* name = nullptr;
+    for ( int i=1 ; i < argc ; i++ ) {
+        const char* a = argv[i];
+        if (!strcmp(a, "--help"))
+            usage(argv[0]);
+        else if (!strcmp(a, "--interior"))
+            interior = true;
+        else if (!strcmp(a, "--subdivide"))
+            subdivide = true;
+        else if (!strcmp(a, "--smooth"))
+            smooth = true;
+        else if (strncmp(a, "--", 2))
+            name = a;
+        // Pixel coordinates are 16 bits
+        else if (!option(argv[0], a, "width", 1, 65535, &width) &&
+                 !option(argv[0], a, "height", 1, 65535, &height) &&
+                 !option(argv[0], a, "cutoff", 1, INT32_MAX, &cutoff) &&
+                 !option(argv[0], a, "center-x", &center_x) &&
+                 !option(argv[0], a, "center-y", &center_y) &&
+                 !option(argv[0], a, "zoom", &zoom)) {
+            printf("Unknown option: %s\n", a);
+            usage(argv[0]);
+        }
+    }
+    if (zoom <= 0) {
+        printf("Bad value for --zoom: %g\n", zoom);
+        usage(argv[0]);
+    }
+    selectKernel(name);
+    setView();
+    allocateIterations();
+
+#ifdef THREADS
+    std::vector<ThreadStats> stats(numThreads());
+    unsigned nthreads = stats.size();
+    auto run = [&] { return mandel(stats); };
+#else
+    unsigned nthreads = 1;
+    auto run = [] { return mandel(); };
+#endif
+    (void)nthreads;
+
+#if defined(RUNTIME) || defined(BENCH)
+    // With --interior or --subdivide the kernel is also run brute force, with
+    // both off, for the speedup and to check that the image is unchanged.  A
+    // kernel with a baseline is also compared against that, brute force too,
+    // so that the two comparisons are not mixed up.
+    const Kernel* chosen = kernel;
+    const Kernel* baseline = kernel->baseline ? findKernel(kernel->baseline) : nullptr;
+    bool brute = interior || subdivide;
+    bool with_interior = interior;
+    bool with_subdivide = subdivide;
+    auto bruteForce = [&](const Kernel* k) {
+        kernel = k;
+        interior = false;
+        subdivide = false;
+    };
+    auto restore = [&] {
+        kernel = chosen;
+        interior = with_interior;
+        subdivide = with_subdivide;
+    };
+    Snapshot brute_reference, baseline_reference;
+#endif
+
+#ifdef BENCH
+    // Repeated runs for statistics; the run below still produces the image.
+    {
+        BenchStats plain = { 0, 0, 0, 0, 0 }, base = plain;
+        double plain_use = 0, base_use = 0;
+        if (brute) {
+            bruteForce(chosen);
+            laneUtilisation();
+            plain = benchRun("mandel", kernel->name, nthreads, run);
+            plain_use = laneUtilisation();
+            brute_reference = snapshot();
+            restore();
+        }
+        if (baseline) {
+            bruteForce(baseline);
+            laneUtilisation();
+            base = benchRun("mandel", kernel->name, nthreads, run);
+            base_use = laneUtilisation();
+            baseline_reference = snapshot();
+            restore();
+        }
+        char variant[64];
+        snprintf(variant, sizeof(variant), "%s%s%s%s", kernel->name, interior ? "+interior" : "", subdivide ? "+subdivide" : "",
+                 smooth ? "+smooth" : "");
+        laneUtilisation();
+        BenchStats s = benchRun("mandel", variant, nthreads, run);
+        double use = laneUtilisation();
+        // The view, for sweeps over zoom and image size, and the comparison
+        printf("{\"benchmark\":\"mandel\",\"variant\":\"%s\",\"threads\":%u", variant, nthreads);
+        printf(",\"width\":%u,\"height\":%u,\"cutoff\":%u,\"center_x\":%.17g,\"center_y\":%.17g,\"zoom\":%g",
+               width, height, cutoff, center_x.hi, center_y.hi, zoom);
+        if (brute) {
+            printf(",\"brute_force_speedup\":%.3f,\"brute_force_differing\":%u",
+                   plain.min / s.min, differing(brute_reference));
+        }
+        if (baseline) {
+            printf(",\"baseline\":\"%s\",\"speedup\":%.3f,\"differing\":%u",
+                   baseline->name, base.min / s.min, differing(baseline_reference));
+        }
+        if (use > 0)
+            printf(",\"utilisation\":%.3f", use);
+        if (plain_use > 0)
+            printf(",\"brute_force_utilisation\":%.3f", plain_use);
+        if (base_use > 0)
+            printf(",\"baseline_utilisation\":%.3f", base_use);
+        printf("}\n");
+
+        // The colouring of the image, which is serial
+        std::vector<uint8_t> colours(size_t(width) * height * 3);
+        benchRun("mandel-colour", smooth ? "scalar+smooth" : "scalar", 1, [&] { colour(colours.data(), true); });
+# ifdef USE_SIMD
+        benchRun("mandel-colour", smooth ? "SIMD+smooth" : "SIMD", 1, [&] { colour(colours.data(), false); });
+# endif
+    }
+#endif
+
 #ifdef RUNTIME
+    double plain = 0, base = 0;
+    double plain_use = 0, base_use = 0;
+    if (brute) {
+        bruteForce(chosen);
+        laneUtilisation();
+        uint64_t then = timestamp();
+        run();
+        plain = (timestamp() - then) / 1000.0;
+        plain_use = laneUtilisation();
+        brute_reference = snapshot();
+        restore();
+    }
+    if (baseline) {
+        bruteForce(baseline);
+        laneUtilisation();
+        uint64_t then = timestamp();
+        run();
+        base = (timestamp() - then) / 1000.0;
+        base_use = laneUtilisation();
+        baseline_reference = snapshot();
+        restore();
+    }
+    laneUtilisation();
+    uint64_t glitches, references;
+    glitchStats(&glitches, &references);
     uint64_t then = timestamp();
 #endif
 
-    mandel();
+    unsigned computed = run();
+    (void)computed;
 
 #ifdef RUNTIME
     uint64_t now = timestamp();
     double runtime = (now - then) / 1000.0;
-    printf("Rendering time "
+    printf("View: %ux%u, cutoff %u, center %.17g%+.17gi, zoom %g\n", width, height, cutoff, center_x.hi, center_y.hi, zoom);
+    printf("Rendering time %s: %g ms\n", kernel->name, runtime);
+    double use = laneUtilisation();
+    if (use > 0)
+        printf("Lane utilisation: %.1f%%\n", 100 * use);
+    glitchStats(&glitches, &references);
+# ifdef USE_SIMD
+    if (kernel->prepare == preparePerturb)
+        printf("Glitched pixels: %llu, rebased on %llu more references\n", (unsigned long long)glitches, (unsigned long long)references);
+# endif
+    if (subdivide)
+        printf("Pixels computed: %u of %u\n", computed, unsigned(width * height));
+    if (brute) {
+        printf("Brute force %s: %g ms, speedup %.2f, %u pixels differ", kernel->name, plain, plain / runtime, differing(brute_reference));
+        if (plain_use > 0)
+            printf(", lane utilisation %.1f%%", 100 * plain_use);
+        printf("\n");
+    }
+    if (baseline) {
+        printf("Baseline %s: %g ms, speedup %.2f, %u pixels differ", baseline->name, base, base / runtime, differing(baseline_reference));
+        if (base_use > 0)
+            printf(", lane utilisation %.1f%%", 100 * base_use);
+        printf("\n");
+    }
+    // The colouring is serial, and once rendering is not it can matter
+    std::vector<uint8_t> colours(size_t(width) * height * 3);
+    then = timestamp();
+    colour(colours.data(), false);
+    double colouring = (timestamp() - then) / 1000.0;
 # ifdef USE_SIMD
-            "SIMD"
+    std::vector<uint8_t> scalar_colours(colours.size());
+    then = timestamp();
+    colour(scalar_colours.data(), true);
+    double scalar_colouring = (timestamp() - then) / 1000.0;
+    unsigned colours_differ = 0;
+    for ( size_t i=0 ; i < colours.size() ; i+=3 )
+        colours_differ += memcmp(&colours[i], &scalar_colours[i], 3) != 0;
+    printf("Colouring time: %g ms, scalar %g ms, %u pixels differ\n", colouring, scalar_colouring, colours_differ);
 # else
-            "scalar"
+    printf("Colouring time: %g ms\n", colouring);
+# endif
+# ifdef THREADS
+    printf("Threads: %u\n", unsigned(stats.size()));
+    // Busy time is time spent computing rows; the rest of the wall time is
+    // spent waiting for the slowest thread.
+    double total = 0, longest = 0;
+    for ( unsigned i=0 ; i < stats.size() ; i++ ) {
+        double busy = stats[i].busy / 1000.0;
+        printf("  thread %2u: %4u rows, busy %g ms (%.0f%%)\n", i, stats[i].rows, busy, 100 * busy / runtime);
+        total += busy;
+        longest = busy > longest ? busy : longest;
+    }
+    printf("  imbalance (max/mean busy): %.2f\n", longest / (total / stats.size()));
 # endif
-            ": %g ms\n", runtime);
 #endif
 
     // SDL_BROWSER is for the browser, it renders in a canvas.
     //
     // PPMX_STDOUT is for the js shell, it writes text output that must be
-    // postprocessed by ppmx2ppm.
+    // postprocessed by ppmx2ppm.  PPM64_STDOUT is also for the js shell, it
+    // writes base64 that `base64 -d` turns into a ppm.  PPM_STDOUT writes a
+    // binary ppm, for native builds.
 #ifdef SDL_BROWSER
     SDL_Init(SDL_INIT_VIDEO);
-    SDL_Surface *screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_SWSURFACE);
+    SDL_Surface *screen = SDL_SetVideoMode(width, height, 32, SDL_SWSURFACE);
 
     if (SDL_MUSTLOCK(screen))
 	SDL_LockSurface(screen);
 #endif
 
-#ifdef PPMX_STDOUT
-    printf("P6 %d %d 255\n", WIDTH, HEIGHT);
+#if defined(SDL_BROWSER) || defined(IMAGE_FORMAT)
+    std::vector<uint8_t> rgb(size_t(width) * height * 3);
+    colour(rgb.data(), false);
 #endif
 
-#if defined(SDL_BROWSER) || defined(PPMX_STDOUT)
-    for (uint32_t y = 0; y < HEIGHT ; y++ ) {
-	for (uint32_t x = 0; x < WIDTH; x++) {
-	    uint8_t r, g, b, a = 0;
-            if (iterations[y][x] < CUTOFF) {
-                r = R(mapping[iterations[y][x] % 16]);
-                g = G(mapping[iterations[y][x] % 16]);
-                b = B(mapping[iterations[y][x] % 16]);
-            } else {
-                r = g = b = 0;
-            }
-# ifdef SDL_BROWSER
-	    *((Uint32*)screen->pixels + (HEIGHT-y-1) * WIDTH + x) = SDL_MapRGBA(screen->format, r, g, b, a);
-# endif
-# ifdef PPMX_STDOUT
-	    printf("!%x!%x!%x", r, g, b);
-# endif
-	}
+#ifdef SDL_BROWSER
+    const uint8_t* pixel = rgb.data();
+    for (uint32_t y = 0; y < height ; y++ ) {
+	for (uint32_t x = 0; x < width; x++, pixel += 3)
+	    *((Uint32*)screen->pixels + (height-y-1) * width + x) = SDL_MapRGBA(screen->format, pixel[0], pixel[1], pixel[2], 0);
     }
 #endif
 
@@ -175,8 +2126,8 @@ int main(int argc, char** argv) {
     if (SDL_MUSTLOCK(screen))
 	SDL_UnlockSurface(screen);
 #endif
-#ifdef PPMX_STDOUT
-    printf("\n");
+#ifdef IMAGE_FORMAT
+    writeImage(IMAGE_FORMAT, width, height, rgb.data());
 #endif
 
     return 0;
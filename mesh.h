@@ -0,0 +1,363 @@
+/* -*- mode: c++ -*- */
+
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Triangle mesh loading from Wavefront OBJ and binary PLY files.
+ *
+ * The result is an indexed mesh: a vertex buffer of x,y,z positions and an
+ * index buffer of three vertex indices per triangle.  Polygons are split into
+ * triangle fans.  Only positions and faces are read; normals, texture
+ * coordinates, groups, materials and any other PLY properties are skipped.
+ *
+ * The file is read in blocks through a small buffer and parsed as it goes, so
+ * the text of an OBJ file is never held in memory as a whole.
+ */
+
+#ifndef MESH_H
+#define MESH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+struct Mesh {
+    std::vector<float> positions;	// x, y, z per vertex
+    std::vector<uint32_t> indices;	// Three per triangle
+
+    uint32_t numVertices() const { return positions.size() / 3; }
+    uint32_t numTriangles() const { return indices.size() / 3; }
+};
+
+// Buffered input with line and binary reads.  A line can straddle blocks; it
+// is moved to the front of the buffer and the buffer grows if a line does not
+// fit.
+
+class MeshInput
+{
+    FILE* f;
+    std::vector<char> buf;
+    size_t pos;
+    size_t len;
+
+    bool fill() {
+	if (pos > 0) {
+	    memmove(buf.data(), buf.data() + pos, len - pos);
+	    len -= pos;
+	    pos = 0;
+	}
+	if (len == buf.size())
+	    buf.resize(buf.size() * 2);
+	size_t n = fread(buf.data() + len, 1, buf.size() - len, f);
+	len += n;
+	return n > 0;
+    }
+
+public:
+    MeshInput(FILE* f) : f(f), buf(1 << 16), pos(0), len(0) {}
+
+    // The next line without its line terminator, NUL-terminated, or nullptr at
+    // end of file.  The line is valid until the next read.
+    char* line() {
+	for (;;) {
+	    char* start = buf.data() + pos;
+	    char* nl = (char*)memchr(start, '\n', len - pos);
+	    if (nl) {
+		pos = nl + 1 - buf.data();
+		if (nl > start && nl[-1] == '\r')
+		    nl--;
+		*nl = 0;
+		return start;
+	    }
+	    if (!fill()) {
+		if (pos == len)
+		    return nullptr;
+		// Last line without a newline; make room for the NUL.
+		if (len == buf.size())
+		    buf.resize(buf.size() + 1);
+		buf[len] = 0;
+		char* last = buf.data() + pos;
+		pos = len;
+		return last;
+	    }
+	}
+    }
+
+    bool read(void* dst, size_t n) {
+	while (len - pos < n) {
+	    if (!fill())
+		return false;
+	}
+	memcpy(dst, buf.data() + pos, n);
+	pos += n;
+	return true;
+    }
+};
+
+static char mesh_error[256];
+
+static inline bool meshSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Parse one line of an OBJ file.  Returns false if it is malformed.
+static bool objLine(char* s, Mesh* mesh, std::vector<uint32_t>& face) {
+    while (meshSpace(*s))
+	s++;
+    if (s[0] == 'v' && meshSpace(s[1])) {
+	s++;
+	for ( int i=0 ; i < 3 ; i++ ) {
+	    char* end;
+	    float v = strtof(s, &end);
+	    if (end == s)
+		return false;
+	    mesh->positions.push_back(v);
+	    s = end;
+	}
+    } else if (s[0] == 'f' && meshSpace(s[1])) {
+	s++;
+	face.clear();
+	for (;;) {
+	    while (meshSpace(*s))
+		s++;
+	    if (!*s)
+		break;
+	    char* end;
+	    long k = strtol(s, &end, 10);
+	    if (end == s || k == 0)
+		return false;
+	    // Negative indices are relative to the end of the vertex list.
+	    long v = k > 0 ? k-1 : long(mesh->numVertices()) + k;
+	    if (v < 0 || v > long(UINT32_MAX))
+		return false;
+	    face.push_back(uint32_t(v));
+	    // Skip texture and normal indices
+	    s = end;
+	    while (*s && !meshSpace(*s))
+		s++;
+	}
+	if (face.size() < 3)
+	    return false;
+	for ( size_t i=2 ; i < face.size() ; i++ ) {
+	    mesh->indices.push_back(face[0]);
+	    mesh->indices.push_back(face[i-1]);
+	    mesh->indices.push_back(face[i]);
+	}
+    }
+    return true;
+}
+
+static const char* loadOBJ(MeshInput& in, Mesh* mesh) {
+    uint32_t lineno = 0;
+    std::vector<uint32_t> face;
+    while (char* s = in.line()) {
+	lineno++;
+	if (!objLine(s, mesh, face)) {
+	    snprintf(mesh_error, sizeof(mesh_error), "Bad OBJ data on line %u", lineno);
+	    return mesh_error;
+	}
+    }
+    return nullptr;
+}
+
+enum PLYType { PLY_NONE, PLY_I8, PLY_U8, PLY_I16, PLY_U16, PLY_I32, PLY_U32, PLY_F32, PLY_F64 };
+
+struct PLYProperty {
+    PLYType type;
+    PLYType count_type;		// PLY_NONE unless a list
+    char name[64];
+};
+
+struct PLYElement {
+    char name[64];
+    uint64_t count;
+    std::vector<PLYProperty> props;
+};
+
+static PLYType plyType(const char* s) {
+    static const struct { const char* name; PLYType type; } types[] = {
+	{ "char", PLY_I8 }, { "int8", PLY_I8 }, { "uchar", PLY_U8 }, { "uint8", PLY_U8 },
+	{ "short", PLY_I16 }, { "int16", PLY_I16 }, { "ushort", PLY_U16 }, { "uint16", PLY_U16 },
+	{ "int", PLY_I32 }, { "int32", PLY_I32 }, { "uint", PLY_U32 }, { "uint32", PLY_U32 },
+	{ "float", PLY_F32 }, { "float32", PLY_F32 }, { "double", PLY_F64 }, { "float64", PLY_F64 }
+    };
+    for ( auto& t : types ) {
+	if (strcmp(s, t.name) == 0)
+	    return t.type;
+    }
+    return PLY_NONE;
+}
+
+static bool plyRead(MeshInput& in, PLYType type, bool swap, double* v) {
+    static const size_t sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+    uint8_t b[8];
+    size_t n = sizes[type];
+    if (!in.read(b, n))
+	return false;
+    if (swap)
+	std::reverse(b, b + n);
+    switch (type) {
+      case PLY_I8:  { int8_t x;   memcpy(&x, b, 1); *v = x; break; }
+      case PLY_U8:  { uint8_t x;  memcpy(&x, b, 1); *v = x; break; }
+      case PLY_I16: { int16_t x;  memcpy(&x, b, 2); *v = x; break; }
+      case PLY_U16: { uint16_t x; memcpy(&x, b, 2); *v = x; break; }
+      case PLY_I32: { int32_t x;  memcpy(&x, b, 4); *v = x; break; }
+      case PLY_U32: { uint32_t x; memcpy(&x, b, 4); *v = x; break; }
+      case PLY_F32: { float x;    memcpy(&x, b, 4); *v = x; break; }
+      case PLY_F64: { double x;   memcpy(&x, b, 8); *v = x; break; }
+      default:      return false;
+    }
+    return true;
+}
+
+static const char* loadPLY(MeshInput& in, Mesh* mesh) {
+    const uint16_t one = 1;
+    bool little_endian_host = *(const uint8_t*)&one == 1;
+    bool swap = false;
+    bool have_format = false;
+    std::vector<PLYElement> elements;
+
+    // Header
+    char* first = in.line();
+    if (!first || strcmp(first, "ply") != 0)
+	return "Bad PLY magic";
+    for (;;) {
+	char* s = in.line();
+	if (!s)
+	    return "Truncated PLY header";
+	char word[64], a[64], b[64], c[64];
+	unsigned long long count;
+	if (sscanf(s, "%63s", word) != 1 || !strcmp(word, "comment") || !strcmp(word, "obj_info"))
+	    continue;
+	if (!strcmp(word, "end_header"))
+	    break;
+	if (!strcmp(word, "format")) {
+	    if (sscanf(s, "format %63s", a) != 1)
+		return "Bad PLY format line";
+	    if (!strcmp(a, "binary_little_endian"))
+		swap = !little_endian_host;
+	    else if (!strcmp(a, "binary_big_endian"))
+		swap = little_endian_host;
+	    else
+		return "Only binary PLY files are supported";
+	    have_format = true;
+	} else if (!strcmp(word, "element")) {
+	    PLYElement e;
+	    if (sscanf(s, "element %63s %llu", e.name, &count) != 2)
+		return "Bad PLY element line";
+	    e.count = count;
+	    elements.push_back(e);
+	} else if (!strcmp(word, "property")) {
+	    PLYProperty p;
+	    if (elements.empty())
+		return "PLY property outside element";
+	    if (sscanf(s, "property list %63s %63s %63s", a, b, c) == 3) {
+		p.count_type = plyType(a);
+		p.type = plyType(b);
+		strcpy(p.name, c);
+		if (p.count_type == PLY_NONE || p.type == PLY_NONE)
+		    return "Bad PLY property type";
+	    } else if (sscanf(s, "property %63s %63s", a, b) == 2) {
+		p.count_type = PLY_NONE;
+		p.type = plyType(a);
+		strcpy(p.name, b);
+		if (p.type == PLY_NONE)
+		    return "Bad PLY property type";
+	    } else {
+		return "Bad PLY property line";
+	    }
+	    elements.back().props.push_back(p);
+	} else {
+	    return "Unknown PLY header line";
+	}
+    }
+    if (!have_format)
+	return "Missing PLY format";
+
+    // Body
+    for ( const PLYElement& e : elements ) {
+	bool vertex = !strcmp(e.name, "vertex");
+	bool face = !strcmp(e.name, "face");
+	int xyz[3] = { -1, -1, -1 };
+	for ( size_t i=0 ; i < e.props.size() ; i++ ) {
+	    const char* n = e.props[i].name;
+	    if (vertex && n[0] >= 'x' && n[0] <= 'z' && !n[1] && e.props[i].count_type == PLY_NONE)
+		xyz[n[0] - 'x'] = int(i);
+	}
+	if (vertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0))
+	    return "PLY vertex element lacks x, y or z";
+	std::vector<uint32_t> poly;
+	for ( uint64_t r=0 ; r < e.count ; r++ ) {
+	    float pos[3] = { 0, 0, 0 };
+	    for ( size_t i=0 ; i < e.props.size() ; i++ ) {
+		const PLYProperty& p = e.props[i];
+		double v;
+		if (p.count_type == PLY_NONE) {
+		    if (!plyRead(in, p.type, swap, &v))
+			return "Truncated PLY data";
+		    for ( int k=0 ; k < 3 ; k++ ) {
+			if (int(i) == xyz[k])
+			    pos[k] = float(v);
+		    }
+		    continue;
+		}
+		double count;
+		if (!plyRead(in, p.count_type, swap, &count))
+		    return "Truncated PLY data";
+		bool indices = face && (!strcmp(p.name, "vertex_indices") || !strcmp(p.name, "vertex_index"));
+		poly.clear();
+		for ( uint32_t k=0 ; k < uint32_t(count) ; k++ ) {
+		    if (!plyRead(in, p.type, swap, &v))
+			return "Truncated PLY data";
+		    if (indices) {
+			if (v < 0 || v > double(UINT32_MAX))
+			    return "Bad PLY vertex index";
+			poly.push_back(uint32_t(v));
+		    }
+		}
+		if (indices) {
+		    for ( size_t k=2 ; k < poly.size() ; k++ ) {
+			mesh->indices.push_back(poly[0]);
+			mesh->indices.push_back(poly[k-1]);
+			mesh->indices.push_back(poly[k]);
+		    }
+		}
+	    }
+	    if (vertex)
+		mesh->positions.insert(mesh->positions.end(), pos, pos + 3);
+	}
+    }
+    return nullptr;
+}
+
+// Load the mesh in filename, which is PLY if it starts with "ply" and OBJ
+// otherwise.  Returns nullptr on success, or an error message.
+
+static const char* loadMesh(const char* filename, Mesh* mesh) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+	snprintf(mesh_error, sizeof(mesh_error), "Can't open %s", filename);
+	return mesh_error;
+    }
+    MeshInput in(f);
+    char magic[4] = { 0, 0, 0, 0 };
+    bool ply = fread(magic, 1, 3, f) == 3 && !strcmp(magic, "ply");
+    rewind(f);
+    const char* err = ply ? loadPLY(in, mesh) : loadOBJ(in, mesh);
+    fclose(f);
+    if (err)
+	return err;
+    for ( uint32_t i : mesh->indices ) {
+	if (i >= mesh->numVertices())
+	    return "Vertex index out of range";
+    }
+    return nullptr;
+}
+
+#endif // MESH_H
@@ -0,0 +1,88 @@
+/* -*- mode: c++ -*- */
+
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Image output on stdout.  The image is passed as rows of RGB bytes, top row
+ * first, and is encoded into one buffer that is written with a single fwrite.
+ *
+ *   PPMX   the text encoding read by ppmx2ppm: a P6 header line followed by
+ *          "!%x!%x!%x" per pixel on one line
+ *   PPM    binary P6
+ *   PPM64  binary P6 in base64, in lines of 76 characters, for shells whose
+ *          stdout is not binary-safe; decode with `base64 -d`
+ */
+
+#ifndef PPM_H
+#define PPM_H
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+enum ImageFormat {
+    PPMX,
+    PPM,
+    PPM64
+};
+
+static void writeImage(ImageFormat format, uint32_t width, uint32_t height, const uint8_t* rgb) {
+    static const char hex[] = "0123456789abcdef";
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    char header[64];
+    size_t header_len = snprintf(header, sizeof(header), "P6 %u %u 255\n", width, height);
+    size_t nbytes = size_t(width) * height * 3;
+
+    std::vector<char> out;
+    switch (format) {
+      case PPMX: {
+        // At most three characters per byte, hex digits are printed without
+        // leading zeroes.
+        out.reserve(header_len + nbytes*3 + 1);
+        out.insert(out.end(), header, header + header_len);
+        for ( size_t i=0 ; i < nbytes ; i++ ) {
+            out.push_back('!');
+            if (rgb[i] >= 16)
+                out.push_back(hex[rgb[i] >> 4]);
+            out.push_back(hex[rgb[i] & 15]);
+        }
+        out.push_back('\n');
+        break;
+      }
+      case PPM: {
+        out.reserve(header_len + nbytes);
+        out.insert(out.end(), header, header + header_len);
+        out.insert(out.end(), rgb, rgb + nbytes);
+        break;
+      }
+      case PPM64: {
+        std::vector<uint8_t> raw;
+        raw.reserve(header_len + nbytes);
+        raw.insert(raw.end(), header, header + header_len);
+        raw.insert(raw.end(), rgb, rgb + nbytes);
+        size_t len = raw.size();
+        out.reserve((len + 2) / 3 * 4 + len / 57 + 2);
+        for ( size_t i=0 ; i < len ; i+=3 ) {
+            uint32_t n = raw[i] << 16;
+            if (i+1 < len) n |= raw[i+1] << 8;
+            if (i+2 < len) n |= raw[i+2];
+            out.push_back(b64[(n >> 18) & 63]);
+            out.push_back(b64[(n >> 12) & 63]);
+            out.push_back(i+1 < len ? b64[(n >> 6) & 63] : '=');
+            out.push_back(i+2 < len ? b64[n & 63] : '=');
+            // 57 input bytes make a 76-character line
+            if ((i+3) % 57 == 0 || i+3 >= len)
+                out.push_back('\n');
+        }
+        break;
+      }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+#endif // PPM_H
@@ -1,40 +1,151 @@
+/* Convert a ppmx file to ppm.
+ *
+ * A ppmx file is a ppm file where each binary byte is written as "!" followed
+ * by the byte in hex.  Everything that is not such an escape is copied
+ * through.  The input is processed in blocks with a small state machine that
+ * carries a partly parsed escape across block boundaries, so memory use is
+ * constant and input can come from a pipe:
+ *
+ *   js raybench.js | ppmx2ppm > raybench.ppm
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1 << 20)
+
+/* Hex digit values, or 0xFF for characters that are not hex digits. */
+static unsigned char hexval[256];
+
+static unsigned char inbuf[BLOCK_SIZE];
+static unsigned char outbuf[BLOCK_SIZE];
+static size_t outlen;
+static FILE* out;
 
-void usage(char** argv) {
-    fprintf(stderr, "Usage: %s infile outfile\n", argv[0]);
+static void usage(char** argv) {
+    fprintf(stderr, "Usage: %s [infile|- [outfile|-]]\n", argv[0]);
     exit(1);
 }
 
+static void flush(void) {
+    if (fwrite(outbuf, 1, outlen, out) != outlen) {
+        perror("Output file");
+        exit(1);
+    }
+    outlen = 0;
+}
+
+static void emit(unsigned char c) {
+    if (outlen == BLOCK_SIZE)
+        flush();
+    outbuf[outlen++] = c;
+}
+
+static void emitBytes(const unsigned char* p, size_t n) {
+    while (n > 0) {
+        size_t k;
+        if (outlen == BLOCK_SIZE)
+            flush();
+        k = BLOCK_SIZE - outlen;
+        if (k > n)
+            k = n;
+        memcpy(outbuf + outlen, p, k);
+        outlen += k;
+        p += k;
+        n -= k;
+    }
+}
+
 int main(int argc, char** argv) {
-    if (argc != 3)
-        usage(argv);
-    FILE* in = fopen(argv[1], "rb");
-    if (!in) {
-        perror("Input file");
+    FILE* in = stdin;
+    size_t n;
+    int i;
+
+    /* Escape state: 0 = copying, 1 = just read '!', 2 = reading hex digits. */
+    int state = 0;
+    unsigned value = 0;
+
+    if (argc > 3)
         usage(argv);
+    out = stdout;
+    if (argc > 1 && strcmp(argv[1], "-") != 0) {
+        in = fopen(argv[1], "rb");
+        if (!in) {
+            perror("Input file");
+            usage(argv);
+        }
     }
-    FILE* out = fopen(argv[2], "wb");
-    if (!out) {
-        perror("Output file");
-        usage(argv);
+    if (argc > 2 && strcmp(argv[2], "-") != 0) {
+        out = fopen(argv[2], "wb");
+        if (!out) {
+            perror("Output file");
+            usage(argv);
+        }
+    }
+
+    memset(hexval, 0xFF, sizeof(hexval));
+    for ( i=0 ; i < 10 ; i++ )
+        hexval['0' + i] = i;
+    for ( i=0 ; i < 6 ; i++ ) {
+        hexval['a' + i] = 10 + i;
+        hexval['A' + i] = 10 + i;
     }
-    int c;
-    while ((c = fgetc(in)) != EOF) {
-        if (c != '!') {
-            fputc(c, out);
-        } else {
-            int r, g, b;
-            if (fscanf(in, "%x!%x!%x", &r, &g, &b) != 3) {
+
+    while ((n = fread(inbuf, 1, BLOCK_SIZE, in)) > 0) {
+        const unsigned char* p = inbuf;
+        const unsigned char* limit = inbuf + n;
+        while (p < limit) {
+            if (state == 0) {
+                /* Copy up to the next escape in one go. */
+                const unsigned char* bang = memchr(p, '!', limit - p);
+                if (!bang) {
+                    emitBytes(p, limit - p);
+                    p = limit;
+                    break;
+                }
+                emitBytes(p, bang - p);
+                p = bang + 1;
+                state = 1;
+                value = 0;
+            }
+            /* Accumulate hex digits; the first non-digit ends the byte. */
+            while (p < limit && hexval[*p] != 0xFF) {
+                value = (value << 4) | hexval[*p++];
+                state = 2;
+            }
+            if (p == limit)
+                break;
+            if (state == 1 || value > 255) {
                 fprintf(stderr, "Can't parse input\n");
                 exit(1);
             }
-            fputc(r, out);
-            fputc(g, out);
-            fputc(b, out);
+            emit(value);
+            if (*p == '!') {
+                p++;
+                state = 1;
+                value = 0;
+            } else {
+                state = 0;
+            }
         }
     }
-    fclose(in);
-    fclose(out);
+    if (ferror(in)) {
+        perror("Input file");
+        exit(1);
+    }
+    if (state == 1) {
+        fprintf(stderr, "Can't parse input\n");
+        exit(1);
+    }
+    if (state == 2)
+        emit(value);
+    flush();
+    if (in != stdin)
+        fclose(in);
+    if (out != stdout && fclose(out) != 0) {
+        perror("Output file");
+        exit(1);
+    }
     return 0;
 }
@@ -14,22 +14,61 @@
 
 // What takes time here is antialiasing.  To allow this program to scale as a
 // benchmark, we could use a smaller antialiasing grid (2x2 or 3x3, not 4x4).
+// Adaptive antialiasing (--adaptive=1) takes the full grid only at edges and
+// typically needs fewer than half the rays.
 //
 // Also, partitioning speeds the program by a factor of 3.5 or so, so disabling
 // that would make it more challenging still.
 
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
 #include <cstdarg>
-#include <sys/time.h>
-#include <emscripten.h>
-#include <wasm_simd128.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __EMSCRIPTEN__
+#  include <emscripten.h>
+#endif
+#ifdef USE_SIMD
+#  include "simd.h"
+#endif
+#ifdef THREADS
+#  include <thread>
+#  include <mutex>
+#  include <deque>
+#endif
 
 #ifdef SDL_BROWSER
 #  include <SDL/SDL.h>
 #endif
+#if defined(PPM_STDOUT)
+#  define IMAGE_FORMAT PPM
+#elif defined(PPM64_STDOUT)
+#  define IMAGE_FORMAT PPM64
+#elif defined(PPMX_STDOUT)
+#  define IMAGE_FORMAT PPMX
+#endif
+#ifdef IMAGE_FORMAT
+#  include "ppm.h"
+#endif
+#include "bench.h"
+#include "mesh.h"
+
+#if defined(PACKETS) && !defined(USE_SIMD)
+#  error "PACKETS requires USE_SIMD"
+#endif
+
+#if defined(SCALING) && !defined(THREADS)
+#  error "SCALING requires THREADS"
+#endif
 
 using std::vector;
 
@@ -50,7 +89,7 @@ typedef float Float;
 #endif
 
 #ifndef WIDTH
-#  define WIDTH 800;
+#  define WIDTH 800
 #endif
 
 #ifndef SHADOWS
@@ -65,20 +104,68 @@ typedef float Float;
 #  define ANTIALIAS true
 #endif
 
-static const uint32_t g_height = HEIGHT;
-static const uint32_t g_width = WIDTH;
+// Antialiasing takes AA_GRID x AA_GRID samples per pixel
+#ifndef AA_GRID
+#  define AA_GRID 4
+#endif
+
+// Adaptive antialiasing takes a few samples per pixel and the full grid only
+// where the samples, or the pixel and its neighbours, differ by more than
+// AA_THRESHOLD in some color channel, in units of 1/255
+#ifndef ADAPTIVE
+#  define ADAPTIVE false
+#endif
+
+#ifndef AA_THRESHOLD
+#  define AA_THRESHOLD 2
+#endif
+
+// The macros give the defaults for these configuration knobs.  For
+// benchmarking they are variable and can be set on the command line so that
+// one binary can cover a range of workloads.  See parseArgs().
 
-// Normally these configuration knobs would be constant, but for benchmarking they
-// are made variable and affected by command line arguments.  See main().
+static uint32_t g_height = HEIGHT;
+static uint32_t g_width = WIDTH;
 
-static const bool g_partitioning = PARTITIONING;
+static bool g_partitioning = PARTITIONING;
 
-static const bool g_shadows = SHADOWS;	                 // Compute object shadows
+static bool g_shadows = SHADOWS;                        // Compute object shadows
 
-static const bool g_reflection = (REFLECTION != 0);           // Compute object reflections
-static const uint32_t g_reflection_depth = REFLECTION;        //   to this depth
+static uint32_t g_reflection_depth = REFLECTION;        // Compute object reflections to this depth
 
-static const bool g_antialias = ANTIALIAS;                    // Antialias the image (expensive but very pretty)
+static bool g_antialias = ANTIALIAS;                    // Antialias the image (expensive but very pretty)
+static uint32_t g_aa_grid = AA_GRID;                    //   with this many samples squared
+static bool g_adaptive = ADAPTIVE;                      //   but only where the image needs it
+static uint32_t g_aa_threshold = AA_THRESHOLD;          //     as judged by this contrast
+
+static const char* g_mesh = nullptr;                    // OBJ or PLY file to render instead of the objects
+
+static const char* g_cache = nullptr;                   // Directory for prebuilt scenes, see SceneCache
+
+#ifdef THREADS
+// Number of render threads, 0 means one per hardware thread
+#  ifndef NTHREADS
+#    define NTHREADS 0
+#  endif
+
+// Tile size in pixels, rounded up to a multiple of Bitmap::TILE so that
+// threads never write to the same cache line
+#  ifndef TILE_SIZE
+#    define TILE_SIZE 32
+#  endif
+
+static uint32_t g_threads = NTHREADS;
+static uint32_t g_tile_size = TILE_SIZE;
+#endif
+
+#ifdef PACKETS
+// Trace shadow and reflection rays in batches by kind, see traceWavefront()
+#  ifndef WAVEFRONT
+#    define WAVEFRONT false
+#  endif
+
+static bool g_wavefront = WAVEFRONT;
+#endif
 
 // Viewport
 static const Float g_left = -2;
@@ -97,12 +184,6 @@ static void WARNING(const char* msg) {
     printf("WARNING: %s\n", msg);
 }
 
-static uint64_t timestamp() {
-    struct timeval tp;
-    gettimeofday(&tp, nullptr);
-    return uint64_t(tp.tv_sec)*1000000 + tp.tv_usec;
-}
-
 static const Float SENTINEL = 1e32;
 static const Float EPS = 0.00001;
 
@@ -132,6 +213,9 @@ typedef v128_t Bool3;
 
 #define Vec3B(x, y, z) wasm_f32x4_make(x, y, z, 0)
 
+// Load from memory, the w lane is whatever follows z
+#define Vec3L(p) wasm_v128_load(p)
+
 #define V3P v128_t
 
 static inline Vec3 add(V3P a, V3P b) {
@@ -249,6 +333,11 @@ static inline Vec3 Vec3B(Float a, Float b, Float c) {
     return Vec3(a, b, c);
 }
 
+// Load from memory
+static inline Vec3 Vec3L(const Float* p) {
+    return Vec3(p[0], p[1], p[2]);
+}
+
 #define V3P const Vec3&
 
 static inline Vec3 add(V3P a, V3P b) {
@@ -315,6 +404,139 @@ static inline Vec3 bitselect(Vec3 a, Vec3 b, Bool3 control) {
 
 #endif // !USE_SIMD
 
+#ifdef USE_SIMD
+
+// Vectors in structure-of-arrays form, one vector per lane, so that all
+// arithmetic is lane-parallel; unlike Vec3 there is no wasted lane.  Masks are
+// all-ones or all-zeroes per lane.
+
+struct Vec3x4 {
+    v128_t x, y, z;
+};
+
+static inline Vec3x4 splat(V3P a) {
+    Vec3x4 r = { wasm_f32x4_splat(X(a)), wasm_f32x4_splat(Y(a)), wasm_f32x4_splat(Z(a)) };
+    return r;
+}
+
+static inline Vec3 lane(const Vec3x4& a, uint32_t i) {
+    switch (i) {
+      case 0:  return Vec3B(wasm_f32x4_extract_lane(a.x, 0), wasm_f32x4_extract_lane(a.y, 0), wasm_f32x4_extract_lane(a.z, 0));
+      case 1:  return Vec3B(wasm_f32x4_extract_lane(a.x, 1), wasm_f32x4_extract_lane(a.y, 1), wasm_f32x4_extract_lane(a.z, 1));
+      case 2:  return Vec3B(wasm_f32x4_extract_lane(a.x, 2), wasm_f32x4_extract_lane(a.y, 2), wasm_f32x4_extract_lane(a.z, 2));
+      default: return Vec3B(wasm_f32x4_extract_lane(a.x, 3), wasm_f32x4_extract_lane(a.y, 3), wasm_f32x4_extract_lane(a.z, 3));
+    }
+}
+
+// The Vec3x4 whose lanes are a, b, c and d.
+static inline Vec3x4 gather(V3P a, V3P b, V3P c, V3P d) {
+    v128_t xy_ab = wasm_v32x4_shuffle(a, b, 0, 4, 1, 5);
+    v128_t xy_cd = wasm_v32x4_shuffle(c, d, 0, 4, 1, 5);
+    v128_t zw_ab = wasm_v32x4_shuffle(a, b, 2, 6, 3, 7);
+    v128_t zw_cd = wasm_v32x4_shuffle(c, d, 2, 6, 3, 7);
+    Vec3x4 r = { wasm_v32x4_shuffle(xy_ab, xy_cd, 0, 1, 4, 5),
+                 wasm_v32x4_shuffle(xy_ab, xy_cd, 2, 3, 6, 7),
+                 wasm_v32x4_shuffle(zw_ab, zw_cd, 0, 1, 4, 5) };
+    return r;
+}
+
+static inline Vec3x4 add(const Vec3x4& a, const Vec3x4& b) {
+    Vec3x4 r = { wasm_f32x4_add(a.x, b.x), wasm_f32x4_add(a.y, b.y), wasm_f32x4_add(a.z, b.z) };
+    return r;
+}
+
+static inline Vec3x4 sub(const Vec3x4& a, const Vec3x4& b) {
+    Vec3x4 r = { wasm_f32x4_sub(a.x, b.x), wasm_f32x4_sub(a.y, b.y), wasm_f32x4_sub(a.z, b.z) };
+    return r;
+}
+
+static inline Vec3x4 muli(const Vec3x4& a, v128_t c) {
+    Vec3x4 r = { wasm_f32x4_mul(a.x, c), wasm_f32x4_mul(a.y, c), wasm_f32x4_mul(a.z, c) };
+    return r;
+}
+
+static inline Vec3x4 divi(const Vec3x4& a, v128_t c) {
+    Vec3x4 r = { wasm_f32x4_div(a.x, c), wasm_f32x4_div(a.y, c), wasm_f32x4_div(a.z, c) };
+    return r;
+}
+
+static inline Vec3x4 inv(const Vec3x4& a) {
+    v128_t one = wasm_f32x4_splat(1);
+    Vec3x4 r = { wasm_f32x4_div(one, a.x), wasm_f32x4_div(one, a.y), wasm_f32x4_div(one, a.z) };
+    return r;
+}
+
+static inline v128_t dot(const Vec3x4& a, const Vec3x4& b) {
+    return wasm_f32x4_add(wasm_f32x4_add(wasm_f32x4_mul(a.x, b.x), wasm_f32x4_mul(a.y, b.y)),
+                          wasm_f32x4_mul(a.z, b.z));
+}
+
+static inline Vec3x4 cross(const Vec3x4& a, const Vec3x4& b) {
+    Vec3x4 r = { wasm_f32x4_sub(wasm_f32x4_mul(a.y, b.z), wasm_f32x4_mul(a.z, b.y)),
+                 wasm_f32x4_sub(wasm_f32x4_mul(a.z, b.x), wasm_f32x4_mul(a.x, b.z)),
+                 wasm_f32x4_sub(wasm_f32x4_mul(a.x, b.y), wasm_f32x4_mul(a.y, b.x)) };
+    return r;
+}
+
+static inline v128_t rsqrt(v128_t a) {
+    return wasm_f32x4_div(wasm_f32x4_splat(1), wasm_f32x4_sqrt(a));
+}
+
+// wasm has no approximate reciprocal square root, but one division and three
+// multiplications are still cheaper than three divisions.
+static inline Vec3x4 normalize(const Vec3x4& a) {
+    return muli(a, rsqrt(dot(a, a)));
+}
+
+// x^y for 0 <= x <= 1 and y >= 0, as 2^(y*log2(x)) with polynomial log2 and
+// exp2.  The relative error is below 6e-6*(y+1), well under one step of an 8-bit
+// color channel for the shininess of any material here.  0^0 is 1.
+static inline v128_t pow4(v128_t x, v128_t y) {
+    v128_t one = wasm_f32x4_splat(1);
+
+    // x = 2^e * (1+t) with 0 <= t < 1, and log2(1+t) = t*P(t)
+    v128_t e = wasm_i32x4_sub(wasm_u32x4_shr(x, 23), wasm_i32x4_splat(127));
+    v128_t t = wasm_f32x4_sub(wasm_v128_or(wasm_v128_and(x, wasm_i32x4_splat(0x007FFFFF)), one), one);
+    v128_t p = wasm_f32x4_splat(-0.033822046f);
+    p = wasm_f32x4_add(wasm_f32x4_mul(p, t), wasm_f32x4_splat(0.144471096f));
+    p = wasm_f32x4_add(wasm_f32x4_mul(p, t), wasm_f32x4_splat(-0.30163801f));
+    p = wasm_f32x4_add(wasm_f32x4_mul(p, t), wasm_f32x4_splat(0.468658879f));
+    p = wasm_f32x4_add(wasm_f32x4_mul(p, t), wasm_f32x4_splat(-0.720358773f));
+    p = wasm_f32x4_add(wasm_f32x4_mul(p, t), wasm_f32x4_splat(1.44268147f));
+    v128_t log2x = wasm_f32x4_add(wasm_f32x4_convert_i32x4(e), wasm_f32x4_mul(p, t));
+
+    // z = i + f with i = floor(z) and 0 <= f < 1, and 2^z = 2^i * Q(f).
+    // Truncation rounds negative z up, so step down where it did.  Results
+    // below 2^-64 are flushed to zero, as products with them could otherwise be
+    // denormal, which is very slow on some hardware.
+    v128_t z = wasm_f32x4_mul(y, log2x);
+    v128_t tiny = wasm_f32x4_lt(z, wasm_f32x4_splat(-64));
+    z = wasm_f32x4_max(z, wasm_f32x4_splat(-64));
+    v128_t i = wasm_i32x4_trunc_saturate_f32x4(z);
+    i = wasm_i32x4_add(i, wasm_f32x4_gt(wasm_f32x4_convert_i32x4(i), z));
+    v128_t f = wasm_f32x4_sub(z, wasm_f32x4_convert_i32x4(i));
+    v128_t q = wasm_f32x4_splat(0.00189375406f);
+    q = wasm_f32x4_add(wasm_f32x4_mul(q, f), wasm_f32x4_splat(0.00894959042f));
+    q = wasm_f32x4_add(wasm_f32x4_mul(q, f), wasm_f32x4_splat(0.0558603371f));
+    q = wasm_f32x4_add(wasm_f32x4_mul(q, f), wasm_f32x4_splat(0.240141818f));
+    q = wasm_f32x4_add(wasm_f32x4_mul(q, f), wasm_f32x4_splat(0.69315449f));
+    q = wasm_f32x4_add(wasm_f32x4_mul(q, f), wasm_f32x4_splat(0.999999898f));
+    return wasm_v128_andnot(wasm_f32x4_mul(q, wasm_i32x4_shl(wasm_i32x4_add(i, wasm_i32x4_splat(127)), 23)), tiny);
+}
+
+#endif // USE_SIMD
+
+#ifdef PACKETS
+
+// Packets of four rays, one per lane.
+
+struct Ray4 {
+    Vec3x4 origin;
+    Vec3x4 dir;
+};
+
+#endif // PACKETS
+
 static inline Float length(V3P a) {
     return Sqrt(dot(a,a));
 }
@@ -354,508 +576,2313 @@ struct Bounds {
     Bounds(Vec3 mins, Vec3 maxs) : mins(mins), maxs(maxs) {}
 };
 
-class Surface
-{
-public:
-    Material material;
+// Scene description, as built by setStage().  Materials are referenced by their
+// index in World::materials.  A World is compiled into a Scene for tracing.
 
-    Surface(const Material& material)
-	: material(material)
+struct Sphere {
+    Vec3 center;
+    Float radius;
+    uint32_t material;
+
+    Sphere(uint32_t material, V3P center, Float radius)
+	: center(center)
+	, radius(radius)
+	, material(material)
     {}
 
-    virtual Surface* intersect(V3P eye, V3P ray, Float min, Float max, Float* distance) = 0;
-    virtual Vec3 normal(V3P p) = 0;
-    virtual Bounds bounds() = 0;
-    virtual Vec3 center() = 0;
-    virtual void debug(void (*print)(const char* s), uint32_t level) = 0;
+    Bounds bounds() const {
+	return Bounds(subi(center, radius), addi(center, radius));
+    }
+
+    Vec3 centroid() const {
+	return center;
+    }
 };
 
-class Volume : public Surface
-{
-    Bounds   bounds_;
-    Surface* left_;
-    Surface* right_;
+// Triangles reference their vertices by index in World::vertices, so that
+// meshes share vertices between triangles.
 
-public:
-    Volume(Bounds bounds, Surface* left, Surface* right)
-	: Surface(Material())
-	, bounds_(bounds)
-	, left_(left)
-	, right_(right)
-    {}
+struct Triangle {
+    uint32_t v1;
+    uint32_t v2;
+    uint32_t v3;
+    uint32_t material;
 
-    Surface* intersect(V3P eye, V3P ray, Float min, Float max, Float* distance) {
-	// Test volume intersection.
-        Vec3 a = inv(ray);
-        Vec3 a_times_mins_minus_eye = mul(a, sub(bounds_.mins, eye));
-        Vec3 a_times_maxs_minus_eye = mul(a, sub(bounds_.maxs, eye));
-        Bool3 a_ge_0 = vpositive(a);
-        Vec3 mins = bitselect(a_times_mins_minus_eye, a_times_maxs_minus_eye, a_ge_0);
-        Vec3 maxs = bitselect(a_times_maxs_minus_eye, a_times_mins_minus_eye, a_ge_0);
-	Float tmin = 0, tmax = 0, tymin = 0, tymax = 0, tzmin = 0, tzmax = 0;
-        tmin = X(mins);
-        tmax = X(maxs);
-        tymin = Y(mins);
-        tymax = Y(maxs);
-	if (tmin > tymax || tymin > tmax)
-	    return nullptr;
-	if (tymin > tmin)
-	    tmin = tymin;
-	if (tymax < tmax)
-	    tmax = tymax;
-        tzmin = Z(mins);
-        tzmax = Z(maxs);
-	if (tmin > tzmax || tzmin > tmax)
-	    return nullptr;
-	if (tzmin > tmin)
-	    tmin = tzmin;
-	if (tzmax < tmax)
-	    tmax = tzmax;
+    Triangle(uint32_t material, uint32_t v1, uint32_t v2, uint32_t v3)
+	: v1(v1)
+	, v2(v2)
+	, v3(v3)
+	, material(material)
+    {}
+};
 
-	if (!(tmin < max && tmax > min))
-	    return nullptr;
+struct World {
+    vector<Material> materials;
+    vector<Sphere> spheres;
+    vector<Float> vertices;	// x, y, z per vertex
+    vector<Triangle> triangles;
 
-	// Then test object intersection.
-	Float d1 = 0;
-	Surface* r1 = left_->intersect(eye, ray, min, max, &d1);
-	if (right_) {
-	    Float d2 = 0;
-	    Surface* r2 = right_->intersect(eye, ray, min, max, &d2);
-	    if (r2 && (!r1 || d2 < d1)) {
-		*distance = d2;
-		return r2;
-	    }
-	}
-	*distance = d1;
-	return r1;
+    uint32_t material(const Material& m) {
+	materials.push_back(m);
+	return materials.size() - 1;
     }
 
-    Bounds bounds() {
-	return bounds_;
+    uint32_t vertex(V3P v) {
+	vertices.push_back(X(v));
+	vertices.push_back(Y(v));
+	vertices.push_back(Z(v));
+	return vertices.size()/3 - 1;
     }
 
-    Vec3 normal(V3P p) {
-	CRASH("Normal not implemented for Volume");
-	return Vec3Z();
+    Vec3 vertex(uint32_t i) const {
+	return Vec3B(vertices[3*i], vertices[3*i+1], vertices[3*i+2]);
     }
 
-    Vec3 center() {
-	CRASH("Center not implemented for Volume");
-	return Vec3Z();
+    Bounds bounds(const Triangle& t) const {
+	Vec3 v1 = vertex(t.v1);
+	Vec3 v2 = vertex(t.v2);
+	Vec3 v3 = vertex(t.v3);
+	return Bounds(vmin(v1, vmin(v2, v3)),
+                      vmax(v1, vmax(v2, v3)));
     }
 
-    void debug(void (*print)(const char* s), uint32_t level) {
-	print("[");
-	left_->debug(print, level+1);
-	if (right_) {
-	    print(",\n");
-	    for ( uint32_t i=0 ; i < level ; i++ )
-		print(" ");
-	    right_->debug(print, level+1);
-	}
-	print("]");
+    Vec3 centroid(const Triangle& t) const {
+	return divi(add(vertex(t.v1), add(vertex(t.v2), vertex(t.v3))), 3);
     }
 };
 
-class Jumble : public Surface
+// Read-only array for scene data.  Either it owns its elements, which are
+// appended with push_back while the scene is built, or it views elements that
+// live elsewhere, in the scene's block or a mapped scene cache file.
+
+template<typename T>
+class Array
 {
-    vector<Surface*> surfaces;
+    vector<T> storage;
+    const T* elems;
+    size_t length;
 
 public:
-    Jumble(vector<Surface*>& world)
-	: Surface(Material())
-    {
-	surfaces.assign(world.begin(), world.end());
-    }
+    Array() : elems(nullptr), length(0) {}
+    Array(const Array&) = delete;
+    Array& operator=(const Array&) = delete;
 
-    Surface* intersect(V3P eye, V3P ray, Float min, Float max, Float* distance) {
-	Surface* min_obj = nullptr;
-	Float min_dist = 1e100;
-
-	for ( Surface* surface : surfaces ) {
-	    Float dist = 0;
-	    Surface* obj = surface->intersect(eye, ray, min, max, &dist);
-	    if (obj) {
-		if (dist < min_dist) {
-		    min_obj = obj;
-		    min_dist = dist;
-		}
-	    }
-	}
-	*distance = min_dist;
-	return min_obj;
-    }
+    size_t size() const { return length; }
+    const T* data() const { return elems; }
+    const T& operator[](size_t i) const { return elems[i]; }
 
-    Vec3 normal(V3P p) {
-	CRASH("Normal not implemented for Jumble");
-	return Vec3Z();
+    void reserve(size_t n) {
+	storage.reserve(n);
+	elems = storage.data();
     }
 
-    Bounds bounds() {
-	CRASH("Bounds not implemented for Jumble");
-	return Bounds(Vec3Z(), Vec3Z());
+    void push_back(const T& x) {
+	storage.push_back(x);
+	elems = storage.data();
+	length = storage.size();
     }
 
-    Vec3 center() {
-	CRASH("Center not implemented for Jumble");
-	return Vec3Z();
+    void assign(const vector<T>& xs) {
+	storage = xs;
+	elems = storage.data();
+	length = storage.size();
     }
 
-    void debug(void (*print)(const char* s), uint32_t level) {
+    // Any owned elements are freed.
+    void view(const T* xs, size_t n) {
+	vector<T>().swap(storage);
+	elems = xs;
+	length = n;
     }
 };
 
-class Sphere : public Surface
-{
-    Vec3 center_;
-    Float radius_;
+// Primitive geometry for tracing, in structure-of-arrays form.  Primitives are
+// stored in groups of four so that a ray can be tested against a group with
+// single SIMD operations; incomplete groups are padded with primitives that are
+// never hit.  Data that are needed only for shading the nearest hit are kept
+// apart from the intersection data.
 
-public:
-    Sphere(const Material& material, V3P center, Float radius)
-	: Surface(material)
-	, center_(center)
-	, radius_(radius)
-    {}
+struct Spheres {
+    // Intersection data
+    Array<Float> cx, cy, cz;
+    Array<Float> r2;		// Radius squared, negative for padding
+    // Shading data
+    Array<Float> radius;
+    Array<uint32_t> material;
 
-    Surface* intersect(V3P eye, V3P ray, Float min, Float max, Float* distance) {
-	Float DdotD = dot(ray, ray);
-	Vec3 EminusC = sub(eye, center_);
-	Float B = dot(ray, EminusC);
-	Float disc = B*B - DdotD*(dot(EminusC,EminusC) - radius_*radius_);
-	if (disc < 0.0)
-	    return nullptr;
-	Float s1 = (-B + Sqrt(disc))/DdotD;
-	Float s2 = (-B - Sqrt(disc))/DdotD;
-	// Here return the smallest of s1 and s2 after filtering for _min and _max
-	if (s1 < min || s1 > max)
-	    s1 = SENTINEL;
-	if (s2 < min || s2 > max)
-	    s2 = SENTINEL;
-	Float dist = Min(s1, s2);
-	if (dist == SENTINEL)
-	    return nullptr;
-	*distance = dist;
-	return this;
+    uint32_t count;		// Not counting padding
+
+    Spheres() : count(0) {}
+
+    uint32_t size() const {
+	return cx.size();
     }
 
-    Vec3 normal(V3P p) {
-	return divi(sub(p, center_), radius_);
+    void reserve(size_t n) {
+	cx.reserve(n); cy.reserve(n); cz.reserve(n); r2.reserve(n);
+	radius.reserve(n); material.reserve(n);
     }
 
-    Bounds bounds() {
-	return Bounds(subi(center_, radius_), addi(center_, radius_));
+    void add(const Sphere& s) {
+	push(X(s.center), Y(s.center), Z(s.center), s.radius*s.radius, s.radius, s.material);
+	count++;
     }
 
-    Vec3 center() {
-	return center_;
+    void pad() {
+	// Given a negative r2 the discriminant is always negative.
+	while (size() % 4)
+	    push(0, 0, 0, -SENTINEL, 1, 0);
     }
 
-    void debug(void (*print)(const char* s), uint32_t level) {
-	char buf[256];
-	sprintf(buf, "(S c=(%g,%g,%g) r=%g)", X(center_), Y(center_), Z(center_), radius_);
-	print(buf);
+private:
+    void push(Float x, Float y, Float z, Float r2_, Float r, uint32_t m) {
+	cx.push_back(x);
+	cy.push_back(y);
+	cz.push_back(z);
+	r2.push_back(r2_);
+	radius.push_back(r);
+	material.push_back(m);
     }
 };
 
-class Triangle : public Surface
-{
-    Vec3 v1;
-    Vec3 v2;
-    Vec3 v3;
-    Vec3 norm;
+struct Triangles {
+    // Intersection data: the first vertex and the edges e1 = v2-v1, e2 = v3-v1,
+    // computed once here rather than per ray
+    Array<Float> v1x, v1y, v1z;
+    Array<Float> e1x, e1y, e1z;
+    Array<Float> e2x, e2y, e2z;
+    // Shading data
+    Array<Float> nx, ny, nz;
+    Array<uint32_t> material;
 
-public:
-    Triangle(const Material& material, V3P v1, V3P v2, V3P v3)
-	: Surface(material)
-	, v1(v1)
-	, v2(v2)
-	, v3(v3)
-	, norm(normalize(cross(sub(v2, v1), sub(v3, v1))))
-    {}
+    uint32_t count;		// Not counting padding
 
-    Surface* intersect(V3P eye, V3P ray, Float min, Float max, Float* distance) {
-	// TODO: observe that values that do not depend on ray can be
-	// precomputed and stored with the triangle (for a given eye position),
-	// at some (possibly significant) space cost.
-        Vec3 v1_minus_v2 = sub(v1, v2);
-        Vec3 v1_minus_v3 = sub(v1, v3);
-        Vec3 v1_minus_eye = sub(v1, eye);
-        Vec3 v1_minus_v2_x_v1_minus_eye = cross(v1_minus_v2, v1_minus_eye);
-        Vec3 v1_minus_v3_x_ray = cross(v1_minus_v3, ray);
-	Float M = dot(v1_minus_v2, v1_minus_v3_x_ray);
-        Float t = -(dot(v1_minus_v3, v1_minus_v2_x_v1_minus_eye)/M);
-	if (t < min || t > max)
-	    return nullptr;
-	Float gamma = dot(ray, v1_minus_v2_x_v1_minus_eye)/M;
-	if (gamma < 0 || gamma > 1.0)
-	    return nullptr;
-	Float beta = dot(v1_minus_eye, v1_minus_v3_x_ray)/M;
-	if (beta < 0.0 || beta > 1.0 - gamma)
-	    return nullptr;
-	*distance = t;
-	return this;
+    Triangles() : count(0) {}
+
+    uint32_t size() const {
+	return v1x.size();
     }
 
-    Vec3 normal(V3P p) {
-	return norm;
+    void reserve(size_t n) {
+	v1x.reserve(n); v1y.reserve(n); v1z.reserve(n);
+	e1x.reserve(n); e1y.reserve(n); e1z.reserve(n);
+	e2x.reserve(n); e2y.reserve(n); e2z.reserve(n);
+	nx.reserve(n); ny.reserve(n); nz.reserve(n);
+	material.reserve(n);
     }
 
-    Bounds bounds() {
-	return Bounds(vmin(v1, vmin(v2, v3)),
-                      vmax(v1, vmax(v2, v3)));
+    void add(const World& w, const Triangle& t) {
+	Vec3 v1 = w.vertex(t.v1);
+	Vec3 e1 = sub(w.vertex(t.v2), v1);
+	Vec3 e2 = sub(w.vertex(t.v3), v1);
+	push(v1, e1, e2, normalize(cross(e1, e2)), t.material);
+	count++;
     }
 
-    Vec3 center() {
-	return divi(add(v1, add(v2, v3)), 3);
+    void pad() {
+	// Given zero edges the determinant is zero and no test succeeds.
+	while (size() % 4)
+	    push(Vec3Z(), Vec3Z(), Vec3Z(), Vec3Z(), 0);
     }
 
-    void debug(void (*print)(const char* s), uint32_t level) {
-	char buf[1024];
-	sprintf(buf, "[T (%g,%g,%g) (%g,%g,%g) (%g,%g,%g)]", X(v1), Y(v1), Z(v1), X(v2), Y(v2), Z(v2), X(v3), Y(v3), Z(v3));
-	print(buf);
+private:
+    void push(V3P v1, V3P e1, V3P e2, V3P n, uint32_t m) {
+	v1x.push_back(X(v1)); v1y.push_back(Y(v1)); v1z.push_back(Z(v1));
+	e1x.push_back(X(e1)); e1y.push_back(Y(e1)); e1z.push_back(Z(e1));
+	e2x.push_back(X(e2)); e2y.push_back(Y(e2)); e2z.push_back(Z(e2));
+	nx.push_back(X(n)); ny.push_back(Y(n)); nz.push_back(Z(n));
+	material.push_back(m);
     }
 };
 
-// "Color" is a Vec3 representing RGB scaled by 256.
-// "RGBA" is a uint32_t representing r,g,b,a in the range 0..255
+// A reference to a primitive in a Scene: an index into Spheres or, with the
+// TRIANGLE bit set, into Triangles.
 
-Vec3 colorFromRGB(uint32_t r, uint32_t g, uint32_t b) {
-    return Vec3B(r/256.0, g/256.0, b/256.0);
-}
+typedef uint32_t PrimRef;
 
-uint32_t rgbaFromColor(V3P color)
-{
-    return (255<<24) | (uint32_t(255*Z(color))<<16) | (uint32_t(255*Y(color))<<8) | uint32_t(255*X(color));
-}
+static const PrimRef TRIANGLE = 0x80000000;
+static const PrimRef NOTHING = 0xFFFFFFFF;
 
-void componentsFromRgba(uint32_t rgba, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
-{
-    *r = rgba;
-    *g = (rgba >> 8);
-    *b = (rgba >> 16);
-    *a = (rgba >> 24);
-}
+// Bounding volume hierarchy node.  The nodes of a hierarchy are stored in one
+// flat array, two nodes to a cache line.  The two children of an interior node
+// are adjacent in the array.  A leaf references a range of either Spheres or
+// Triangles that starts at a group boundary.
 
-class Bitmap
-{
-    uint32_t height;
-    uint32_t width;
-    uint32_t* const data;
+struct BVHNode {
+    Float mins[3];
+    uint32_t leftFirst;		// Interior: index of left child, right is next; Leaf: first primitive
+    Float maxs[3];
+    uint32_t count;		// Interior: 0; Leaf: number of primitives, with TRIANGLE if triangles
+};
 
-public:
-    Bitmap(uint32_t height, uint32_t width, V3P color)
-	: height(height)
-	, width(width)
-	, data(new uint32_t[height*width])
-    {
-	if (!data)
-	    CRASH("Failed to allocate array");
+static const uint32_t BVH_MAX_DEPTH = 64;
 
-	uint32_t c = rgbaFromColor(color);
-	for ( uint32_t i=0, l=width*height ; i < l ; i++ )
-	    data[i] = c;
+struct Scene {
+    Array<Material> materials;
+    Spheres spheres;
+    Triangles triangles;
+    Array<BVHNode> nodes;	// Aligned to a cache line, root at index 0; empty if not partitioned
+
+    // Once the scene is complete all the arrays above live in this one block,
+    // see compact(), so that the scene is freed in one step.
+    char* block;
+    size_t block_size;
+    bool mapped;		// The block is a mapped scene cache file
+
+    Scene() : block(nullptr), block_size(0), mapped(false) {}
+
+    ~Scene() {
+	if (mapped)
+	    munmap(block, block_size);
+	else
+	    free(block);
     }
 
-    // For debugging only
-    uint32_t ref(uint32_t y, uint32_t x) {
-	return data[(height-y)*width + x];
+    const Material& material(PrimRef p) const {
+	if (p & TRIANGLE)
+	    return materials[triangles.material[p & ~TRIANGLE]];
+	return materials[spheres.material[p]];
     }
 
-    // Not a hot function
-    void setColor(uint32_t y, uint32_t x, V3P v) {
-	data[(height-y)*width + x] = rgbaFromColor(v);
+    Vec3 normal(PrimRef p, V3P point) const {
+	if (p & TRIANGLE) {
+	    uint32_t i = p & ~TRIANGLE;
+	    return Vec3B(triangles.nx[i], triangles.ny[i], triangles.nz[i]);
+	}
+	return divi(sub(point, Vec3B(spheres.cx[p], spheres.cy[p], spheres.cz[p])), spheres.radius[p]);
     }
 };
 
-
-////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
+//
+// Intersection kernels.  Each tests a ray against the primitives [first,
+// first+count) and updates *min_dist and *min_prim if one is hit at a distance
+// in [min, *min_dist).
+//
+// Occlusion kernels are for shadow rays: they only answer whether any of the
+// primitives is hit at a distance in [min, max), and return at the first hit.
 
-static Surface* setStage(Vec3* eye, Vec3* light, Vec3* background);
-static void trace(uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim, V3P eye, V3P light, V3P background, Surface* world, Bitmap* bits);
-
-int main(int argc, char** argv)
-{
-    Vec3 eye;
-    Vec3 light;
-    Vec3 background;
-    Surface* world;
+#ifdef USE_SIMD
 
-    {
-#ifdef RUNTIME
-	uint64_t then = timestamp();
-#endif
-	world = setStage(&eye, &light, &background);
-#ifdef RUNTIME
-	uint64_t now = timestamp();
-	printf("Setup time: %g ms\n", (now-then) / 1000.0);
-#endif
-    }
+// Four primitives per SIMD operation.  first must be at a group boundary, and
+// the padding of the last group is tested along with the primitives.
 
-    Bitmap bits(g_height, g_width, colorFromRGB(152, 251, 152));
+static inline Float hmin(v128_t a) {
+    v128_t b = wasm_f32x4_min(a, wasm_v32x4_shuffle(a, a, 2, 3, 0, 1));
+    return wasm_f32x4_extract_lane(wasm_f32x4_min(b, wasm_v32x4_shuffle(b, b, 1, 0, 3, 2)), 0);
+}
 
-    {
-#ifdef RUNTIME
-	uint64_t then = timestamp();
-#endif
-	trace(0, g_height, 0, g_width, eye, light, background, world, &bits);
-#ifdef RUNTIME
-	uint64_t now = timestamp();
-	printf("Render time: %g ms\n", (now-then) / 1000.0);
-#endif
+// Record the nearest of the distances in lanes selected by hit.
+static inline void nearest(v128_t dist, v128_t hit, uint32_t i, Float* min_dist, PrimRef* min_prim) {
+    dist = wasm_v128_bitselect(dist, wasm_f32x4_splat(SENTINEL), hit);
+    Float d = hmin(dist);
+    if (d < *min_dist) {
+	v128_t at = wasm_f32x4_eq(dist, wasm_f32x4_splat(d));
+	*min_dist = d;
+	*min_prim = wasm_i32x4_extract_lane(at, 0) ? i :
+		    wasm_i32x4_extract_lane(at, 1) ? i+1 :
+		    wasm_i32x4_extract_lane(at, 2) ? i+2 : i+3;
     }
+}
 
-#ifdef PPMX_STDOUT
-    printf("P6 %d %d 255\n", g_width, g_height);
-#endif
-
-#ifdef SDL_BROWSER
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_Surface *screen = SDL_SetVideoMode(g_width, g_height, 32, SDL_SWSURFACE);
-
-    if (SDL_MUSTLOCK(screen))
-	SDL_LockSurface(screen);
-#endif
-
-#if defined(SDL_BROWSER) || defined(PPMX_STDOUT)
-    for (uint32_t y = 0; y < g_height ; y++ ) {
-	for (uint32_t x = 0; x < g_width; x++) {
-	    uint8_t r, g, b, a;
-# ifdef SDL_BROWSER
-	    componentsFromRgba(bits.ref(y, x), &r, &g, &b, &a);
-            *((Uint32*)screen->pixels + (g_height-1-y) * g_width + x) = SDL_MapRGBA(screen->format, r, g, b, a);
-# endif
-# ifdef PPMX_STDOUT
-	    componentsFromRgba(bits.ref(g_height-1-y, x), &r, &g, &b, &a);
-            printf("!%x!%x!%x", r, g, b);
-# endif
-	}
+static inline void intersectSpheres(const Spheres& s, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float* min_dist, PrimRef* min_prim)
+{
+    Vec3x4 D = splat(ray);
+    Vec3x4 E = splat(eye);
+    v128_t DdotD = wasm_f32x4_splat(dot(ray, ray));
+    v128_t vmin = wasm_f32x4_splat(min);
+    for ( uint32_t i=first ; i < first+count ; i+=4 ) {
+	Vec3x4 C = { wasm_v128_load(&s.cx[i]), wasm_v128_load(&s.cy[i]), wasm_v128_load(&s.cz[i]) };
+	Vec3x4 EminusC = sub(E, C);
+	v128_t B = dot(D, EminusC);
+	v128_t disc = wasm_f32x4_sub(wasm_f32x4_mul(B, B),
+				     wasm_f32x4_mul(DdotD, wasm_f32x4_sub(dot(EminusC, EminusC),
+									  wasm_v128_load(&s.r2[i]))));
+	v128_t hit = wasm_f32x4_ge(disc, wasm_f32x4_splat(0));
+	if (!wasm_i32x4_any_true(hit))
+	    continue;
+	v128_t root = wasm_f32x4_sqrt(disc);
+	v128_t s1 = wasm_f32x4_div(wasm_f32x4_add(wasm_f32x4_neg(B), root), DdotD);
+	v128_t s2 = wasm_f32x4_div(wasm_f32x4_sub(wasm_f32x4_neg(B), root), DdotD);
+	// s2 <= s1, so the nearest is s2 if it is in range.
+	v128_t vmax = wasm_f32x4_splat(*min_dist);
+	v128_t ok1 = wasm_v128_and(wasm_f32x4_ge(s1, vmin), wasm_f32x4_lt(s1, vmax));
+	v128_t ok2 = wasm_v128_and(wasm_f32x4_ge(s2, vmin), wasm_f32x4_lt(s2, vmax));
+	hit = wasm_v128_and(hit, wasm_v128_or(ok1, ok2));
+	nearest(wasm_v128_bitselect(s2, s1, ok2), hit, i, min_dist, min_prim);
     }
-#endif
+}
 
-#ifdef SDL_BROWSER
-    if (SDL_MUSTLOCK(screen))
-	SDL_UnlockSurface(screen);
-#endif
+// Moller-Trumbore.  The barycentric coordinates u and v are tested scaled by
+// the determinant, with its sign folded in, so that groups that miss are
+// rejected before the one division, which computes t.
 
-#ifdef PPMX_STDOUT
-    printf("\n");
-#endif
+static inline void intersectTriangles(const Triangles& tr, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float* min_dist, PrimRef* min_prim)
+{
+    Vec3x4 D = splat(ray);
+    Vec3x4 E = splat(eye);
+    v128_t vmin = wasm_f32x4_splat(min);
+    v128_t zero = wasm_f32x4_splat(0);
+    v128_t signbit = wasm_i32x4_splat(0x80000000);
+    for ( uint32_t i=first ; i < first+count ; i+=4 ) {
+	Vec3x4 e1 = { wasm_v128_load(&tr.e1x[i]), wasm_v128_load(&tr.e1y[i]), wasm_v128_load(&tr.e1z[i]) };
+	Vec3x4 e2 = { wasm_v128_load(&tr.e2x[i]), wasm_v128_load(&tr.e2y[i]), wasm_v128_load(&tr.e2z[i]) };
+	Vec3x4 pvec = cross(D, e2);
+	v128_t det = dot(e1, pvec);
+	v128_t sign = wasm_v128_and(det, signbit);
+	v128_t adet = wasm_v128_xor(det, sign);
+	Vec3x4 v1 = { wasm_v128_load(&tr.v1x[i]), wasm_v128_load(&tr.v1y[i]), wasm_v128_load(&tr.v1z[i]) };
+	Vec3x4 tvec = sub(E, v1);
+	v128_t u = wasm_v128_xor(dot(tvec, pvec), sign);
+	// Zero determinant (parallel ray, or padding) fails adet > 0.
+	v128_t hit = wasm_v128_and(wasm_f32x4_gt(adet, zero),
+				   wasm_v128_and(wasm_f32x4_ge(u, zero), wasm_f32x4_le(u, adet)));
+	if (!wasm_i32x4_any_true(hit))
+	    continue;
+	Vec3x4 qvec = cross(tvec, e1);
+	v128_t v = wasm_v128_xor(dot(D, qvec), sign);
+	hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(v, zero),
+					       wasm_f32x4_le(wasm_f32x4_add(u, v), adet)));
+	if (!wasm_i32x4_any_true(hit))
+	    continue;
+	v128_t t = wasm_f32x4_div(wasm_v128_xor(dot(e2, qvec), sign), adet);
+	hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(t, vmin), wasm_f32x4_lt(t, wasm_f32x4_splat(*min_dist))));
+	if (wasm_i32x4_any_true(hit))
+	    nearest(t, hit, i, min_dist, min_prim);
+    }
 }
 
+static inline bool occludedSpheres(const Spheres& s, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float max)
+{
+    Vec3x4 D = splat(ray);
+    Vec3x4 E = splat(eye);
+    v128_t DdotD = wasm_f32x4_splat(dot(ray, ray));
+    v128_t vmin = wasm_f32x4_splat(min);
+    v128_t vmax = wasm_f32x4_splat(max);
+    for ( uint32_t i=first ; i < first+count ; i+=4 ) {
+	Vec3x4 C = { wasm_v128_load(&s.cx[i]), wasm_v128_load(&s.cy[i]), wasm_v128_load(&s.cz[i]) };
+	Vec3x4 EminusC = sub(E, C);
+	v128_t B = dot(D, EminusC);
+	v128_t disc = wasm_f32x4_sub(wasm_f32x4_mul(B, B),
+				     wasm_f32x4_mul(DdotD, wasm_f32x4_sub(dot(EminusC, EminusC),
+									  wasm_v128_load(&s.r2[i]))));
+	v128_t hit = wasm_f32x4_ge(disc, wasm_f32x4_splat(0));
+	if (!wasm_i32x4_any_true(hit))
+	    continue;
+	v128_t root = wasm_f32x4_sqrt(disc);
+	v128_t s1 = wasm_f32x4_div(wasm_f32x4_add(wasm_f32x4_neg(B), root), DdotD);
+	v128_t s2 = wasm_f32x4_div(wasm_f32x4_sub(wasm_f32x4_neg(B), root), DdotD);
+	v128_t ok1 = wasm_v128_and(wasm_f32x4_ge(s1, vmin), wasm_f32x4_lt(s1, vmax));
+	v128_t ok2 = wasm_v128_and(wasm_f32x4_ge(s2, vmin), wasm_f32x4_lt(s2, vmax));
+	if (wasm_i32x4_any_true(wasm_v128_and(hit, wasm_v128_or(ok1, ok2))))
+	    return true;
+    }
+    return false;
+}
 
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-
-static Vec3 g_eye;
-static Vec3 g_background;
-static Vec3 g_light;
-static Surface* g_world;
-static Bitmap* g_bits;
-
-static void traceWithoutAntialias(uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim);
-static void traceWithAntialias(uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim);
-static Vec3 raycolor(V3P eye, V3P ray, Float t0, Float t1, uint32_t depth);
-
-static void trace(uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim, V3P eye, V3P light, V3P background, Surface* world, Bitmap* bits)
-{
-    // Easiest to keep these in globals.
-    g_eye = eye;
-    g_light = light;
-    g_background = background;
-    g_world = world;
-    g_bits = bits;
-    if (g_antialias)
-	traceWithAntialias(ymin, ylim, xmin, xlim);
-    else
-	traceWithoutAntialias(ymin, ylim, xmin, xlim);
+static inline bool occludedTriangles(const Triangles& tr, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float max)
+{
+    Vec3x4 D = splat(ray);
+    Vec3x4 E = splat(eye);
+    v128_t zero = wasm_f32x4_splat(0);
+    v128_t signbit = wasm_i32x4_splat(0x80000000);
+    for ( uint32_t i=first ; i < first+count ; i+=4 ) {
+	Vec3x4 e1 = { wasm_v128_load(&tr.e1x[i]), wasm_v128_load(&tr.e1y[i]), wasm_v128_load(&tr.e1z[i]) };
+	Vec3x4 e2 = { wasm_v128_load(&tr.e2x[i]), wasm_v128_load(&tr.e2y[i]), wasm_v128_load(&tr.e2z[i]) };
+	Vec3x4 pvec = cross(D, e2);
+	v128_t det = dot(e1, pvec);
+	v128_t sign = wasm_v128_and(det, signbit);
+	v128_t adet = wasm_v128_xor(det, sign);
+	Vec3x4 v1 = { wasm_v128_load(&tr.v1x[i]), wasm_v128_load(&tr.v1y[i]), wasm_v128_load(&tr.v1z[i]) };
+	Vec3x4 tvec = sub(E, v1);
+	v128_t u = wasm_v128_xor(dot(tvec, pvec), sign);
+	v128_t hit = wasm_v128_and(wasm_f32x4_gt(adet, zero),
+				   wasm_v128_and(wasm_f32x4_ge(u, zero), wasm_f32x4_le(u, adet)));
+	if (!wasm_i32x4_any_true(hit))
+	    continue;
+	Vec3x4 qvec = cross(tvec, e1);
+	v128_t v = wasm_v128_xor(dot(D, qvec), sign);
+	hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(v, zero),
+					       wasm_f32x4_le(wasm_f32x4_add(u, v), adet)));
+	if (!wasm_i32x4_any_true(hit))
+	    continue;
+	// t in [min, max) is t*adet in [min*adet, max*adet), so no division.
+	v128_t tdet = wasm_v128_xor(dot(e2, qvec), sign);
+	hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(tdet, wasm_f32x4_mul(wasm_f32x4_splat(min), adet)),
+					       wasm_f32x4_lt(tdet, wasm_f32x4_mul(wasm_f32x4_splat(max), adet))));
+	if (wasm_i32x4_any_true(hit))
+	    return true;
+    }
+    return false;
 }
 
-static void traceWithoutAntialias(uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+#else
+
+static inline void intersectSpheres(const Spheres& s, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float* min_dist, PrimRef* min_prim)
 {
-    for ( uint32_t h=ymin ; h < ylim ; h++ ) {
-	for ( uint32_t w=xmin ; w < xlim ; w++ ) {
-	    Float u = g_left + (g_right - g_left)*(w + 0.5)/g_width;
-	    Float v = g_bottom + (g_top - g_bottom)*(h + 0.5)/g_height;
-	    Vec3 ray = Vec3B(u, v, -Z(g_eye));
-	    Vec3 col = raycolor(g_eye, ray, 0, SENTINEL, g_reflection_depth);
-	    g_bits->setColor(h, w, col);
+    Float DdotD = dot(ray, ray);
+    for ( uint32_t i=first ; i < first+count ; i++ ) {
+	Vec3 EminusC = sub(eye, Vec3B(s.cx[i], s.cy[i], s.cz[i]));
+	Float B = dot(ray, EminusC);
+	Float disc = B*B - DdotD*(dot(EminusC,EminusC) - s.r2[i]);
+	if (disc < 0.0)
+	    continue;
+	Float s1 = (-B + Sqrt(disc))/DdotD;
+	Float s2 = (-B - Sqrt(disc))/DdotD;
+	// Here return the smallest of s1 and s2 after filtering for _min and _max
+	if (s1 < min || s1 > *min_dist)
+	    s1 = SENTINEL;
+	if (s2 < min || s2 > *min_dist)
+	    s2 = SENTINEL;
+	Float dist = Min(s1, s2);
+	if (dist < *min_dist) {
+	    *min_dist = dist;
+	    *min_prim = i;
 	}
     }
 }
 
-static const Float random_numbers[] = {
-    0.495,0.840,0.636,0.407,0.026,0.547,0.223,0.349,0.033,0.643,0.558,0.481,0.039,
-    0.175,0.169,0.606,0.638,0.364,0.709,0.814,0.206,0.346,0.812,0.603,0.969,0.888,
-    0.294,0.824,0.410,0.467,0.029,0.706,0.314
-};
+// Moller-Trumbore, with u and v tested before the division as above.
 
-static void traceWithAntialias(uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+static inline void intersectTriangles(const Triangles& tr, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float* min_dist, PrimRef* min_prim)
 {
-    uint32_t k = 0;
-    for ( uint32_t h=ymin ; h < ylim ; h++ ) {
-	for ( uint32_t w=xmin ; w < xlim ; w++ ) {
-	    // Simple stratified sampling, cf Shirley&Marschner ch 13 and a fast "random" function.
-	    const uint32_t n = 4;
-	    //var k = h % 32;
-	    uint32_t rand = k % 2;
-	    Vec3 c = Vec3Z();
-	    k++;
-	    for ( uint32_t p=0 ; p < n ; p++ ) {
-		for ( uint32_t q=0 ; q < n ; q++ ) {
-		    Float jx = random_numbers[rand]; rand=rand+1;
-		    Float jy = random_numbers[rand]; rand=rand+1;
-		    Float u = g_left + (g_right - g_left)*(w + (p + jx)/n)/g_width;
-		    Float v = g_bottom + (g_top - g_bottom)*(h + (q + jy)/n)/g_height;
-		    Vec3 ray = Vec3B(u, v, -Z(g_eye));
-		    c = add(c, raycolor(g_eye, ray, 0.0, SENTINEL, g_reflection_depth));
-		}
-	    }
-	    g_bits->setColor(h, w, divi(c, n*n));
-	}
+    for ( uint32_t i=first ; i < first+count ; i++ ) {
+	Vec3 e1 = Vec3B(tr.e1x[i], tr.e1y[i], tr.e1z[i]);
+	Vec3 e2 = Vec3B(tr.e2x[i], tr.e2y[i], tr.e2z[i]);
+	Vec3 pvec = cross(ray, e2);
+	Float det = dot(e1, pvec);
+	Float sign = det < 0 ? -1 : 1;
+	Float adet = det * sign;
+	if (!(adet > 0))
+	    continue;
+	Vec3 tvec = sub(eye, Vec3B(tr.v1x[i], tr.v1y[i], tr.v1z[i]));
+	Float u = dot(tvec, pvec) * sign;
+	if (u < 0 || u > adet)
+	    continue;
+	Vec3 qvec = cross(tvec, e1);
+	Float v = dot(ray, qvec) * sign;
+	if (v < 0 || u + v > adet)
+	    continue;
+	Float t = dot(e2, qvec) * sign / adet;
+	if (t < min || t >= *min_dist)
+	    continue;
+	*min_dist = t;
+	*min_prim = i;
     }
 }
 
-// Clamping c is not necessary provided the three color components by
+static inline bool occludedSpheres(const Spheres& s, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float max)
+{
+    Float DdotD = dot(ray, ray);
+    for ( uint32_t i=first ; i < first+count ; i++ ) {
+	Vec3 EminusC = sub(eye, Vec3B(s.cx[i], s.cy[i], s.cz[i]));
+	Float B = dot(ray, EminusC);
+	Float disc = B*B - DdotD*(dot(EminusC,EminusC) - s.r2[i]);
+	if (disc < 0.0)
+	    continue;
+	Float s1 = (-B + Sqrt(disc))/DdotD;
+	Float s2 = (-B - Sqrt(disc))/DdotD;
+	if ((s1 >= min && s1 < max) || (s2 >= min && s2 < max))
+	    return true;
+    }
+    return false;
+}
+
+static inline bool occludedTriangles(const Triangles& tr, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float max)
+{
+    for ( uint32_t i=first ; i < first+count ; i++ ) {
+	Vec3 e1 = Vec3B(tr.e1x[i], tr.e1y[i], tr.e1z[i]);
+	Vec3 e2 = Vec3B(tr.e2x[i], tr.e2y[i], tr.e2z[i]);
+	Vec3 pvec = cross(ray, e2);
+	Float det = dot(e1, pvec);
+	Float sign = det < 0 ? -1 : 1;
+	Float adet = det * sign;
+	if (!(adet > 0))
+	    continue;
+	Vec3 tvec = sub(eye, Vec3B(tr.v1x[i], tr.v1y[i], tr.v1z[i]));
+	Float u = dot(tvec, pvec) * sign;
+	if (u < 0 || u > adet)
+	    continue;
+	Vec3 qvec = cross(tvec, e1);
+	Float v = dot(ray, qvec) * sign;
+	if (v < 0 || u + v > adet)
+	    continue;
+	// As above, without the division
+	Float tdet = dot(e2, qvec) * sign;
+	if (tdet >= min*adet && tdet < max*adet)
+	    return true;
+    }
+    return false;
+}
+
+#endif // !USE_SIMD
+
+#ifdef PACKETS
+
+// Packet kernels test the rays of a packet selected by `active` against one
+// primitive.  For every lane that hits the primitive at a distance in [min,
+// max) the lane of *max is updated with that distance and hits[lane] with the
+// primitive.  They return the mask of lanes that were updated.
+
+static inline void setHits(PrimRef* hits, v128_t mask, PrimRef p) {
+    if (wasm_i32x4_extract_lane(mask, 0)) hits[0] = p;
+    if (wasm_i32x4_extract_lane(mask, 1)) hits[1] = p;
+    if (wasm_i32x4_extract_lane(mask, 2)) hits[2] = p;
+    if (wasm_i32x4_extract_lane(mask, 3)) hits[3] = p;
+}
+
+static inline v128_t intersectSphere4(const Spheres& s, uint32_t i, const Ray4& rays, v128_t active, Float min, v128_t* max, PrimRef* hits)
+{
+    v128_t DdotD = dot(rays.dir, rays.dir);
+    Vec3x4 C = { wasm_f32x4_splat(s.cx[i]), wasm_f32x4_splat(s.cy[i]), wasm_f32x4_splat(s.cz[i]) };
+    Vec3x4 EminusC = sub(rays.origin, C);
+    v128_t B = dot(rays.dir, EminusC);
+    v128_t disc = wasm_f32x4_sub(wasm_f32x4_mul(B, B),
+				 wasm_f32x4_mul(DdotD, wasm_f32x4_sub(dot(EminusC, EminusC),
+								      wasm_f32x4_splat(s.r2[i]))));
+    v128_t hit = wasm_v128_and(active, wasm_f32x4_ge(disc, wasm_f32x4_splat(0)));
+    if (!wasm_i32x4_any_true(hit))
+	return hit;
+    v128_t root = wasm_f32x4_sqrt(disc);
+    v128_t s1 = wasm_f32x4_div(wasm_f32x4_add(wasm_f32x4_neg(B), root), DdotD);
+    v128_t s2 = wasm_f32x4_div(wasm_f32x4_sub(wasm_f32x4_neg(B), root), DdotD);
+    v128_t vmin = wasm_f32x4_splat(min);
+    v128_t ok1 = wasm_v128_and(wasm_f32x4_ge(s1, vmin), wasm_f32x4_lt(s1, *max));
+    v128_t ok2 = wasm_v128_and(wasm_f32x4_ge(s2, vmin), wasm_f32x4_lt(s2, *max));
+    hit = wasm_v128_and(hit, wasm_v128_or(ok1, ok2));
+    *max = wasm_v128_bitselect(wasm_v128_bitselect(s2, s1, ok2), *max, hit);
+    setHits(hits, hit, i);
+    return hit;
+}
+
+static inline v128_t intersectTriangle4(const Triangles& tr, uint32_t i, const Ray4& rays, v128_t active, Float min, v128_t* max, PrimRef* hits)
+{
+    v128_t zero = wasm_f32x4_splat(0);
+    Vec3x4 e1 = { wasm_f32x4_splat(tr.e1x[i]), wasm_f32x4_splat(tr.e1y[i]), wasm_f32x4_splat(tr.e1z[i]) };
+    Vec3x4 e2 = { wasm_f32x4_splat(tr.e2x[i]), wasm_f32x4_splat(tr.e2y[i]), wasm_f32x4_splat(tr.e2z[i]) };
+    Vec3x4 pvec = cross(rays.dir, e2);
+    v128_t det = dot(e1, pvec);
+    v128_t sign = wasm_v128_and(det, wasm_i32x4_splat(0x80000000));
+    v128_t adet = wasm_v128_xor(det, sign);
+    Vec3x4 v1 = { wasm_f32x4_splat(tr.v1x[i]), wasm_f32x4_splat(tr.v1y[i]), wasm_f32x4_splat(tr.v1z[i]) };
+    Vec3x4 tvec = sub(rays.origin, v1);
+    v128_t u = wasm_v128_xor(dot(tvec, pvec), sign);
+    v128_t hit = wasm_v128_and(active, wasm_f32x4_gt(adet, zero));
+    hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(u, zero), wasm_f32x4_le(u, adet)));
+    if (!wasm_i32x4_any_true(hit))
+	return hit;
+    Vec3x4 qvec = cross(tvec, e1);
+    v128_t v = wasm_v128_xor(dot(rays.dir, qvec), sign);
+    hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(v, zero),
+					   wasm_f32x4_le(wasm_f32x4_add(u, v), adet)));
+    if (!wasm_i32x4_any_true(hit))
+	return hit;
+    v128_t t = wasm_f32x4_div(wasm_v128_xor(dot(e2, qvec), sign), adet);
+    hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(t, wasm_f32x4_splat(min)), wasm_f32x4_lt(t, *max)));
+    *max = wasm_v128_bitselect(t, *max, hit);
+    setHits(hits, hit, i | TRIANGLE);
+    return hit;
+}
+
+// Packet occlusion kernels return the mask of the `active` lanes that hit the
+// primitive at a distance in [min, max).
+
+static inline v128_t occludeSphere4(const Spheres& s, uint32_t i, const Ray4& rays, v128_t active, Float min, v128_t max)
+{
+    v128_t DdotD = dot(rays.dir, rays.dir);
+    Vec3x4 C = { wasm_f32x4_splat(s.cx[i]), wasm_f32x4_splat(s.cy[i]), wasm_f32x4_splat(s.cz[i]) };
+    Vec3x4 EminusC = sub(rays.origin, C);
+    v128_t B = dot(rays.dir, EminusC);
+    v128_t disc = wasm_f32x4_sub(wasm_f32x4_mul(B, B),
+				 wasm_f32x4_mul(DdotD, wasm_f32x4_sub(dot(EminusC, EminusC),
+								      wasm_f32x4_splat(s.r2[i]))));
+    v128_t hit = wasm_v128_and(active, wasm_f32x4_ge(disc, wasm_f32x4_splat(0)));
+    if (!wasm_i32x4_any_true(hit))
+	return hit;
+    v128_t root = wasm_f32x4_sqrt(disc);
+    v128_t s1 = wasm_f32x4_div(wasm_f32x4_add(wasm_f32x4_neg(B), root), DdotD);
+    v128_t s2 = wasm_f32x4_div(wasm_f32x4_sub(wasm_f32x4_neg(B), root), DdotD);
+    v128_t vmin = wasm_f32x4_splat(min);
+    v128_t ok1 = wasm_v128_and(wasm_f32x4_ge(s1, vmin), wasm_f32x4_lt(s1, max));
+    v128_t ok2 = wasm_v128_and(wasm_f32x4_ge(s2, vmin), wasm_f32x4_lt(s2, max));
+    return wasm_v128_and(hit, wasm_v128_or(ok1, ok2));
+}
+
+static inline v128_t occludeTriangle4(const Triangles& tr, uint32_t i, const Ray4& rays, v128_t active, Float min, v128_t max)
+{
+    v128_t zero = wasm_f32x4_splat(0);
+    Vec3x4 e1 = { wasm_f32x4_splat(tr.e1x[i]), wasm_f32x4_splat(tr.e1y[i]), wasm_f32x4_splat(tr.e1z[i]) };
+    Vec3x4 e2 = { wasm_f32x4_splat(tr.e2x[i]), wasm_f32x4_splat(tr.e2y[i]), wasm_f32x4_splat(tr.e2z[i]) };
+    Vec3x4 pvec = cross(rays.dir, e2);
+    v128_t det = dot(e1, pvec);
+    v128_t sign = wasm_v128_and(det, wasm_i32x4_splat(0x80000000));
+    v128_t adet = wasm_v128_xor(det, sign);
+    Vec3x4 v1 = { wasm_f32x4_splat(tr.v1x[i]), wasm_f32x4_splat(tr.v1y[i]), wasm_f32x4_splat(tr.v1z[i]) };
+    Vec3x4 tvec = sub(rays.origin, v1);
+    v128_t u = wasm_v128_xor(dot(tvec, pvec), sign);
+    v128_t hit = wasm_v128_and(active, wasm_f32x4_gt(adet, zero));
+    hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(u, zero), wasm_f32x4_le(u, adet)));
+    if (!wasm_i32x4_any_true(hit))
+	return hit;
+    Vec3x4 qvec = cross(tvec, e1);
+    v128_t v = wasm_v128_xor(dot(rays.dir, qvec), sign);
+    hit = wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(v, zero),
+					   wasm_f32x4_le(wasm_f32x4_add(u, v), adet)));
+    if (!wasm_i32x4_any_true(hit))
+	return hit;
+    v128_t tdet = wasm_v128_xor(dot(e2, qvec), sign);
+    return wasm_v128_and(hit, wasm_v128_and(wasm_f32x4_ge(tdet, wasm_f32x4_mul(wasm_f32x4_splat(min), adet)),
+					    wasm_f32x4_lt(tdet, wasm_f32x4_mul(max, adet))));
+}
+
+#endif // PACKETS
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Scene intersection.
+
+// Ray/box test by the slab method, for a ray whose direction has been inverted
+// component-wise.  Returns true if the ray enters the box before max and leaves
+// it after min, and then *tnear is the entry distance.
+
+static inline bool slabs(const BVHNode& node, V3P eye, V3P inv_ray, Float min, Float max, Float* tnear) {
+    Vec3 a_times_mins_minus_eye = mul(inv_ray, sub(Vec3L(node.mins), eye));
+    Vec3 a_times_maxs_minus_eye = mul(inv_ray, sub(Vec3L(node.maxs), eye));
+    Bool3 a_ge_0 = vpositive(inv_ray);
+    Vec3 mins = bitselect(a_times_mins_minus_eye, a_times_maxs_minus_eye, a_ge_0);
+    Vec3 maxs = bitselect(a_times_maxs_minus_eye, a_times_mins_minus_eye, a_ge_0);
+    Float tmin = Max(X(mins), Max(Y(mins), Z(mins)));
+    Float tmax = Min(X(maxs), Min(Y(maxs), Z(maxs)));
+    if (tmin > tmax || !(tmin < max && tmax > min))
+	return false;
+    *tnear = tmin;
+    return true;
+}
+
+static inline void intersectLeaf(const Scene& scene, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float* min_dist, PrimRef* min_prim)
+{
+    if (count & TRIANGLE) {
+	PrimRef p = NOTHING;
+	intersectTriangles(scene.triangles, first, count & ~TRIANGLE, eye, ray, min, min_dist, &p);
+	if (p != NOTHING)
+	    *min_prim = p | TRIANGLE;
+    } else {
+	intersectSpheres(scene.spheres, first, count, eye, ray, min, min_dist, min_prim);
+    }
+}
+
+// Returns the nearest primitive hit by the ray at a distance in [min, max), or
+// NOTHING.  The BVH is traversed iteratively, nearer child first.  The farther
+// child is stacked with its entry distance and is skipped when it is popped if
+// a hit closer than that distance has been found in the meantime.
+
+static PrimRef intersect(const Scene& scene, V3P eye, V3P ray, Float min, Float max, Float* distance)
+{
+    PrimRef min_prim = NOTHING;
+    Float min_dist = max;
+
+    if (!scene.nodes.size()) {
+	intersectLeaf(scene, 0, scene.spheres.count, eye, ray, min, &min_dist, &min_prim);
+	intersectLeaf(scene, 0, scene.triangles.count | TRIANGLE, eye, ray, min, &min_dist, &min_prim);
+	*distance = min_dist;
+	return min_prim;
+    }
+
+    const BVHNode* nodes = scene.nodes.data();
+    struct { uint32_t node; Float tnear; } stack[BVH_MAX_DEPTH];
+    uint32_t sp = 0;
+    Vec3 a = inv(ray);
+    Float tnear;
+
+    if (!slabs(nodes[0], eye, a, min, max, &tnear))
+	return NOTHING;
+
+    uint32_t ni = 0;
+    for (;;) {
+	const BVHNode& node = nodes[ni];
+	if (node.count) {
+	    intersectLeaf(scene, node.leftFirst, node.count, eye, ray, min, &min_dist, &min_prim);
+	} else {
+	    uint32_t left = node.leftFirst;
+	    uint32_t right = left + 1;
+	    Float tleft = 0, tright = 0;
+	    bool hitleft = slabs(nodes[left], eye, a, min, min_dist, &tleft);
+	    bool hitright = slabs(nodes[right], eye, a, min, min_dist, &tright);
+	    if (hitleft && hitright) {
+		if (tright < tleft) {
+		    stack[sp].node = left;
+		    stack[sp].tnear = tleft;
+		    ni = right;
+		} else {
+		    stack[sp].node = right;
+		    stack[sp].tnear = tright;
+		    ni = left;
+		}
+		sp++;
+		continue;
+	    }
+	    if (hitleft) {
+		ni = left;
+		continue;
+	    }
+	    if (hitright) {
+		ni = right;
+		continue;
+	    }
+	}
+	for (;;) {
+	    if (sp == 0) {
+		*distance = min_dist;
+		return min_prim;
+	    }
+	    --sp;
+	    if (stack[sp].tnear <= min_dist) {
+		ni = stack[sp].node;
+		break;
+	    }
+	}
+    }
+}
+
+static inline bool occludedLeaf(const Scene& scene, uint32_t first, uint32_t count, V3P eye, V3P ray, Float min, Float max)
+{
+    if (count & TRIANGLE)
+	return occludedTriangles(scene.triangles, first, count & ~TRIANGLE, eye, ray, min, max);
+    return occludedSpheres(scene.spheres, first, count, eye, ray, min, max);
+}
+
+// Returns true if the ray hits any primitive at a distance in [min, max).  The
+// traversal stops at the first hit, and as there is no nearest hit to narrow
+// the search the children of a node are visited in either order.
+
+static bool occluded(const Scene& scene, V3P eye, V3P ray, Float min, Float max)
+{
+    if (!scene.nodes.size()) {
+	return occludedLeaf(scene, 0, scene.spheres.count, eye, ray, min, max) ||
+	       occludedLeaf(scene, 0, scene.triangles.count | TRIANGLE, eye, ray, min, max);
+    }
+
+    const BVHNode* nodes = scene.nodes.data();
+    uint32_t stack[BVH_MAX_DEPTH];
+    uint32_t sp = 0;
+    Vec3 a = inv(ray);
+    Float tnear;
+
+    if (!slabs(nodes[0], eye, a, min, max, &tnear))
+	return false;
+
+    uint32_t ni = 0;
+    for (;;) {
+	const BVHNode& node = nodes[ni];
+	if (node.count) {
+	    if (occludedLeaf(scene, node.leftFirst, node.count, eye, ray, min, max))
+		return true;
+	} else {
+	    uint32_t left = node.leftFirst;
+	    bool hitleft = slabs(nodes[left], eye, a, min, max, &tnear);
+	    bool hitright = slabs(nodes[left+1], eye, a, min, max, &tnear);
+	    if (hitleft && hitright)
+		stack[sp++] = left+1;
+	    if (hitleft || hitright) {
+		ni = hitleft ? left : left+1;
+		continue;
+	    }
+	}
+	if (sp == 0)
+	    return false;
+	ni = stack[--sp];
+    }
+}
+
+#ifdef PACKETS
+
+// Packet version of the slab test: returns the mask of the `active` lanes whose
+// rays enter the box before the lane's max and leave it after min, with the
+// entry distances in *tnear.  inv_ray must come from slabsInv().
+
+static inline v128_t slabs4(const BVHNode& node, const Vec3x4& eye, const Vec3x4& inv_ray, v128_t active, Float min, v128_t max, v128_t* tnear) {
+    v128_t t0x = wasm_f32x4_mul(wasm_f32x4_sub(wasm_f32x4_splat(node.mins[0]), eye.x), inv_ray.x);
+    v128_t t1x = wasm_f32x4_mul(wasm_f32x4_sub(wasm_f32x4_splat(node.maxs[0]), eye.x), inv_ray.x);
+    v128_t t0y = wasm_f32x4_mul(wasm_f32x4_sub(wasm_f32x4_splat(node.mins[1]), eye.y), inv_ray.y);
+    v128_t t1y = wasm_f32x4_mul(wasm_f32x4_sub(wasm_f32x4_splat(node.maxs[1]), eye.y), inv_ray.y);
+    v128_t t0z = wasm_f32x4_mul(wasm_f32x4_sub(wasm_f32x4_splat(node.mins[2]), eye.z), inv_ray.z);
+    v128_t t1z = wasm_f32x4_mul(wasm_f32x4_sub(wasm_f32x4_splat(node.maxs[2]), eye.z), inv_ray.z);
+    v128_t tmin = wasm_f32x4_max(wasm_f32x4_max(wasm_f32x4_min(t0x, t1x), wasm_f32x4_min(t0y, t1y)),
+                                 wasm_f32x4_min(t0z, t1z));
+    v128_t tmax = wasm_f32x4_min(wasm_f32x4_min(wasm_f32x4_max(t0x, t1x), wasm_f32x4_max(t0y, t1y)),
+                                 wasm_f32x4_max(t0z, t1z));
+    v128_t hit = wasm_v128_and(active, wasm_f32x4_le(tmin, tmax));
+    hit = wasm_v128_and(hit, wasm_f32x4_lt(tmin, max));
+    hit = wasm_v128_and(hit, wasm_f32x4_gt(tmax, wasm_f32x4_splat(min)));
+    *tnear = tmin;
+    return hit;
+}
+
+// Component-wise inverse of ray directions for slabs4().  Zero components are
+// replaced by a tiny number of the same sign so that a ray parallel to a slab
+// and starting in its boundary plane yields 0 rather than NaN (0 * inf), which
+// would otherwise poison the min and max.
+
+static inline Vec3x4 slabsInv(const Vec3x4& dir) {
+    v128_t zero = wasm_f32x4_splat(0);
+    v128_t sign = wasm_i32x4_splat(0x80000000);
+    v128_t tiny = wasm_f32x4_splat(1e-30);
+    Vec3x4 d = { wasm_v128_bitselect(wasm_v128_or(wasm_v128_and(dir.x, sign), tiny), dir.x, wasm_f32x4_eq(dir.x, zero)),
+                 wasm_v128_bitselect(wasm_v128_or(wasm_v128_and(dir.y, sign), tiny), dir.y, wasm_f32x4_eq(dir.y, zero)),
+                 wasm_v128_bitselect(wasm_v128_or(wasm_v128_and(dir.z, sign), tiny), dir.z, wasm_f32x4_eq(dir.z, zero)) };
+    return inv(d);
+}
+
+static inline v128_t intersectLeaf4(const Scene& scene, uint32_t first, uint32_t count, const Ray4& rays, v128_t active, Float min, v128_t* max, PrimRef* hits)
+{
+    v128_t updated = wasm_i32x4_const(0, 0, 0, 0);
+    if (count & TRIANGLE) {
+	for ( uint32_t i=first, l=first+(count & ~TRIANGLE) ; i < l ; i++ )
+	    updated = wasm_v128_or(updated, intersectTriangle4(scene.triangles, i, rays, active, min, max, hits));
+    } else {
+	for ( uint32_t i=first, l=first+count ; i < l ; i++ )
+	    updated = wasm_v128_or(updated, intersectSphere4(scene.spheres, i, rays, active, min, max, hits));
+    }
+    return updated;
+}
+
+// Intersect the rays of the packet selected by `active`.  For every lane that
+// hits a primitive at a distance in [min, max) the lane of *max is updated with
+// the nearest distance and hits[lane] with the primitive.  Returns the mask of
+// lanes that were updated.
+//
+// A node is entered if any lane hits its box; only the lanes that hit are
+// carried into the subtree.  The child with the nearest entry distance over
+// all lanes is visited first, and a stacked node is skipped when popped if no
+// lane can still find a closer hit in it.
+
+static v128_t intersect4(const Scene& scene, const Ray4& rays, v128_t active, Float min, v128_t* max, PrimRef* hits)
+{
+    if (!scene.nodes.size()) {
+	return wasm_v128_or(intersectLeaf4(scene, 0, scene.spheres.count, rays, active, min, max, hits),
+			    intersectLeaf4(scene, 0, scene.triangles.count | TRIANGLE, rays, active, min, max, hits));
+    }
+
+    const BVHNode* nodes = scene.nodes.data();
+    struct { uint32_t node; v128_t mask; v128_t tnear; } stack[BVH_MAX_DEPTH];
+    uint32_t sp = 0;
+    Vec3x4 a = slabsInv(rays.dir);
+    v128_t updated = wasm_i32x4_const(0, 0, 0, 0);
+    v128_t sentinel = wasm_f32x4_splat(SENTINEL);
+    v128_t tnear;
+
+    v128_t mask = slabs4(nodes[0], rays.origin, a, active, min, *max, &tnear);
+    if (!wasm_i32x4_any_true(mask))
+	return updated;
+
+    uint32_t ni = 0;
+    for (;;) {
+	const BVHNode& node = nodes[ni];
+	if (node.count) {
+	    updated = wasm_v128_or(updated, intersectLeaf4(scene, node.leftFirst, node.count, rays, mask, min, max, hits));
+	} else {
+	    uint32_t left = node.leftFirst;
+	    uint32_t right = left + 1;
+	    v128_t tleft, tright;
+	    v128_t mleft = slabs4(nodes[left], rays.origin, a, mask, min, *max, &tleft);
+	    v128_t mright = slabs4(nodes[right], rays.origin, a, mask, min, *max, &tright);
+	    bool hitleft = wasm_i32x4_any_true(mleft);
+	    bool hitright = wasm_i32x4_any_true(mright);
+	    if (hitleft && hitright) {
+		if (hmin(wasm_v128_bitselect(tright, sentinel, mright)) <
+		    hmin(wasm_v128_bitselect(tleft, sentinel, mleft))) {
+		    stack[sp].node = left;
+		    stack[sp].mask = mleft;
+		    stack[sp].tnear = tleft;
+		    ni = right;
+		    mask = mright;
+		} else {
+		    stack[sp].node = right;
+		    stack[sp].mask = mright;
+		    stack[sp].tnear = tright;
+		    ni = left;
+		    mask = mleft;
+		}
+		sp++;
+		continue;
+	    }
+	    if (hitleft) {
+		ni = left;
+		mask = mleft;
+		continue;
+	    }
+	    if (hitright) {
+		ni = right;
+		mask = mright;
+		continue;
+	    }
+	}
+	for (;;) {
+	    if (sp == 0)
+		return updated;
+	    --sp;
+	    mask = wasm_v128_and(stack[sp].mask, wasm_f32x4_le(stack[sp].tnear, *max));
+	    if (wasm_i32x4_any_true(mask)) {
+		ni = stack[sp].node;
+		break;
+	    }
+	}
+    }
+}
+
+static inline v128_t occludedLeaf4(const Scene& scene, uint32_t first, uint32_t count, const Ray4& rays, v128_t active, Float min, v128_t max)
+{
+    v128_t occluded = wasm_i32x4_const(0, 0, 0, 0);
+    if (count & TRIANGLE) {
+	for ( uint32_t i=first, l=first+(count & ~TRIANGLE) ; i < l ; i++ ) {
+	    occluded = wasm_v128_or(occluded, occludeTriangle4(scene.triangles, i, rays, active, min, max));
+	    active = wasm_v128_andnot(active, occluded);
+	}
+    } else {
+	for ( uint32_t i=first, l=first+count ; i < l ; i++ ) {
+	    occluded = wasm_v128_or(occluded, occludeSphere4(scene.spheres, i, rays, active, min, max));
+	    active = wasm_v128_andnot(active, occluded);
+	}
+    }
+    return occluded;
+}
+
+// Returns the mask of the `active` lanes whose rays hit any primitive at a
+// distance in [min, max) of the lane.  A lane drops out of the traversal at
+// its first hit, and the traversal ends when no lane is left.
+
+static v128_t occluded4(const Scene& scene, const Ray4& rays, v128_t active, Float min, v128_t max)
+{
+    if (!scene.nodes.size()) {
+	v128_t occluded = occludedLeaf4(scene, 0, scene.spheres.count, rays, active, min, max);
+	return wasm_v128_or(occluded, occludedLeaf4(scene, 0, scene.triangles.count | TRIANGLE, rays,
+						    wasm_v128_andnot(active, occluded), min, max));
+    }
+
+    const BVHNode* nodes = scene.nodes.data();
+    struct { uint32_t node; v128_t mask; } stack[BVH_MAX_DEPTH];
+    uint32_t sp = 0;
+    Vec3x4 a = slabsInv(rays.dir);
+    v128_t occluded = wasm_i32x4_const(0, 0, 0, 0);
+    v128_t tnear;
+
+    v128_t mask = slabs4(nodes[0], rays.origin, a, active, min, max, &tnear);
+    if (!wasm_i32x4_any_true(mask))
+	return occluded;
+
+    uint32_t ni = 0;
+    for (;;) {
+	const BVHNode& node = nodes[ni];
+	if (node.count) {
+	    occluded = wasm_v128_or(occluded, occludedLeaf4(scene, node.leftFirst, node.count, rays, mask, min, max));
+	    if (!wasm_i32x4_any_true(wasm_v128_andnot(active, occluded)))
+		return occluded;
+	} else {
+	    uint32_t left = node.leftFirst;
+	    v128_t mleft = slabs4(nodes[left], rays.origin, a, mask, min, max, &tnear);
+	    v128_t mright = slabs4(nodes[left+1], rays.origin, a, mask, min, max, &tnear);
+	    bool hitleft = wasm_i32x4_any_true(mleft);
+	    bool hitright = wasm_i32x4_any_true(mright);
+	    if (hitleft && hitright) {
+		stack[sp].node = left+1;
+		stack[sp].mask = mright;
+		sp++;
+	    }
+	    if (hitleft || hitright) {
+		ni = hitleft ? left : left+1;
+		mask = hitleft ? mleft : mright;
+		continue;
+	    }
+	}
+	for (;;) {
+	    if (sp == 0)
+		return occluded;
+	    --sp;
+	    mask = wasm_v128_andnot(stack[sp].mask, occluded);
+	    if (wasm_i32x4_any_true(mask)) {
+		ni = stack[sp].node;
+		break;
+	    }
+	}
+    }
+}
+
+#endif // PACKETS
+
+// "Color" is a Vec3 representing RGB scaled by 256.
+// "RGBA" is a uint32_t representing r,g,b,a in the range 0..255
+
+Vec3 colorFromRGB(uint32_t r, uint32_t g, uint32_t b) {
+    return Vec3B(r/256.0, g/256.0, b/256.0);
+}
+
+// Components outside 0..1 saturate.
+
+#ifdef USE_SIMD
+
+uint32_t rgbaFromColor(V3P color)
+{
+    // Scale, put 255 in the alpha lane, and narrow to bytes
+    v128_t c = wasm_v32x4_shuffle(wasm_f32x4_mul(color, wasm_f32x4_splat(255)), wasm_f32x4_splat(255), 0, 1, 2, 4);
+    v128_t i = wasm_i32x4_trunc_saturate_f32x4(c);
+    v128_t h = wasm_i16x8_narrow_i32x4(i, i);
+    return wasm_i32x4_extract_lane(wasm_u8x16_narrow_i16x8(h, h), 0);
+}
+
+#else
+
+static inline uint32_t channel(Float c) {
+    return c <= 0 ? 0 : c >= 1 ? 255 : uint32_t(255*c);
+}
+
+uint32_t rgbaFromColor(V3P color)
+{
+    return (255<<24) | (channel(Z(color))<<16) | (channel(Y(color))<<8) | channel(X(color));
+}
+
+#endif // USE_SIMD
+
+// rgbaFromColor() of four colors.
+
+static inline void rgbaFromColors(const Vec3* colors, uint32_t* rgba)
+{
+#ifdef USE_SIMD
+    v128_t scale = wasm_f32x4_splat(255);
+    v128_t c[4];
+    for ( uint32_t i=0 ; i < 4 ; i++ )
+	c[i] = wasm_i32x4_trunc_saturate_f32x4(wasm_v32x4_shuffle(wasm_f32x4_mul(colors[i], scale), scale, 0, 1, 2, 4));
+    wasm_v128_store(rgba, wasm_u8x16_narrow_i16x8(wasm_i16x8_narrow_i32x4(c[0], c[1]),
+						   wasm_i16x8_narrow_i32x4(c[2], c[3])));
+#else
+    for ( uint32_t i=0 ; i < 4 ; i++ )
+	rgba[i] = rgbaFromColor(colors[i]);
+#endif
+}
+
+void componentsFromRgba(uint32_t rgba, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+{
+    *r = rgba;
+    *g = (rgba >> 8);
+    *b = (rgba >> 16);
+    *a = (rgba >> 24);
+}
+
+// The frame buffer.  Pixels are stored in tiles of TILE x TILE, the tiles in
+// row order and the pixels of a tile in row order, so that a rectangle of the
+// image that is rendered together is together in memory too.  A tile's rows
+// fill whole cache lines, and rectangles made of whole tiles share none, so
+// threads can render them side by side.  As in the tracer, y counts from the
+// bottom.
+
+class Bitmap
+{
+public:
+    static const uint32_t TILE = 8;
+
+private:
+    uint32_t height;
+    uint32_t width;
+    uint32_t across;		// Tiles per row of tiles
+    uint32_t* const data;
+
+    uint32_t* pixel(uint32_t y, uint32_t x) const {
+	return data + ((y/TILE)*across + x/TILE)*TILE*TILE + (y%TILE)*TILE + x%TILE;
+    }
+
+public:
+    Bitmap(uint32_t height, uint32_t width, V3P color)
+	: height(height)
+	, width(width)
+	, across((width + TILE - 1) / TILE)
+	, data((uint32_t*)aligned_alloc(64, across * ((height + TILE - 1) / TILE) * TILE*TILE * sizeof(uint32_t)))
+    {
+	if (!data)
+	    CRASH("Failed to allocate array");
+
+	uint32_t c = rgbaFromColor(color);
+	for ( uint32_t i=0, l=across * ((height + TILE - 1) / TILE) * TILE*TILE ; i < l ; i++ )
+	    data[i] = c;
+    }
+
+    ~Bitmap() {
+	free(data);
+    }
+
+    Bitmap(const Bitmap&) = delete;
+    Bitmap& operator=(const Bitmap&) = delete;
+
+    // For debugging only
+    uint32_t ref(uint32_t y, uint32_t x) {
+	return *pixel(y, x);
+    }
+
+    // Not a hot function
+    void setColor(uint32_t y, uint32_t x, V3P v) {
+	*pixel(y, x) = rgbaFromColor(v);
+    }
+
+    // The 2x2 block with lower left corner (y, x), both even, from the colors
+    // of (y, x), (y, x+1), (y+1, x) and (y+1, x+1).  The block is within a
+    // tile.
+    void setColors2x2(uint32_t y, uint32_t x, const Vec3* colors) {
+	uint32_t rgba[4];
+	rgbaFromColors(colors, rgba);
+	uint32_t* p = pixel(y, x);
+	p[0] = rgba[0];
+	p[1] = rgba[1];
+	p[TILE] = rgba[2];
+	p[TILE+1] = rgba[3];
+    }
+
+    // Copy the image to out in row order, top row first, in one pass over the
+    // tiles.
+    void read(uint32_t* out) const {
+	const uint32_t* p = data;
+	for ( uint32_t ty=0 ; ty < height ; ty+=TILE ) {
+	    for ( uint32_t tx=0 ; tx < width ; tx+=TILE ) {
+		uint32_t n = width - tx < TILE ? width - tx : TILE;
+		for ( uint32_t y=ty ; y < ty+TILE ; y++, p+=TILE ) {
+		    if (y < height)
+			memcpy(out + (height-1-y)*width + tx, p, n * sizeof(uint32_t));
+		}
+	    }
+	}
+    }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Everything the tracer needs.  The context is passed down explicitly rather
+// than kept in globals so that several threads can render at once, each with
+// its own copy.  The scene is shared and read-only; threads write disjoint
+// pixels of the bitmap.
+
+struct RenderContext {
+    Vec3 eye;
+    Vec3 light;
+    Vec3 background;
+    const Scene* scene;
+    Bitmap* bits;
+    std::atomic<uint64_t>* samples;	// Samples taken of the pixels by adaptive antialiasing
+};
+
+static Scene* setStage(Vec3* eye, Vec3* light, Vec3* background);
+static void trace(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim);
+#ifdef THREADS
+static uint32_t traceParallel(const RenderContext& ctx, uint32_t nthreads);
+#endif
+
+// Command line options override the compile-time defaults, eg
+//
+//   raybench --width=1600 --height=1200 --aa-grid=2 --reflection=0
+
+static void usage(const char* prog)
+{
+    printf("Usage: %s [option ...]\n"
+	   "  --width=n          image width (default %u)\n"
+	   "  --height=n         image height (default %u)\n"
+	   "  --shadows=0|1      compute shadows (default %u)\n"
+	   "  --reflection=n     reflection depth, 0 for none (default %u)\n"
+	   "  --antialias=0|1    antialias (default %u)\n"
+	   "  --aa-grid=n        n x n samples per pixel when antialiasing (default %u)\n"
+	   "  --adaptive=0|1     take the full grid of samples only where needed (default %u)\n"
+	   "  --aa-threshold=n   contrast in 1/255 that needs the full grid (default %u)\n"
+	   "  --partitioning=0|1 partition the scene (default %u)\n"
+	   "  --mesh=file        render the OBJ or binary PLY mesh in file on the floor\n"
+	   "  --cache=dir        reuse prebuilt scenes stored in dir\n",
+	   prog, unsigned(WIDTH), unsigned(HEIGHT), unsigned(SHADOWS), unsigned(REFLECTION),
+	   unsigned(ANTIALIAS), unsigned(AA_GRID), unsigned(ADAPTIVE), unsigned(AA_THRESHOLD),
+	   unsigned(PARTITIONING));
+#ifdef THREADS
+    printf("  --threads=n        render threads, 0 for one per hardware thread (default %u)\n"
+	   "  --tile-size=n      tiles are n x n pixels, rounded up to a multiple of 8 (default %u)\n",
+	   unsigned(NTHREADS), unsigned(TILE_SIZE));
+#endif
+#ifdef PACKETS
+    printf("  --wavefront=0|1    trace secondary rays in batches by kind (default %u)\n",
+	   unsigned(WAVEFRONT));
+#endif
+    exit(1);
+}
+
+// If arg is --name=value, parse value into *v, which must be at least min.
+static bool option(const char* prog, const char* arg, const char* name, uint32_t min, uint32_t* v)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, "--", 2) != 0 || strncmp(arg+2, name, len) != 0 || arg[2+len] != '=')
+	return false;
+    const char* s = arg + 3 + len;
+    char* end;
+    unsigned long n = strtoul(s, &end, 10);
+    if (*s < '0' || *s > '9' || *end != 0 || n < min || n > UINT32_MAX) {
+	printf("Bad value for --%s: %s\n", name, s);
+	usage(prog);
+    }
+    *v = uint32_t(n);
+    return true;
+}
+
+static bool option(const char* prog, const char* arg, const char* name, bool* v)
+{
+    uint32_t n;
+    if (!option(prog, arg, name, 0, &n))
+	return false;
+    if (n > 1) {
+	printf("Bad value for --%s: %u\n", name, n);
+	usage(prog);
+    }
+    *v = n != 0;
+    return true;
+}
+
+static void parseArgs(int argc, char** argv)
+{
+    for ( int i=1 ; i < argc ; i++ ) {
+	const char* a = argv[i];
+	if (strcmp(a, "--help") == 0)
+	    usage(argv[0]);
+	if (strncmp(a, "--mesh=", 7) == 0) {
+	    g_mesh = a + 7;
+	    continue;
+	}
+	if (strncmp(a, "--cache=", 8) == 0) {
+	    g_cache = a + 8;
+	    continue;
+	}
+	if (option(argv[0], a, "width", 1, &g_width) ||
+	    option(argv[0], a, "height", 1, &g_height) ||
+	    option(argv[0], a, "shadows", &g_shadows) ||
+	    option(argv[0], a, "reflection", 0, &g_reflection_depth) ||
+	    option(argv[0], a, "antialias", &g_antialias) ||
+	    option(argv[0], a, "aa-grid", 1, &g_aa_grid) ||
+	    option(argv[0], a, "adaptive", &g_adaptive) ||
+	    option(argv[0], a, "aa-threshold", 0, &g_aa_threshold) ||
+	    option(argv[0], a, "partitioning", &g_partitioning))
+	    continue;
+#ifdef THREADS
+	if (option(argv[0], a, "threads", 0, &g_threads) ||
+	    option(argv[0], a, "tile-size", 1, &g_tile_size))
+	    continue;
+#endif
+#ifdef PACKETS
+	if (option(argv[0], a, "wavefront", &g_wavefront))
+	    continue;
+#endif
+	printf("Unknown option: %s\n", a);
+	usage(argv[0]);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    RenderContext ctx;
+    std::atomic<uint64_t> samples(0);
+    ctx.samples = &samples;
+
+    parseArgs(argc, argv);
+
+    {
+#ifdef RUNTIME
+	uint64_t then = timestamp();
+#endif
+	ctx.scene = setStage(&ctx.eye, &ctx.light, &ctx.background);
+#ifdef RUNTIME
+	uint64_t now = timestamp();
+	printf("Setup time: %g ms\n", (now-then) / 1000.0);
+#endif
+    }
+
+    Bitmap bits(g_height, g_width, colorFromRGB(152, 251, 152));
+    ctx.bits = &bits;
+
+#ifdef THREADS
+    uint32_t nthreads = g_threads ? g_threads : std::thread::hardware_concurrency();
+    if (nthreads == 0)
+	nthreads = 1;
+#endif
+
+#ifdef SCALING
+    // Render with 1, 2, 4, ... threads up to nthreads, and nthreads itself.
+    {
+	printf("Threads  Time (ms)  Speedup  Efficiency  Steals\n");
+	double base = 0;
+	for ( uint32_t n=1 ; ; n = n*2 < nthreads ? n*2 : nthreads ) {
+	    uint64_t then = timestamp();
+	    uint32_t steals = traceParallel(ctx, n);
+	    double ms = (timestamp() - then) / 1000.0;
+	    if (n == 1)
+		base = ms;
+	    printf("%7u  %9.1f  %7.2f  %9.0f%%  %6u\n", n, ms, base/ms, 100*base/(ms*n), steals);
+	    if (n == nthreads)
+		break;
+	}
+    }
+#endif
+
+#ifdef BENCH
+    // Repeated renders for statistics; the render below still produces the
+    // image.
+    {
+# if defined(PACKETS)
+	const char* variant = "SIMD+packets";
+# elif defined(USE_SIMD)
+	const char* variant = "SIMD";
+# else
+	const char* variant = "scalar";
+# endif
+# ifdef THREADS
+	benchRun("raybench", variant, nthreads, [&] { traceParallel(ctx, nthreads); });
+# else
+	benchRun("raybench", variant, 1, [&] { trace(ctx, 0, g_height, 0, g_width); });
+# endif
+    }
+#endif
+
+    {
+	samples = 0;
+#ifdef RUNTIME
+	uint64_t then = timestamp();
+#endif
+#ifdef THREADS
+	traceParallel(ctx, nthreads);
+#else
+	trace(ctx, 0, g_height, 0, g_width);
+#endif
+#ifdef RUNTIME
+	uint64_t now = timestamp();
+#  ifdef THREADS
+	printf("Render time: %g ms (%u threads)\n", (now-then) / 1000.0, nthreads);
+#  else
+	printf("Render time: %g ms\n", (now-then) / 1000.0);
+#  endif
+	if (g_antialias && g_adaptive)
+	    printf("Samples per pixel: %.2f of %u\n", double(samples) / (g_width * g_height), g_aa_grid * g_aa_grid);
+#endif
+    }
+
+#if defined(SDL_BROWSER) || defined(IMAGE_FORMAT)
+    vector<uint32_t> rgba(g_width * g_height);
+    bits.read(rgba.data());
+#endif
+
+#ifdef IMAGE_FORMAT
+    vector<uint8_t> rgb(g_width * g_height * 3);
+    uint8_t* pixel = rgb.data();
+#endif
+
+#ifdef SDL_BROWSER
+    SDL_Init(SDL_INIT_VIDEO);
+    SDL_Surface *screen = SDL_SetVideoMode(g_width, g_height, 32, SDL_SWSURFACE);
+
+    if (SDL_MUSTLOCK(screen))
+	SDL_LockSurface(screen);
+#endif
+
+#if defined(SDL_BROWSER) || defined(IMAGE_FORMAT)
+    for ( uint32_t i=0 ; i < g_width * g_height ; i++ ) {
+	uint8_t r, g, b, a;
+	componentsFromRgba(rgba[i], &r, &g, &b, &a);
+# ifdef SDL_BROWSER
+	*((Uint32*)screen->pixels + i) = SDL_MapRGBA(screen->format, r, g, b, a);
+# endif
+# ifdef IMAGE_FORMAT
+	*pixel++ = r;
+	*pixel++ = g;
+	*pixel++ = b;
+# endif
+    }
+#endif
+
+#ifdef SDL_BROWSER
+    if (SDL_MUSTLOCK(screen))
+	SDL_UnlockSurface(screen);
+#endif
+
+#ifdef IMAGE_FORMAT
+    writeImage(IMAGE_FORMAT, g_width, g_height, rgb.data());
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static void traceWithoutAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim);
+static void traceWithAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim);
+static void traceWithAdaptiveAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim);
+#ifdef PACKETS
+static void traceWavefront(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim);
+#endif
+static Vec3 raycolor(const RenderContext& ctx, V3P eye, V3P ray, Float t0, Float t1, uint32_t depth);
+
+#ifdef PACKETS
+static void raycolor4(const RenderContext& ctx, const Ray4& rays, Vec3* colors);
+
+// Primary rays from the eye through four points on the view plane.
+static inline Ray4 eyeRays(const RenderContext& ctx, const Float* us, const Float* vs) {
+    Ray4 rays;
+    rays.origin = splat(ctx.eye);
+    rays.dir.x = wasm_v128_load(us);
+    rays.dir.y = wasm_v128_load(vs);
+    rays.dir.z = wasm_f32x4_splat(-Z(ctx.eye));
+    return rays;
+}
+
+static Vec3x4 lighting4(const Scene& scene, const PrimRef* objs, const Vec3x4& ray, const Vec3x4& p, const Vec3x4& l1, Vec3x4* n1);
+#endif
+
+static Vec3 shade(const RenderContext& ctx, PrimRef obj, V3P ray, V3P p, V3P l1, bool shadowed, uint32_t depth);
+static Vec3 lighting(const Material& m, V3P n1, V3P ray, V3P l1);
+static inline Vec3 reflect(V3P ray, V3P n1);
+
+static void trace(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+{
+    if (g_antialias && g_adaptive)
+	traceWithAdaptiveAntialias(ctx, ymin, ylim, xmin, xlim);
+#ifdef PACKETS
+    else if (g_wavefront)
+	traceWavefront(ctx, ymin, ylim, xmin, xlim);
+#endif
+    else if (g_antialias)
+	traceWithAntialias(ctx, ymin, ylim, xmin, xlim);
+    else
+	traceWithoutAntialias(ctx, ymin, ylim, xmin, xlim);
+}
+
+#ifdef THREADS
+
+// Tile scheduling.  Each worker owns a queue of tiles, initially a contiguous
+// band of the image so that a worker's tiles touch the same parts of the scene.
+// A worker takes tiles from the front of its own queue and, when that is empty,
+// steals from the back of the other workers' queues.  Tiles are coarse enough
+// that a lock per queue costs nothing measurable.
+
+struct Tile {
+    uint32_t ymin, ylim, xmin, xlim;
+};
+
+class TileQueue
+{
+    std::mutex lock;
+    std::deque<Tile> tiles;
+
+public:
+    void push(const Tile& t) {
+	std::lock_guard<std::mutex> guard(lock);
+	tiles.push_back(t);
+    }
+
+    bool take(Tile* t) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (tiles.empty())
+	    return false;
+	*t = tiles.front();
+	tiles.pop_front();
+	return true;
+    }
+
+    bool steal(Tile* t) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (tiles.empty())
+	    return false;
+	*t = tiles.back();
+	tiles.pop_back();
+	return true;
+    }
+};
+
+// Render the whole image on nthreads threads, the calling thread being one of
+// them.  Returns the number of tiles that were stolen.
+
+static uint32_t traceParallel(const RenderContext& ctx, uint32_t nthreads)
+{
+    uint32_t size = (g_tile_size + Bitmap::TILE - 1) / Bitmap::TILE * Bitmap::TILE;
+    vector<Tile> tiles;
+    for ( uint32_t y=0 ; y < g_height ; y+=size ) {
+	for ( uint32_t x=0 ; x < g_width ; x+=size ) {
+	    Tile t = { y, y+size < g_height ? y+size : g_height,
+		       x, x+size < g_width ? x+size : g_width };
+	    tiles.push_back(t);
+	}
+    }
+
+    vector<TileQueue> queues(nthreads);
+    for ( size_t i=0 ; i < tiles.size() ; i++ )
+	queues[i * nthreads / tiles.size()].push(tiles[i]);
+
+    vector<uint32_t> steals(nthreads);
+    auto worker = [&](uint32_t id) {
+	RenderContext local = ctx;
+	Tile t = { 0, 0, 0, 0 };
+	for (;;) {
+	    if (!queues[id].take(&t)) {
+		uint32_t k = 1;
+		while (k < nthreads && !queues[(id+k) % nthreads].steal(&t))
+		    k++;
+		if (k == nthreads)
+		    return;
+		steals[id]++;
+	    }
+	    trace(local, t.ymin, t.ylim, t.xmin, t.xlim);
+	}
+    };
+
+    vector<std::thread> threads;
+    for ( uint32_t id=1 ; id < nthreads ; id++ )
+	threads.push_back(std::thread(worker, id));
+    worker(0);
+    for ( std::thread& t : threads )
+	t.join();
+
+    uint32_t total = 0;
+    for ( uint32_t s : steals )
+	total += s;
+    return total;
+}
+
+#endif // THREADS
+
+#ifdef PACKETS
+
+// Pixels are traced in 2x2 blocks, one ray per lane.  At the right and bottom
+// edges lanes outside the rectangle duplicate the last row or column.
+
+static void traceWithoutAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+{
+    for ( uint32_t h=ymin ; h < ylim ; h+=2 ) {
+	for ( uint32_t w=xmin ; w < xlim ; w+=2 ) {
+	    alignas(16) Float us[4];
+	    alignas(16) Float vs[4];
+	    uint32_t hs[4], ws[4];
+	    for ( uint32_t i=0 ; i < 4 ; i++ ) {
+		ws[i] = w + (i & 1) < xlim ? w + (i & 1) : xlim - 1;
+		hs[i] = h + (i >> 1) < ylim ? h + (i >> 1) : ylim - 1;
+		us[i] = g_left + (g_right - g_left)*(ws[i] + 0.5)/g_width;
+		vs[i] = g_bottom + (g_top - g_bottom)*(hs[i] + 0.5)/g_height;
+	    }
+	    Vec3 cols[4];
+	    raycolor4(ctx, eyeRays(ctx, us, vs), cols);
+	    if (h+1 < ylim && w+1 < xlim && !((h | w) & 1)) {
+		ctx.bits->setColors2x2(h, w, cols);
+	    } else {
+		for ( uint32_t i=0 ; i < 4 ; i++ )
+		    ctx.bits->setColor(hs[i], ws[i], cols[i]);
+	    }
+	}
+    }
+}
+
+#else
+
+static void traceWithoutAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+{
+    for ( uint32_t h=ymin ; h < ylim ; h++ ) {
+	for ( uint32_t w=xmin ; w < xlim ; w++ ) {
+	    Float u = g_left + (g_right - g_left)*(w + 0.5)/g_width;
+	    Float v = g_bottom + (g_top - g_bottom)*(h + 0.5)/g_height;
+	    Vec3 ray = Vec3B(u, v, -Z(ctx.eye));
+	    Vec3 col = raycolor(ctx, ctx.eye, ray, 0, SENTINEL, g_reflection_depth);
+	    ctx.bits->setColor(h, w, col);
+	}
+    }
+}
+
+#endif // PACKETS
+
+// Jitter for antialiasing; indices wrap so that any grid size can be used.
+static const uint32_t NUM_RANDOM = 33;
+static const Float random_numbers[NUM_RANDOM] = {
+    0.495,0.840,0.636,0.407,0.026,0.547,0.223,0.349,0.033,0.643,0.558,0.481,0.039,
+    0.175,0.169,0.606,0.638,0.364,0.709,0.814,0.206,0.346,0.812,0.603,0.969,0.888,
+    0.294,0.824,0.410,0.467,0.029,0.706,0.314
+};
+
+#ifdef PACKETS
+
+// The n x n subsamples of a pixel are traced as 2x2 packets, with the same
+// jitter as the scalar version.  Lanes that fall outside the grid when n is
+// odd duplicate another sample and are not accumulated.
+
+static void traceWithAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+{
+    for ( uint32_t h=ymin ; h < ylim ; h++ ) {
+	for ( uint32_t w=xmin ; w < xlim ; w++ ) {
+	    const uint32_t n = g_aa_grid;
+	    uint32_t rand = (h*g_width + w) % 2;
+	    Vec3 c = Vec3Z();
+	    for ( uint32_t p=0 ; p < n ; p+=2 ) {
+		for ( uint32_t q=0 ; q < n ; q+=2 ) {
+		    alignas(16) Float us[4];
+		    alignas(16) Float vs[4];
+		    bool valid[4];
+		    for ( uint32_t i=0 ; i < 4 ; i++ ) {
+			uint32_t pp = p + (i & 1);
+			uint32_t qq = q + (i >> 1);
+			valid[i] = pp < n && qq < n;
+			if (!valid[i]) {
+			    pp = p;
+			    qq = q;
+			}
+			uint32_t r = rand + 2*(pp*n + qq);
+			Float jx = random_numbers[r % NUM_RANDOM];
+			Float jy = random_numbers[(r+1) % NUM_RANDOM];
+			us[i] = g_left + (g_right - g_left)*(w + (pp + jx)/n)/g_width;
+			vs[i] = g_bottom + (g_top - g_bottom)*(h + (qq + jy)/n)/g_height;
+		    }
+		    Vec3 cols[4];
+		    raycolor4(ctx, eyeRays(ctx, us, vs), cols);
+		    for ( uint32_t i=0 ; i < 4 ; i++ ) {
+			if (valid[i])
+			    c = add(c, cols[i]);
+		    }
+		}
+	    }
+	    ctx.bits->setColor(h, w, divi(c, n*n));
+	}
+    }
+}
+
+#else
+
+static void traceWithAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+{
+    for ( uint32_t h=ymin ; h < ylim ; h++ ) {
+	for ( uint32_t w=xmin ; w < xlim ; w++ ) {
+	    // Simple stratified sampling, cf Shirley&Marschner ch 13 and a fast "random" function.
+	    // The choice of sequence depends only on the pixel, not on the order of tracing.
+	    const uint32_t n = g_aa_grid;
+	    uint32_t rand = (h*g_width + w) % 2;
+	    Vec3 c = Vec3Z();
+	    for ( uint32_t p=0 ; p < n ; p++ ) {
+		for ( uint32_t q=0 ; q < n ; q++ ) {
+		    Float jx = random_numbers[rand % NUM_RANDOM]; rand=rand+1;
+		    Float jy = random_numbers[rand % NUM_RANDOM]; rand=rand+1;
+		    Float u = g_left + (g_right - g_left)*(w + (p + jx)/n)/g_width;
+		    Float v = g_bottom + (g_top - g_bottom)*(h + (q + jy)/n)/g_height;
+		    Vec3 ray = Vec3B(u, v, -Z(ctx.eye));
+		    c = add(c, raycolor(ctx, ctx.eye, ray, 0.0, SENTINEL, g_reflection_depth));
+		}
+	    }
+	    ctx.bits->setColor(h, w, divi(c, n*n));
+	}
+    }
+}
+
+#endif // PACKETS
+
+// Adaptive antialiasing.  Every pixel first gets the samples of a few strata of
+// the n x n grid, spread over the pixel, and their mean is its preliminary
+// color.  A pixel whose samples differ, or whose preliminary color differs
+// from that of a neighbour, by more than the threshold in some channel gets
+// the remaining samples too and then has the same color as with plain
+// antialiasing.  Flat regions thus cost a few rays per pixel and edges,
+// shadow boundaries and reflections the full grid.
+//
+// Preliminary colors are computed a row at a time and kept for the next row,
+// and also for a border of one pixel around the region so that the decision
+// does not depend on how the image is split into tiles.  The border belongs to
+// the neighbouring tiles and its samples are counted there.
+
+// The view plane position of subsample s = p*n + q of pixel (h, w), jittered
+// within stratum (p, q) as by traceWithAntialias().
+
+static inline void subsample(uint32_t h, uint32_t w, uint32_t s, Float* u, Float* v)
+{
+    const uint32_t n = g_aa_grid;
+    uint32_t r = (h*g_width + w) % 2 + 2*s;
+    *u = g_left + (g_right - g_left)*(w + (s/n + random_numbers[r % NUM_RANDOM])/n)/g_width;
+    *v = g_bottom + (g_top - g_bottom)*(h + (s%n + random_numbers[(r+1) % NUM_RANDOM])/n)/g_height;
+}
+
+// Trace the subsamples ss[0..k) of pixel (h, w), storing the colors as RGB
+// triples.
+
+static void traceSubsamples(const RenderContext& ctx, uint32_t h, uint32_t w, const uint32_t* ss, uint32_t k, Float* rgb)
+{
+#ifdef PACKETS
+    for ( uint32_t j=0 ; j < k ; j+=4 ) {
+	alignas(16) Float us[4];
+	alignas(16) Float vs[4];
+	for ( uint32_t i=0 ; i < 4 ; i++ )
+	    subsample(h, w, ss[j+i < k ? j+i : k-1], &us[i], &vs[i]);
+	Vec3 cols[4];
+	raycolor4(ctx, eyeRays(ctx, us, vs), cols);
+	for ( uint32_t i=0 ; i < 4 && j+i < k ; i++ ) {
+	    Float* c = rgb + 3*(j+i);
+	    c[0] = X(cols[i]); c[1] = Y(cols[i]); c[2] = Z(cols[i]);
+	}
+    }
+#else
+    for ( uint32_t j=0 ; j < k ; j++ ) {
+	Float u, v;
+	subsample(h, w, ss[j], &u, &v);
+	Vec3 col = raycolor(ctx, ctx.eye, Vec3B(u, v, -Z(ctx.eye)), 0.0, SENTINEL, g_reflection_depth);
+	Float* c = rgb + 3*j;
+	c[0] = X(col); c[1] = Y(col); c[2] = Z(col);
+    }
+#endif
+}
+
+static inline bool differ(const Float* a, const Float* b, Float threshold) {
+    return std::abs(a[0] - b[0]) > threshold || std::abs(a[1] - b[1]) > threshold || std::abs(a[2] - b[2]) > threshold;
+}
+
+static void traceWithAdaptiveAntialias(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+{
+    // Subsample s is stratum (s/n, s%n).  The first pass takes strata n/4 and
+    // 3n/4 in both directions, fewer if they coincide.
+    const uint32_t n = g_aa_grid;
+    const Float threshold = g_aa_threshold / 255.0;
+    vector<uint32_t> first, rest;
+    vector<int32_t> slot(n*n, -1);	// Index in first, or -1
+    for ( uint32_t p : { n/4, 3*n/4 } ) {
+	for ( uint32_t q : { n/4, 3*n/4 } ) {
+	    if (slot[p*n + q] < 0) {
+		slot[p*n + q] = first.size();
+		first.push_back(p*n + q);
+	    }
+	}
+    }
+    for ( uint32_t s=0 ; s < n*n ; s++ ) {
+	if (slot[s] < 0)
+	    rest.push_back(s);
+    }
+    const uint32_t k = first.size();
+
+    // The order in which traceWithAntialias() sums the subsamples, so that
+    // refined pixels get exactly its color.
+    vector<uint32_t> order;
+#ifdef PACKETS
+    for ( uint32_t p=0 ; p < n ; p+=2 ) {
+	for ( uint32_t q=0 ; q < n ; q+=2 ) {
+	    for ( uint32_t i=0 ; i < 4 ; i++ ) {
+		uint32_t pp = p + (i & 1);
+		uint32_t qq = q + (i >> 1);
+		if (pp < n && qq < n)
+		    order.push_back(pp*n + qq);
+	    }
+	}
+    }
+#else
+    for ( uint32_t s=0 ; s < n*n ; s++ )
+	order.push_back(s);
+#endif
+
+    // Rows [y0, y1) and columns [x0, x1) are the region and its border.  The
+    // samples and preliminary colors of row h are in ring slot h % 3.
+    const uint32_t y0 = ymin > 0 ? ymin-1 : 0;
+    const uint32_t x0 = xmin > 0 ? xmin-1 : 0;
+    const uint32_t y1 = std::min(ylim + 1, g_height);
+    const uint32_t x1 = std::min(xlim + 1, g_width);
+    const uint32_t stride = x1 - x0;
+    vector<Float> samples(3*stride*k*3);	// k RGB samples per pixel
+    vector<Float> means(3*stride*3);		// Preliminary colors
+    vector<Float> more(3*rest.size());
+    vector<Float> sum(3*n*n);
+    uint64_t count = 0;
+
+    uint32_t next = y0;				// Next row to trace
+    for ( uint32_t h=ymin ; h < ylim ; h++ ) {
+	for ( ; next <= h+1 && next < y1 ; next++ ) {
+	    for ( uint32_t w=x0 ; w < x1 ; w++ ) {
+		uint32_t i = (next % 3)*stride + (w-x0);
+		Float* ss = &samples[i*k*3];
+		traceSubsamples(ctx, next, w, first.data(), k, ss);
+		Float* m = &means[i*3];
+		m[0] = m[1] = m[2] = 0;
+		for ( uint32_t j=0 ; j < k ; j++ ) {
+		    m[0] += ss[3*j]; m[1] += ss[3*j+1]; m[2] += ss[3*j+2];
+		}
+		m[0] /= k; m[1] /= k; m[2] /= k;
+	    }
+	}
+	count += uint64_t(xlim-xmin) * k;
+
+	for ( uint32_t w=xmin ; w < xlim ; w++ ) {
+	    uint32_t i = (h % 3)*stride + (w-x0);
+	    const Float* ss = &samples[i*k*3];
+	    const Float* m = &means[i*3];
+	    const Float* above = &means[(((h+2) % 3)*stride + (w-x0))*3];
+	    const Float* below = &means[(((h+1) % 3)*stride + (w-x0))*3];
+	    bool refine = false;
+	    for ( uint32_t j=1 ; j < k && !refine ; j++ )
+		refine = differ(ss, ss + 3*j, threshold);
+	    refine = refine ||
+		(h > y0 && differ(m, above, threshold)) ||
+		(h+1 < y1 && differ(m, below, threshold)) ||
+		(w > x0 && differ(m, m - 3, threshold)) ||
+		(w+1 < x1 && differ(m, m + 3, threshold));
+	    if (!refine) {
+		ctx.bits->setColor(h, w, Vec3B(m[0], m[1], m[2]));
+		continue;
+	    }
+
+	    traceSubsamples(ctx, h, w, rest.data(), rest.size(), more.data());
+	    count += rest.size();
+	    for ( uint32_t s=0, r=0 ; s < n*n ; s++ ) {
+		const Float* col = slot[s] >= 0 ? ss + 3*slot[s] : &more[3*r++];
+		sum[3*s] = col[0]; sum[3*s+1] = col[1]; sum[3*s+2] = col[2];
+	    }
+	    Vec3 c = Vec3Z();
+	    for ( uint32_t s : order )
+		c = add(c, Vec3B(sum[3*s], sum[3*s+1], sum[3*s+2]));
+	    ctx.bits->setColor(h, w, divi(c, n*n));
+	}
+    }
+    *ctx.samples += count;
+}
+
+#ifdef PACKETS
+
+// Wavefront tracing.  Rather than following each packet of primary rays
+// through its shadow rays and reflections, all the primary rays of a block of
+// pixels are traced as one batch.  Their hits yield a batch of shadow rays, and
+// the unshadowed hits on mirrors a batch of reflection rays, which is traced in
+// turn, and so on down to the reflection depth.  Every batch is traced in full
+// packets, whereas secondary rays that follow from one packet of primary rays
+// leave most lanes idle: few of the four hit a mirror, and each goes its own way.
+//
+// Colors are accumulated per sample as the batches are processed, so they may
+// differ from the recursive tracer's in the last bit.
+
+static const uint32_t WAVEFRONT_BLOCK = 16;
+
+// Secondary rays in structure-of-arrays form.  Each carries the sample whose
+// color it contributes to and the weight of the contribution, the product of
+// the mirror factors along its path.  Primary rays are not stored but computed
+// a packet at a time.
+
+struct RayBatch {
+    vector<Float> ox, oy, oz;
+    vector<Float> dx, dy, dz;
+    vector<Float> wr, wg, wb;
+    vector<uint32_t> sample;
+
+    uint32_t size() const {
+	return sample.size();
+    }
+
+    void clear() {
+	ox.clear(); oy.clear(); oz.clear();
+	dx.clear(); dy.clear(); dz.clear();
+	wr.clear(); wg.clear(); wb.clear();
+	sample.clear();
+    }
+
+    void push(V3P o, V3P d, V3P w, uint32_t s) {
+	ox.push_back(X(o)); oy.push_back(Y(o)); oz.push_back(Z(o));
+	dx.push_back(X(d)); dy.push_back(Y(d)); dz.push_back(Z(d));
+	wr.push_back(X(w)); wg.push_back(Y(w)); wb.push_back(Z(w));
+	sample.push_back(s);
+    }
+
+    // Pad to whole packets with copies of the last ray and return the number
+    // of rays before padding.
+    uint32_t pad() {
+	uint32_t n = size();
+	while (size() % 4) {
+	    push(Vec3B(ox[n-1], oy[n-1], oz[n-1]), Vec3B(dx[n-1], dy[n-1], dz[n-1]),
+		 Vec3B(wr[n-1], wg[n-1], wb[n-1]), sample[n-1]);
+	}
+	return n;
+    }
+
+    Ray4 packet(uint32_t i) const {
+	Ray4 r;
+	r.origin.x = wasm_v128_load(&ox[i]);
+	r.origin.y = wasm_v128_load(&oy[i]);
+	r.origin.z = wasm_v128_load(&oz[i]);
+	r.dir.x = wasm_v128_load(&dx[i]);
+	r.dir.y = wasm_v128_load(&dy[i]);
+	r.dir.z = wasm_v128_load(&dz[i]);
+	return r;
+    }
+};
+
+// Lanes of the packet at i that hold one of the first n rays.
+static inline v128_t activeLanes(uint32_t i, uint32_t n) {
+    return wasm_i32x4_gt(wasm_i32x4_splat(n - i), wasm_i32x4_const(0, 1, 2, 3));
+}
+
+// A hit waiting for the result of its shadow ray.
+struct PendingHit {
+    PrimRef obj;
+    uint32_t sample;
+    Float p[3];
+    Float l1[3];
+    Float ldist;		// Distance to the light
+    Float ray[3];
+    Float weight[3];
+};
+
+// A packet of rays and their hits unpacked for per-lane work.
+struct Lanes {
+    alignas(16) Float px[4], py[4], pz[4];	// Hit points
+    alignas(16) Float lx[4], ly[4], lz[4];	// Directions to the light
+    alignas(16) Float ld[4];			// Distances to the light
+    alignas(16) Float dx[4], dy[4], dz[4];	// Ray directions
+
+    Lanes(const Ray4& rays, const Vec3x4& p, const Vec3x4& l1, v128_t ldist) {
+	wasm_v128_store(px, p.x); wasm_v128_store(py, p.y); wasm_v128_store(pz, p.z);
+	wasm_v128_store(lx, l1.x); wasm_v128_store(ly, l1.y); wasm_v128_store(lz, l1.z);
+	wasm_v128_store(ld, ldist);
+	wasm_v128_store(dx, rays.dir.x); wasm_v128_store(dy, rays.dir.y); wasm_v128_store(dz, rays.dir.z);
+    }
+};
+
+class Wavefront
+{
+    const RenderContext& ctx;
+    RayBatch rays;
+    RayBatch next;
+    vector<PendingHit> pending;
+    vector<int32_t> shadowed;	// Per pending hit, nonzero if in shadow
+    vector<Float> colors;	// RGB per sample
+
+public:
+    Wavefront(const RenderContext& ctx) : ctx(ctx) {}
+
+    // Trace a block of pixels with n x n samples each, n = 1 meaning the
+    // pixel centers.
+    void trace(uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim, uint32_t n) {
+	uint32_t width = xlim - xmin;
+	uint32_t count = (ylim - ymin) * width * n*n;
+	colors.assign(3*count, 0);
+
+	// Sample s is subsample s % n*n of pixel s / n*n of the block.
+	pending.clear();
+	for ( uint32_t i=0 ; i < count ; i+=4 ) {
+	    alignas(16) Float us[4];
+	    alignas(16) Float vs[4];
+	    for ( uint32_t j=0 ; j < 4 ; j++ ) {
+		uint32_t s = i+j < count ? i+j : count-1;
+		uint32_t pixel = s / (n*n);
+		uint32_t h = ymin + pixel / width;
+		uint32_t w = xmin + pixel % width;
+		if (n > 1) {
+		    subsample(h, w, s % (n*n), &us[j], &vs[j]);
+		} else {
+		    us[j] = g_left + (g_right - g_left)*(w + 0.5)/g_width;
+		    vs[j] = g_bottom + (g_top - g_bottom)*(h + 0.5)/g_height;
+		}
+	    }
+	    intersectPacket(eyeRays(ctx, us, vs), i, count, nullptr, 0);
+	}
+
+	for ( uint32_t depth=g_reflection_depth ; ; depth-- ) {
+	    if (g_shadows)
+		shadowBatch();
+	    next.clear();
+	    shadeBatch(depth);
+	    if (next.size() == 0)
+		break;
+	    std::swap(rays, next);
+	    uint32_t nrays = rays.pad();
+	    pending.clear();
+	    for ( uint32_t i=0 ; i < nrays ; i+=4 )
+		intersectPacket(rays.packet(i), i, nrays, &rays, EPS);
+	}
+
+	const Float* c = colors.data();
+	for ( uint32_t h=ymin ; h < ylim ; h++ ) {
+	    for ( uint32_t w=xmin ; w < xlim ; w++ ) {
+		Vec3 sum = Vec3Z();
+		for ( uint32_t k=0 ; k < n*n ; k++, c+=3 )
+		    sum = add(sum, Vec3B(c[0], c[1], c[2]));
+		ctx.bits->setColor(h, w, divi(sum, n*n));
+	    }
+	}
+    }
+
+private:
+    void accumulate(uint32_t s, V3P c) {
+	colors[3*s] += X(c);
+	colors[3*s+1] += Y(c);
+	colors[3*s+2] += Z(c);
+    }
+
+    // Intersect the packet of rays i..i+3 of n, which are secondary rays from
+    // batch or, if batch is null, primary rays for samples i..i+3.  A miss
+    // contributes the background; a hit contributes the ambient light and is
+    // pending.
+    void intersectPacket(const Ray4& packet, uint32_t i, uint32_t n, const RayBatch* batch, Float min) {
+	const Scene& scene = *ctx.scene;
+	v128_t dist = wasm_f32x4_splat(SENTINEL);
+	PrimRef objs[4] = { NOTHING, NOTHING, NOTHING, NOTHING };
+	intersect4(scene, packet, activeLanes(i, n), min, &dist, objs);
+	Vec3x4 p = add(packet.origin, muli(packet.dir, dist));
+	Vec3x4 tolight = sub(splat(ctx.light), p);
+	v128_t ldist = wasm_f32x4_sqrt(dot(tolight, tolight));
+	Lanes lanes(packet, p, divi(tolight, ldist), ldist);
+	for ( uint32_t j=0 ; j < 4 && i+j < n ; j++ ) {
+	    uint32_t s = batch ? batch->sample[i+j] : i+j;
+	    Vec3 weight = batch ? Vec3B(batch->wr[i+j], batch->wg[i+j], batch->wb[i+j]) : Vec3C(1, 1, 1);
+	    if (objs[j] == NOTHING) {
+		accumulate(s, mul(weight, ctx.background));
+		continue;
+	    }
+	    accumulate(s, mul(weight, scene.material(objs[j]).ambient));
+	    PendingHit h = { objs[j], s,
+			     { lanes.px[j], lanes.py[j], lanes.pz[j] },
+			     { lanes.lx[j], lanes.ly[j], lanes.lz[j] }, lanes.ld[j],
+			     { lanes.dx[j], lanes.dy[j], lanes.dz[j] },
+			     { X(weight), Y(weight), Z(weight) } };
+	    pending.push_back(h);
+	}
+    }
+
+    // Trace the shadow ray of every pending hit.  The packets are gathered
+    // from consecutive hits, so all lanes are busy.
+    void shadowBatch() {
+	uint32_t n = pending.size();
+	shadowed.resize((n + 3) & ~3u);
+	for ( uint32_t i=0 ; i < n ; i+=4 ) {
+	    alignas(16) Float p[3][4];
+	    alignas(16) Float l1[3][4];
+	    alignas(16) Float ldist[4];
+	    for ( uint32_t j=0 ; j < 4 ; j++ ) {
+		const PendingHit& h = pending[i+j < n ? i+j : n-1];
+		for ( uint32_t k=0 ; k < 3 ; k++ ) {
+		    p[k][j] = h.p[k];
+		    l1[k][j] = h.l1[k];
+		}
+		ldist[j] = h.ldist;
+	    }
+	    Ray4 shadows;
+	    shadows.dir.x = wasm_v128_load(l1[0]);
+	    shadows.dir.y = wasm_v128_load(l1[1]);
+	    shadows.dir.z = wasm_v128_load(l1[2]);
+	    Vec3x4 origin = { wasm_v128_load(p[0]), wasm_v128_load(p[1]), wasm_v128_load(p[2]) };
+	    shadows.origin = add(origin, muli(shadows.dir, wasm_f32x4_splat(EPS)));
+	    wasm_v128_store(&shadowed[i], occluded4(*ctx.scene, shadows, activeLanes(i, n), EPS, wasm_v128_load(ldist)));
+	}
+    }
+
+    // Light the pending hits that are not in shadow and reflect the rays that
+    // hit mirrors into the next batch.  The lit hits are lit four at a time.
+    void shadeBatch(uint32_t depth) {
+	uint32_t n = pending.size();
+	uint32_t lit[4];
+	uint32_t count = 0;
+	for ( uint32_t k=0 ; k < n ; k++ ) {
+	    if (!(g_shadows && shadowed[k]))
+		lit[count++] = k;
+	    if (count == 4 || (k == n-1 && count > 0)) {
+		shadeGroup(lit, count, depth);
+		count = 0;
+	    }
+	}
+    }
+
+    void shadeGroup(const uint32_t* lit, uint32_t count, uint32_t depth) {
+	const Scene& scene = *ctx.scene;
+	alignas(16) Float p[3][4];
+	alignas(16) Float l1[3][4];
+	alignas(16) Float ray[3][4];
+	PrimRef objs[4];
+	for ( uint32_t j=0 ; j < 4 ; j++ ) {
+	    const PendingHit& h = pending[lit[j < count ? j : count-1]];
+	    for ( uint32_t k=0 ; k < 3 ; k++ ) {
+		p[k][j] = h.p[k];
+		l1[k][j] = h.l1[k];
+		ray[k][j] = h.ray[k];
+	    }
+	    objs[j] = h.obj;
+	}
+	Vec3x4 n1;
+	Vec3x4 light = lighting4(scene,
+				 objs,
+				 { wasm_v128_load(ray[0]), wasm_v128_load(ray[1]), wasm_v128_load(ray[2]) },
+				 { wasm_v128_load(p[0]), wasm_v128_load(p[1]), wasm_v128_load(p[2]) },
+				 { wasm_v128_load(l1[0]), wasm_v128_load(l1[1]), wasm_v128_load(l1[2]) },
+				 &n1);
+	for ( uint32_t j=0 ; j < count ; j++ ) {
+	    const PendingHit& h = pending[lit[j]];
+	    const Material& m = scene.material(h.obj);
+	    Vec3 w = Vec3B(h.weight[0], h.weight[1], h.weight[2]);
+	    accumulate(h.sample, mul(w, lane(light, j)));
+	    // depth starts at g_reflection_depth, so this is off when that is zero
+	    if (depth > 0 && m.mirror != 0.0) {
+		Vec3 r = reflect(Vec3B(h.ray[0], h.ray[1], h.ray[2]), lane(n1, j));
+		next.push(add(Vec3B(h.p[0], h.p[1], h.p[2]), muli(r, EPS)), r, muli(w, m.mirror), h.sample);
+	    }
+	}
+    }
+};
+
+static void traceWavefront(const RenderContext& ctx, uint32_t ymin, uint32_t ylim, uint32_t xmin, uint32_t xlim)
+{
+    Wavefront wave(ctx);
+    for ( uint32_t y=ymin ; y < ylim ; y+=WAVEFRONT_BLOCK ) {
+	for ( uint32_t x=xmin ; x < xlim ; x+=WAVEFRONT_BLOCK )
+	    wave.trace(y, std::min(y+WAVEFRONT_BLOCK, ylim), x, std::min(x+WAVEFRONT_BLOCK, xlim), g_antialias ? g_aa_grid : 1);
+    }
+}
+
+#endif // PACKETS
+
+// Clamping c is not necessary provided the three color components by
 // themselves never add up to more than 1, and shininess == 0 or shininess >= 1.
 //
 // TODO: lighting intensity is baked into the material here, but we probably want
 // to factor that out and somehow attenuate light with distance from the light source,
 // for diffuse and specular lighting.
 
-static Vec3 raycolor(V3P eye, V3P ray, Float t0, Float t1, uint32_t depth)
+static Vec3 raycolor(const RenderContext& ctx, V3P eye, V3P ray, Float t0, Float t1, uint32_t depth)
 {
     Float dist;
-    Surface* obj = g_world->intersect(eye, ray, t0, t1, &dist);
+    PrimRef obj = intersect(*ctx.scene, eye, ray, t0, t1, &dist);
 
-    if (obj) {
-	Material& m = obj->material;
+    if (obj != NOTHING) {
 	Vec3 p = add(eye, muli(ray, dist));
-	Vec3 n1 = obj->normal(p);
-	Vec3 l1 = normalize(sub(g_light, p));
+	Vec3 tolight = sub(ctx.light, p);
+	Float ldist = length(tolight);
+	Vec3 l1 = divi(tolight, ldist);
+	// Only what lies between p and the light casts a shadow
+	bool shadowed = g_shadows && occluded(*ctx.scene, add(p, muli(l1, EPS)), l1, EPS, ldist);
+	return shade(ctx, obj, ray, p, l1, shadowed, depth);
+    }
+    return ctx.background;
+}
+
+#ifdef PACKETS
+
+// Packet version of raycolor for primary rays.  The shadow rays of the lanes
+// that hit something form a second packet, and the lanes are lit together;
+// reflection is per lane.
+
+static void raycolor4(const RenderContext& ctx, const Ray4& rays, Vec3* colors)
+{
+    v128_t dist = wasm_f32x4_splat(SENTINEL);
+    PrimRef objs[4] = { NOTHING, NOTHING, NOTHING, NOTHING };
+    v128_t hit = intersect4(*ctx.scene, rays, wasm_i32x4_const(-1, -1, -1, -1), 0, &dist, objs);
+
+    Vec3x4 p = add(rays.origin, muli(rays.dir, dist));
+    Vec3x4 tolight = sub(splat(ctx.light), p);
+    v128_t ldist = wasm_f32x4_sqrt(dot(tolight, tolight));
+    Vec3x4 l1 = divi(tolight, ldist);
+    alignas(16) int32_t shadowed[4] = { 0, 0, 0, 0 };
+
+    if (g_shadows && wasm_i32x4_any_true(hit)) {
+	Ray4 shadows;
+	shadows.origin = add(p, muli(l1, wasm_f32x4_splat(EPS)));
+	shadows.dir = l1;
+	wasm_v128_store(shadowed, occluded4(*ctx.scene, shadows, hit, EPS, ldist));
+    }
+
+    Vec3x4 n1;
+    Vec3x4 light = lighting4(*ctx.scene, objs, rays.dir, p, l1, &n1);
+
+    for ( uint32_t i=0 ; i < 4 ; i++ ) {
+	if (objs[i] == NOTHING) {
+	    colors[i] = ctx.background;
+	    continue;
+	}
+	const Material& m = ctx.scene->material(objs[i]);
 	Vec3 c = m.ambient;
-	Surface* min_obj = nullptr;
-
-	if (g_shadows) {
-	    Float tmp;
-	    min_obj = g_world->intersect(add(p, muli(l1, EPS)), l1, EPS, SENTINEL, &tmp);
-	}
-	if (!min_obj) {
-	    const Float diffuse = Max(0.0, dot(n1,l1));
-	    const Vec3 v1 = normalize(neg(ray));
-	    const Vec3 h1 = normalize(add(v1, l1));
-	    const Float specular = Pow(Max(0.0, dot(n1, h1)), m.shininess);
-	    c = add(c, add(muli(m.diffuse, diffuse), muli(m.specular, specular)));
-	    if (g_reflection) {
-		if (depth > 0 && m.mirror != 0.0) {
-		    const Vec3 r = sub(ray, muli(n1, 2.0*dot(ray, n1)));
-		    c = add(c, muli(raycolor(add(p, muli(r, EPS)), r, EPS, SENTINEL, depth-1), m.mirror));
-		}
+	if (!shadowed[i]) {
+	    c = add(c, lane(light, i));
+	    if (g_reflection_depth > 0 && m.mirror != 0.0) {
+		const Vec3 r = reflect(lane(rays.dir, i), lane(n1, i));
+		c = add(c, muli(raycolor(ctx, add(lane(p, i), muli(r, EPS)), r, EPS, SENTINEL, g_reflection_depth-1), m.mirror));
 	    }
 	}
-	return c;
+	colors[i] = c;
+    }
+}
+
+// Lane-parallel lighting(), for four hits at once: the diffuse and specular
+// light at points p on objs seen along ray, with light direction l1.  The
+// normals are returned in n1.  Lanes whose obj is NOTHING are meaningless.
+
+static Vec3x4 lighting4(const Scene& scene, const PrimRef* objs, const Vec3x4& ray, const Vec3x4& p, const Vec3x4& l1, Vec3x4* n1)
+{
+    Vec3 diffuse[4], specular[4], centers[4], normals[4];
+    alignas(16) Float shininess[4];
+    alignas(16) Float radius[4];
+    alignas(16) int32_t triangle[4];
+    for ( uint32_t i=0 ; i < 4 ; i++ ) {
+	PrimRef obj = objs[i];
+	if (obj == NOTHING) {
+	    diffuse[i] = specular[i] = centers[i] = normals[i] = Vec3Z();
+	    shininess[i] = 0;
+	    radius[i] = 1;
+	    triangle[i] = 0;
+	    continue;
+	}
+	const Material& m = scene.material(obj);
+	diffuse[i] = m.diffuse;
+	specular[i] = m.specular;
+	shininess[i] = m.shininess;
+	triangle[i] = (obj & TRIANGLE) ? -1 : 0;
+	if (obj & TRIANGLE) {
+	    uint32_t k = obj & ~TRIANGLE;
+	    normals[i] = Vec3B(scene.triangles.nx[k], scene.triangles.ny[k], scene.triangles.nz[k]);
+	    centers[i] = Vec3Z();
+	    radius[i] = 1;
+	} else {
+	    normals[i] = Vec3Z();
+	    centers[i] = Vec3B(scene.spheres.cx[obj], scene.spheres.cy[obj], scene.spheres.cz[obj]);
+	    radius[i] = scene.spheres.radius[obj];
+	}
+    }
+
+    // Sphere normals are computed in every lane and replaced in triangle lanes
+    Vec3x4 sn = divi(sub(p, gather(centers[0], centers[1], centers[2], centers[3])), wasm_v128_load(radius));
+    Vec3x4 tn = gather(normals[0], normals[1], normals[2], normals[3]);
+    v128_t tri = wasm_v128_load(triangle);
+    Vec3x4 n = { wasm_v128_bitselect(tn.x, sn.x, tri), wasm_v128_bitselect(tn.y, sn.y, tri), wasm_v128_bitselect(tn.z, sn.z, tri) };
+    *n1 = n;
+
+    v128_t zero = wasm_f32x4_splat(0);
+    v128_t d = wasm_f32x4_max(zero, dot(n, l1));
+    // v1 = normalize(neg(ray))
+    Vec3x4 v1 = muli(ray, wasm_f32x4_neg(rsqrt(dot(ray, ray))));
+    Vec3x4 h1 = normalize(add(v1, l1));
+    v128_t s = pow4(wasm_f32x4_max(zero, dot(n, h1)), wasm_v128_load(shininess));
+    return add(muli(gather(diffuse[0], diffuse[1], diffuse[2], diffuse[3]), d),
+	       muli(gather(specular[0], specular[1], specular[2], specular[3]), s));
+}
+
+#endif // PACKETS
+
+// Diffuse and specular light at a point with normal n1 seen along ray, with
+// light direction l1.
+
+static Vec3 lighting(const Material& m, V3P n1, V3P ray, V3P l1)
+{
+    const Float diffuse = Max(0.0, dot(n1,l1));
+    const Vec3 v1 = normalize(neg(ray));
+    const Vec3 h1 = normalize(add(v1, l1));
+    const Float specular = Pow(Max(0.0, dot(n1, h1)), m.shininess);
+    return add(muli(m.diffuse, diffuse), muli(m.specular, specular));
+}
+
+// Mirror reflection of ray about the normal n1.
+
+static inline Vec3 reflect(V3P ray, V3P n1) {
+    return sub(ray, muli(n1, 2.0*dot(ray, n1)));
+}
+
+// Color at point p on obj seen along ray, with light direction l1.
+
+static Vec3 shade(const RenderContext& ctx, PrimRef obj, V3P ray, V3P p, V3P l1, bool shadowed, uint32_t depth)
+{
+    const Material& m = ctx.scene->material(obj);
+    Vec3 n1 = ctx.scene->normal(obj, p);
+    Vec3 c = m.ambient;
+
+    if (!shadowed) {
+	c = add(c, lighting(m, n1, ray, l1));
+	// depth starts at g_reflection_depth, so this is off when that is zero
+	if (depth > 0 && m.mirror != 0.0) {
+	    const Vec3 r = reflect(ray, n1);
+	    c = add(c, muli(raycolor(ctx, add(p, muli(r, EPS)), r, EPS, SENTINEL, depth-1), m.mirror));
+	}
     }
-    return g_background;
+    return c;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -870,16 +2897,28 @@ static const Vec3 red = colorFromRGB(256, 0, 0);
 static const Vec3 blue = colorFromRGB(0, 0, 256);
 
 // Not restricted to a rectangle, actually
-static void rectangle(vector<Surface*>& world, const Material& m, V3P v1, V3P v2, V3P v3, V3P v4)
+static void triangle(World& world, uint32_t m, V3P v1, V3P v2, V3P v3)
+{
+    uint32_t a = world.vertex(v1);
+    uint32_t b = world.vertex(v2);
+    uint32_t c = world.vertex(v3);
+    world.triangles.push_back(Triangle(m, a, b, c));
+}
+
+static void rectangle(World& world, uint32_t m, V3P v1, V3P v2, V3P v3, V3P v4)
 {
-    world.push_back(new Triangle(m, v1, v2, v3));
-    world.push_back(new Triangle(m, v1, v3, v4));
+    uint32_t a = world.vertex(v1);
+    uint32_t b = world.vertex(v2);
+    uint32_t c = world.vertex(v3);
+    uint32_t d = world.vertex(v4);
+    world.triangles.push_back(Triangle(m, a, b, c));
+    world.triangles.push_back(Triangle(m, a, c, d));
 }
 
 // Vertices are for front and back faces, both counterclockwise as seen
 // from the outside.
 // Not restricted to a cube, actually.
-static void cube(vector<Surface*>& world, const Material& m, V3P v1, V3P v2, V3P v3, V3P v4, V3P v5, V3P v6, V3P v7, V3P v8)
+static void cube(World& world, uint32_t m, V3P v1, V3P v2, V3P v3, V3P v4, V3P v5, V3P v6, V3P v7, V3P v8)
 {
     rectangle(world, m, v1, v2, v3, v4);  // front
     rectangle(world, m, v2, v5, v8, v3);  // right
@@ -889,116 +2928,659 @@ static void cube(vector<Surface*>& world, const Material& m, V3P v1, V3P v2, V3P
     rectangle(world, m, v6, v1, v2, v5);  // bottom
 }
 
+// Load a mesh and scale it uniformly so that it is MESH_SIZE along its largest
+// extent and stands on the floor in the middle of the view.  The vertex and
+// index buffers are appended to the world's as they are.
+
+static const Float MESH_SIZE = 2;
+
+static void addMesh(World& world, uint32_t m, const char* filename)
+{
+    Mesh mesh;
+    const char* err = loadMesh(filename, &mesh);
+    if (err)
+	CRASH(err);
+    if (mesh.numTriangles() == 0)
+	CRASH("Mesh has no triangles");
+
+    float lo[3], hi[3];
+    for ( uint32_t k=0 ; k < 3 ; k++ )
+	lo[k] = hi[k] = mesh.positions[k];
+    for ( uint32_t i=0 ; i < mesh.positions.size() ; i++ ) {
+	lo[i % 3] = std::min(lo[i % 3], mesh.positions[i]);
+	hi[i % 3] = std::max(hi[i % 3], mesh.positions[i]);
+    }
+    Float extent = Max(hi[0]-lo[0], Max(hi[1]-lo[1], hi[2]-lo[2]));
+    Float scale = extent > 0 ? MESH_SIZE / extent : 1;
+    Float dx = 0.5 - scale*(lo[0]+hi[0])/2;
+    Float dy = -scale*lo[1];
+    Float dz = -scale*(lo[2]+hi[2])/2;
+
+    uint32_t base = world.vertices.size() / 3;
+    world.vertices.reserve(world.vertices.size() + mesh.positions.size());
+    for ( uint32_t i=0 ; i < mesh.positions.size() ; i+=3 ) {
+	world.vertices.push_back(mesh.positions[i]*scale + dx);
+	world.vertices.push_back(mesh.positions[i+1]*scale + dy);
+	world.vertices.push_back(mesh.positions[i+2]*scale + dz);
+    }
+    uint32_t first = world.triangles.size();
+    world.triangles.reserve(first + mesh.numTriangles());
+    for ( uint32_t i=0 ; i < mesh.indices.size() ; i+=3 ) {
+	uint32_t a = mesh.indices[i], b = mesh.indices[i+1], c = mesh.indices[i+2];
+	// Degenerate triangles can't be hit and have no normal
+	if (a == b || b == c || a == c)
+	    continue;
+	world.triangles.push_back(Triangle(m, base+a, base+b, base+c));
+    }
+#ifdef RUNTIME
+    uint32_t added = world.triangles.size() - first;
+    printf("Mesh: %u vertices, %u triangles, %u degenerate dropped\n", mesh.numVertices(), added, mesh.numTriangles() - added);
+#endif
+}
+
 static constexpr Float MAXBOUND = 1e100;
 static constexpr Float MINBOUND = -MAXBOUND;
 
-static Bounds computeBounds(vector<Surface*>& surfaces)
-{
-    Vec3 mins = Vec3C(MAXBOUND, MAXBOUND, MAXBOUND);
-    Vec3 maxs = Vec3C(MINBOUND, MINBOUND, MINBOUND);
-    for ( Surface *s : surfaces ) {
-	Bounds b = s->bounds();
-        mins = vmin(mins, b.mins);
-        maxs = vmax(maxs, b.maxs);
+// Construction of the BVH by the surface area heuristic (SAH).  Primitive
+// centroids are binned along each axis and the split between bins that
+// minimizes the SAH cost estimate is chosen; a node becomes a leaf when no
+// split is estimated to be cheaper than testing all its primitives.  The
+// primitives are partitioned in place, so there is no copying per level.
+
+static const uint32_t BVH_BINS = 16;
+static const uint32_t BVH_MAX_LEAF = 8;
+static const Float BVH_TRAVERSAL_COST = 1;	// Relative to one primitive test
+
+struct BuildPrim {
+    Bounds bounds;
+    Vec3 centroid;
+    PrimRef prim;		// Index into World::spheres or, with TRIANGLE, World::triangles
+
+    BuildPrim(const Bounds& bounds, V3P centroid, PrimRef prim)
+	: bounds(bounds)
+	, centroid(centroid)
+	, prim(prim)
+    {}
+};
+
+struct BuildBin {
+    Vec3 mins;
+    Vec3 maxs;
+    uint32_t count;
+
+    BuildBin()
+	: mins(Vec3C(MAXBOUND, MAXBOUND, MAXBOUND))
+	, maxs(Vec3C(MINBOUND, MINBOUND, MINBOUND))
+	, count(0)
+    {}
+};
+
+static inline Float axisOf(V3P v, uint32_t axis) {
+    switch (axis) {
+      case 0:  return X(v);
+      case 1:  return Y(v);
+      default: return Z(v);
     }
-    return Bounds(mins, maxs);
 }
 
-// This is not quite right, cf the Jumble object.  The bug could be here, or in
-// the intersection algorithm.
+static inline Float halfArea(V3P mins, V3P maxs) {
+    Vec3 d = sub(maxs, mins);
+    return X(d)*Y(d) + Y(d)*Z(d) + Z(d)*X(d);
+}
+
+static inline uint32_t binOf(V3P centroid, uint32_t axis, Float cmin, Float scale) {
+    uint32_t b = uint32_t((axisOf(centroid, axis) - cmin) * scale);
+    return b < BVH_BINS ? b : BVH_BINS-1;
+}
+
+// Leaves hold only one kind of primitive, so a node that would become a leaf
+// but holds both is split by kind.  The primitives of each leaf are emitted
+// into the scene's arrays in leaf order, with the leaf starting a new group.
 
-static Surface* partition(vector<Surface*>& surfaces, Bounds bounds, uint32_t axis)
+class BVHBuilder
 {
-    Surface* left=nullptr;
-    Surface* right=nullptr;
-    if (surfaces.size() == 1) {
-	left = surfaces[0];
-	right = nullptr;
+    const World& world;
+    vector<BuildPrim> prims;
+    vector<BVHNode> nodes;
+
+public:
+    BVHBuilder(const World& world) : world(world) {
+	prims.reserve(world.spheres.size() + world.triangles.size());
+	for ( uint32_t i=0 ; i < world.spheres.size() ; i++ )
+	    prims.push_back(BuildPrim(world.spheres[i].bounds(), world.spheres[i].centroid(), i));
+	for ( uint32_t i=0 ; i < world.triangles.size() ; i++ )
+	    prims.push_back(BuildPrim(world.bounds(world.triangles[i]), world.centroid(world.triangles[i]), i | TRIANGLE));
     }
-    else if (surfaces.size() == 2) {
-	left = surfaces[0];
-	right = surfaces[1];
+
+    void build(Scene* scene) {
+	// Every leaf holds a primitive, so there are fewer than twice as many
+	// nodes as primitives and the node array is never reallocated.
+	nodes.reserve(2*prims.size() + 1);
+	nodes.resize(1);
+	buildNode(0, 0, prims.size(), 0);
+
+	// Leaves are padded to whole groups.
+	size_t nspheres = 0, ntriangles = 0;
+	for ( const BVHNode& node : nodes ) {
+	    if (node.count) {
+		if (prims[node.leftFirst].prim & TRIANGLE)
+		    ntriangles += (node.count + 3) & ~3u;
+		else
+		    nspheres += (node.count + 3) & ~3u;
+	    }
+	}
+	scene->spheres.reserve(nspheres);
+	scene->triangles.reserve(ntriangles);
+
+	for ( BVHNode& node : nodes ) {
+	    if (node.count) {
+		uint32_t first = node.leftFirst;
+		uint32_t count = node.count;
+		if (prims[first].prim & TRIANGLE) {
+		    node.leftFirst = scene->triangles.size();
+		    node.count = count | TRIANGLE;
+		    for ( uint32_t j=first ; j < first+count ; j++ )
+			scene->triangles.add(world, world.triangles[prims[j].prim & ~TRIANGLE]);
+		    scene->triangles.pad();
+		} else {
+		    node.leftFirst = scene->spheres.size();
+		    for ( uint32_t j=first ; j < first+count ; j++ )
+			scene->spheres.add(world.spheres[prims[j].prim]);
+		    scene->spheres.pad();
+		}
+	    }
+	}
+	scene->nodes.assign(nodes);
     }
-    else {
-	// We really should choose the "best" partitioning here, ie the most
-	// even.  Instead we pick the first that works, and if we can't
-	// partition among any axis we put the objects in a bag together and
-	// trace them all.  There are other strategies.
-	uint32_t safety = 4;
-	vector<Surface*> lobj;
-	vector<Surface*> robj;
-	for (;;) {
-	    if (!--safety) {
-		WARNING("Degenerate parition");
-		return new Jumble(surfaces);
-	    }
-	    Float mid = 0;
-	    Float center = 0;
-	    for ( Surface* s : surfaces) {
-		switch (axis) {
-		  case 0:
-		    mid = (X(bounds.maxs) + X(bounds.mins)) / 2;
-		    center = X(s->center());
-		    break;
-		  case 1:
-		    mid = (Y(bounds.maxs) + Y(bounds.mins)) / 2;
-		    center = Y(s->center());
-		    break;
-		  case 2:
-		    mid = (Z(bounds.maxs) + Z(bounds.mins)) / 2;
-		    center = Z(s->center());
-		    break;
+
+private:
+    void buildNode(uint32_t ni, uint32_t first, uint32_t count, uint32_t depth) {
+	Vec3 mins = Vec3C(MAXBOUND, MAXBOUND, MAXBOUND);
+	Vec3 maxs = Vec3C(MINBOUND, MINBOUND, MINBOUND);
+	Vec3 cmins = mins;
+	Vec3 cmaxs = maxs;
+	uint32_t triangles = 0;
+	for ( uint32_t i=first ; i < first+count ; i++ ) {
+	    mins = vmin(mins, prims[i].bounds.mins);
+	    maxs = vmax(maxs, prims[i].bounds.maxs);
+	    cmins = vmin(cmins, prims[i].centroid);
+	    cmaxs = vmax(cmaxs, prims[i].centroid);
+	    if (prims[i].prim & TRIANGLE)
+		triangles++;
+	}
+	BVHNode& node = nodes[ni];
+	node.mins[0] = X(mins); node.mins[1] = Y(mins); node.mins[2] = Z(mins);
+	node.maxs[0] = X(maxs); node.maxs[1] = Y(maxs); node.maxs[2] = Z(maxs);
+	node.leftFirst = first;
+	node.count = count;
+
+	// Leave room for a split by kind below the depth limit.
+	uint32_t mid = first;
+	if (count > 1 && depth+2 < BVH_MAX_DEPTH)
+	    mid = split(first, count, mins, maxs, cmins, cmaxs);
+	if (mid == first) {
+	    if (triangles == 0 || triangles == count)
+		return;
+	    BuildPrim* p = std::partition(&prims[first], &prims[first] + count,
+					  [](const BuildPrim& bp) { return !(bp.prim & TRIANGLE); });
+	    mid = p - &prims[0];
+	}
+
+	uint32_t left = nodes.size();
+	nodes.resize(left + 2);
+	nodes[ni].leftFirst = left;
+	nodes[ni].count = 0;
+	buildNode(left, first, mid - first, depth+1);
+	buildNode(left+1, mid, first + count - mid, depth+1);
+    }
+
+    // Returns the start of the right half after partitioning the primitives
+    // in place, or first if the node should be a leaf.
+    uint32_t split(uint32_t first, uint32_t count, V3P mins, V3P maxs, V3P cmins, V3P cmaxs) {
+	Float best_cost = SENTINEL;
+	uint32_t best_axis = 0;
+	uint32_t best_split = 0;
+	for ( uint32_t axis=0 ; axis < 3 ; axis++ ) {
+	    Float cmin = axisOf(cmins, axis);
+	    Float cmax = axisOf(cmaxs, axis);
+	    if (cmax <= cmin)
+		continue;
+	    Float scale = BVH_BINS / (cmax - cmin);
+	    BuildBin bins[BVH_BINS];
+	    for ( uint32_t i=first ; i < first+count ; i++ ) {
+		BuildBin& bin = bins[binOf(prims[i].centroid, axis, cmin, scale)];
+		bin.mins = vmin(bin.mins, prims[i].bounds.mins);
+		bin.maxs = vmax(bin.maxs, prims[i].bounds.maxs);
+		bin.count++;
+	    }
+	    // Sweep from the right to get the cost of everything right of each
+	    // split, then from the left to evaluate the splits.
+	    Float right_cost[BVH_BINS];
+	    BuildBin acc;
+	    for ( uint32_t b=BVH_BINS-1 ; b > 0 ; b-- ) {
+		acc.mins = vmin(acc.mins, bins[b].mins);
+		acc.maxs = vmax(acc.maxs, bins[b].maxs);
+		acc.count += bins[b].count;
+		right_cost[b-1] = acc.count ? halfArea(acc.mins, acc.maxs) * acc.count : 0;
+	    }
+	    acc = BuildBin();
+	    for ( uint32_t b=0 ; b < BVH_BINS-1 ; b++ ) {
+		acc.mins = vmin(acc.mins, bins[b].mins);
+		acc.maxs = vmax(acc.maxs, bins[b].maxs);
+		acc.count += bins[b].count;
+		if (acc.count == 0 || acc.count == count)
+		    continue;
+		Float cost = halfArea(acc.mins, acc.maxs) * acc.count + right_cost[b];
+		if (cost < best_cost) {
+		    best_cost = cost;
+		    best_axis = axis;
+		    best_split = b;
 		}
-		if (center <= mid)
-		    lobj.push_back(s);
-		else
-		    robj.push_back(s);
 	    }
-	    axis = (axis + 1) % 3;
-	    if (robj.size() && lobj.size())
-		break;
-	    lobj.clear();
-	    robj.clear();
-	}
-	left = lobj.size() == 1 ? lobj[0] : partition(lobj, computeBounds(lobj), axis);
-	right = robj.size() == 1 ? robj[0] : partition(robj, computeBounds(robj), axis);
-    }
-    return new Volume(bounds, left, right);
-}
-
-static Surface* setStage(Vec3* eye, Vec3* light, Vec3* background)
-{
-    Material m1(Vec3C(0.1, 0.2, 0.2), Vec3C(0.3, 0.6, 0.6), 10, Vec3C(0.05, 0.1, 0.1),  0);
-    Material m2(Vec3C(0.3, 0.3, 0.2), Vec3C(0.6, 0.6, 0.4), 10, Vec3C(0.1,  0.1, 0.05), 0);
-    Material m3(Vec3C(0.1, 0.0, 0.0), Vec3C(0.8, 0.0, 0.0), 10, Vec3C(0.1,  0.0, 0.0),  0);
-    Material m4(muli(darkGray,0.4),  muli(darkGray,0.3), 100, muli(darkGray,0.3),    0.5);
-    Material m5(muli(paleGreen,0.4), muli(paleGreen,0.4), 10, muli(paleGreen,0.2),   1.0);
-    Material m6(muli(yellow,0.6),    Vec3C(0, 0, 0),        0, muli(yellow,0.4),      0);
-    Material m7(muli(red,0.6),       Vec3C(0, 0, 0),        0, muli(red,0.4),         0);
-    Material m8(muli(blue,0.6),      Vec3C(0, 0, 0),        0, muli(blue,0.4),        0);
-
-    vector<Surface*> world;
-
-    world.push_back(new Sphere(m1, Vec3C(-1, 1, -9), 1));
-    world.push_back(new Sphere(m2, Vec3C(1.5, 1, 0), 0.75));
-    world.push_back(new Triangle(m1, Vec3C(-1,0,0.75), Vec3C(-0.75,0,0), Vec3C(-0.75,1.5,0)));
-    world.push_back(new Triangle(m3, Vec3C(-2,0,0), Vec3C(-0.5,0,0), Vec3C(-0.5,2,0)));
-    rectangle(world, m4, Vec3C(-5,0,5), Vec3C(5,0,5), Vec3C(5,0,-40), Vec3C(-5,0,-40));
-    cube(world, m5, Vec3C(1, 1.5, 1.5), Vec3C(1.5, 1.5, 1.25), Vec3C(1.5, 1.75, 1.25), Vec3C(1, 1.75, 1.5),
-	 Vec3C(1.5, 1.5, 0.5), Vec3C(1, 1.5, 0.75), Vec3C(1, 1.75, 0.75), Vec3C(1.5, 1.75, 0.5));
-    for ( uint32_t i=0 ; i < 30 ; i++ )
-	world.push_back(new Sphere(m6, Vec3B((-0.6+(i*0.2)), (0.075+(i*0.05)), (1.5-(i*Cos(i/30.0)*0.5))), 0.075));
-    for ( uint32_t i=0 ; i < 60 ; i++ )
-	world.push_back(new Sphere(m7, Vec3B((1+0.3*Sin(i*(3.14/16))), (0.075+(i*0.025)), (1+0.3*Cos(i*(3.14/16)))), 0.025));
-    for ( uint32_t i=0 ; i < 60 ; i++ )
-	world.push_back(new Sphere(m8, Vec3B((1+0.3*Sin(i*(3.14/16))), (0.075+((i+8)*0.025)), (1+0.3*Cos(i*(3.14/16)))), 0.025));
+	}
+
+	if (best_cost == SENTINEL) {
+	    // All centroids coincide.  Keep small sets together, split large
+	    // ones arbitrarily to bound the leaf size.
+	    if (count <= BVH_MAX_LEAF)
+		return first;
+	    return first + count/2;
+	}
+
+	Float area = halfArea(mins, maxs);
+	Float split_cost = area > 0 ? BVH_TRAVERSAL_COST + best_cost / area : SENTINEL;
+	if (split_cost >= count && count <= BVH_MAX_LEAF)
+	    return first;
+	Float cmin = axisOf(cmins, best_axis);
+	Float scale = BVH_BINS / (axisOf(cmaxs, best_axis) - cmin);
+	BuildPrim* p = std::partition(&prims[first], &prims[first] + count,
+				      [=](const BuildPrim& bp) {
+					  return binOf(bp.centroid, best_axis, cmin, scale) <= best_split;
+				      });
+	return p - &prims[0];
+    }
+};
+
+// Scene storage.  While a scene is built its arrays grow one by one; when it is
+// complete compact() moves them all into one block, in the order given by
+// sceneArrays() and each starting a cache line.  The block is freed in one step
+// with the scene and is what the scene cache writes and maps.
+
+static const uint32_t SCENE_ARRAYS = 21;
+
+// Calls f(array) for every array of the scene, in block order.
+template<typename F>
+static void sceneArrays(Scene& s, F& f) {
+    f(s.materials); f(s.nodes);
+    f(s.spheres.cx); f(s.spheres.cy); f(s.spheres.cz); f(s.spheres.r2);
+    f(s.spheres.radius); f(s.spheres.material);
+    f(s.triangles.v1x); f(s.triangles.v1y); f(s.triangles.v1z);
+    f(s.triangles.e1x); f(s.triangles.e1y); f(s.triangles.e1z);
+    f(s.triangles.e2x); f(s.triangles.e2y); f(s.triangles.e2z);
+    f(s.triangles.nx); f(s.triangles.ny); f(s.triangles.nz);
+    f(s.triangles.material);
+}
+
+static uint64_t alignLine(uint64_t n) {
+    return (n + 63) & ~uint64_t(63);
+}
+
+// Visitors for sceneArrays(), one per pass over the arrays.
+
+struct SceneLayout {
+    uint64_t* offset;
+    uint64_t* length;		// In elements
+    uint32_t i;
+    uint64_t off;		// Total size after the pass
+
+    template<typename T>
+    void operator()(Array<T>& a) {
+	offset[i] = off;
+	length[i] = a.size();
+	off = alignLine(off + a.size() * sizeof(T));
+	i++;
+    }
+};
+
+struct SceneMover {
+    char* block;
+    const uint64_t* offset;
+    uint32_t i;
+
+    template<typename T>
+    void operator()(Array<T>& a) {
+	char* p = block + offset[i++];
+	size_t nbytes = a.size() * sizeof(T);
+	if (nbytes)
+	    memcpy(p, a.data(), nbytes);
+	// Zero the padding so that the block is written out deterministically
+	memset(p + nbytes, 0, alignLine(nbytes) - nbytes);
+	a.view((const T*)p, a.size());
+    }
+};
+
+static void compact(Scene* scene) {
+    uint64_t offset[SCENE_ARRAYS];
+    uint64_t length[SCENE_ARRAYS];
+    SceneLayout layout = { offset, length, 0, 0 };
+    sceneArrays(*scene, layout);
+    char* block = (char*)aligned_alloc(64, std::max(layout.off, uint64_t(64)));
+    if (!block)
+	CRASH("Failed to allocate scene");
+    SceneMover mover = { block, offset, 0 };
+    sceneArrays(*scene, mover);
+    scene->block = block;
+    scene->block_size = layout.off;
+    scene->mapped = false;
+}
+
+// Prebuilt scene cache.  A built Scene is written to a file that a later run
+// maps into memory and traces directly, with no parse or build step.  The file
+// is a header followed by the scene's block, so that each array is at a 64-byte
+// aligned offset from the start of the file, in the order of sceneArrays().  The
+// data are in the layout of the writing program, so the header records the
+// sizes that the layout depends on and a file is only used by a program that
+// agrees on them.
+//
+// Files are named by a hash of the scene input: the World before any mesh is
+// added, the partitioning flag, the layout, and the bytes of the mesh file.  A
+// changed scene therefore gets a new file rather than a stale one.
+
+static const uint32_t SCENE_CACHE_VERSION = 1;
+static const char SCENE_CACHE_MAGIC[8] = { 'R', 'B', 'S', 'C', 'E', 'N', 'E', 0 };
+static const uint32_t SCENE_CACHE_ARRAYS = SCENE_ARRAYS;
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sizeof_float;
+    uint32_t sizeof_vec3;
+    uint32_t sizeof_material;
+    uint32_t sizeof_node;
+    uint32_t partitioned;
+    uint64_t key;
+    uint64_t file_size;
+    uint32_t sphere_count;	// Not counting padding
+    uint32_t triangle_count;
+    uint64_t offset[SCENE_CACHE_ARRAYS];
+    uint64_t length[SCENE_CACHE_ARRAYS];	// In elements
+};
+
+// FNV-1a
+static uint64_t hashBytes(uint64_t h, const void* p, size_t n) {
+    const uint8_t* b = (const uint8_t*)p;
+    for ( size_t i=0 ; i < n ; i++ )
+	h = (h ^ b[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+template<typename T>
+static uint64_t hashValue(uint64_t h, T v) {
+    return hashBytes(h, &v, sizeof(v));
+}
+
+static uint64_t hashVec3(uint64_t h, V3P v) {
+    return hashValue(hashValue(hashValue(h, X(v)), Y(v)), Z(v));
+}
+
+class SceneCache
+{
+    SceneCacheHeader header;
+    char path[4096];
+
+    static const uint64_t HEADER_SPACE = (sizeof(SceneCacheHeader) + 63) & ~uint64_t(63);
+
+    // Visitor for sceneArrays() that views the arrays in the file.
+
+    struct Mapper {
+	const SceneCacheHeader& h;
+	const char* mem;
+	uint32_t i;
+	bool ok;
+
+	template<typename T>
+	void operator()(Array<T>& a) {
+	    uint64_t off = h.offset[i];
+	    uint64_t len = h.length[i];
+	    i++;
+	    if (off % 64 || off > h.file_size || len > (h.file_size - off) / sizeof(T))
+		ok = false;
+	    else
+		a.view((const T*)(mem + off), len);
+	}
+    };
+
+public:
+    SceneCache(const char* dir, const World& world, const char* mesh) {
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_CACHE_VERSION;
+	header.sizeof_float = sizeof(Float);
+	header.sizeof_vec3 = sizeof(Vec3);
+	header.sizeof_material = sizeof(Material);
+	header.sizeof_node = sizeof(BVHNode);
+	header.partitioned = g_partitioning;
+
+	// Fields are hashed one by one as structs may have padding.
+	uint64_t h = hashBytes(0xcbf29ce484222325ULL, &header, offsetof(SceneCacheHeader, key));
+	for ( const Material& m : world.materials ) {
+	    h = hashVec3(hashVec3(hashVec3(h, m.diffuse), m.specular), m.ambient);
+	    h = hashValue(hashValue(h, m.shininess), m.mirror);
+	}
+	for ( const Sphere& s : world.spheres )
+	    h = hashValue(hashValue(hashVec3(h, s.center), s.radius), s.material);
+	h = hashBytes(h, world.vertices.data(), world.vertices.size() * sizeof(Float));
+	for ( const Triangle& t : world.triangles )
+	    h = hashValue(hashValue(hashValue(hashValue(h, t.v1), t.v2), t.v3), t.material);
+	if (mesh) {
+	    FILE* f = fopen(mesh, "rb");
+	    if (!f)
+		CRASH("Can't open mesh file");
+	    static char buf[1 << 16];
+	    size_t n;
+	    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		h = hashBytes(h, buf, n);
+	    fclose(f);
+	}
+	header.key = h;
+	snprintf(path, sizeof(path), "%s/raybench-%016llx.scene", dir, (unsigned long long)h);
+    }
+
+    const char* filename() const {
+	return path;
+    }
+
+    // Map the cached scene, or return nullptr if there is none or it is not
+    // usable.  The mapping is the scene's block.
+    Scene* load() {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	    return nullptr;
+	struct stat st;
+	void* mem = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(SceneCacheHeader))
+	    mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	    return nullptr;
+
+	const SceneCacheHeader* h = (const SceneCacheHeader*)mem;
+	if (memcmp(h, &header, offsetof(SceneCacheHeader, file_size)) != 0 || h->file_size != uint64_t(st.st_size)) {
+	    munmap(mem, st.st_size);
+	    return nullptr;
+	}
+
+	Scene* scene = new Scene();
+	scene->block = (char*)mem;
+	scene->block_size = st.st_size;
+	scene->mapped = true;
+	Mapper mapper = { *h, (const char*)mem, 0, true };
+	sceneArrays(*scene, mapper);
+	scene->spheres.count = h->sphere_count;
+	scene->triangles.count = h->triangle_count;
+	if (!mapper.ok || !valid(*scene)) {
+	    delete scene;
+	    return nullptr;
+	}
+	return scene;
+    }
+
+    // Write the scene to a temporary file that is renamed into place, so that
+    // concurrent runs never see a partial file.  Failure is not fatal.  The
+    // scene must have been compacted.
+    bool save(Scene* scene) {
+	SceneLayout layout = { header.offset, header.length, 0, 0 };
+	sceneArrays(*scene, layout);
+	for ( uint32_t i=0 ; i < SCENE_CACHE_ARRAYS ; i++ )
+	    header.offset[i] += HEADER_SPACE;
+	header.file_size = HEADER_SPACE + layout.off;
+	header.sphere_count = scene->spheres.count;
+	header.triangle_count = scene->triangles.count;
+
+	char tmp[sizeof(path) + 32];
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, int(getpid()));
+	FILE* f = fopen(tmp, "wb");
+	if (!f) {
+	    WARNING("Can't write scene cache");
+	    return false;
+	}
+	static const char zeroes[64] = { 0 };
+	size_t npad = HEADER_SPACE - sizeof(header);
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+	          fwrite(zeroes, 1, npad, f) == npad &&
+	          fwrite(scene->block, 1, layout.off, f) == layout.off;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp, path) != 0) {
+	    remove(tmp);
+	    WARNING("Can't write scene cache");
+	    return false;
+	}
+	return true;
+    }
+
+private:
+    // The arrays must agree in length and the hierarchy must reference only
+    // primitives and nodes that exist, with children after their parents so
+    // that it has no cycles, and be no deeper than the traversal stack.
+    static bool valid(const Scene& s) {
+	const Spheres& sp = s.spheres;
+	const Triangles& tr = s.triangles;
+	size_t ns = sp.size(), nt = tr.size();
+	if (sp.cy.size() != ns || sp.cz.size() != ns || sp.r2.size() != ns || sp.radius.size() != ns ||
+	    sp.material.size() != ns || sp.count > ns || ns % 4)
+	    return false;
+	for ( const Array<Float>* a : { &tr.v1y, &tr.v1z, &tr.e1x, &tr.e1y, &tr.e1z, &tr.e2x, &tr.e2y, &tr.e2z,
+					 &tr.nx, &tr.ny, &tr.nz } ) {
+	    if (a->size() != nt)
+		return false;
+	}
+	if (tr.material.size() != nt || tr.count > nt || nt % 4)
+	    return false;
+	for ( size_t i=0 ; i < ns ; i++ ) {
+	    if (sp.material[i] >= s.materials.size())
+		return false;
+	}
+	for ( size_t i=0 ; i < nt ; i++ ) {
+	    if (tr.material[i] >= s.materials.size())
+		return false;
+	}
+	vector<uint8_t> depth(s.nodes.size());
+	for ( size_t i=0 ; i < s.nodes.size() ; i++ ) {
+	    const BVHNode& n = s.nodes[i];
+	    if (n.count) {
+		uint32_t count = n.count & ~TRIANGLE;
+		size_t limit = n.count & TRIANGLE ? nt : ns;
+		// The kernels read whole groups of 4 from leftFirst, which
+		// stay in the arrays since those are padded to groups of 4
+		if (n.leftFirst % 4 || n.leftFirst > limit || count > limit - n.leftFirst)
+		    return false;
+	    } else {
+		if (n.leftFirst <= i || n.leftFirst + 1 >= s.nodes.size())
+		    return false;
+		if (depth[i] + 1u >= BVH_MAX_DEPTH)
+		    return false;
+		depth[n.leftFirst] = depth[n.leftFirst+1] = depth[i] + 1;
+	    }
+	}
+	return true;
+    }
+};
+
+static Scene* setStage(Vec3* eye, Vec3* light, Vec3* background)
+{
+    World world;
+
+    uint32_t m1 = world.material(Material(Vec3C(0.1, 0.2, 0.2), Vec3C(0.3, 0.6, 0.6), 10, Vec3C(0.05, 0.1, 0.1),  0));
+    uint32_t m2 = world.material(Material(Vec3C(0.3, 0.3, 0.2), Vec3C(0.6, 0.6, 0.4), 10, Vec3C(0.1,  0.1, 0.05), 0));
+    uint32_t m3 = world.material(Material(Vec3C(0.1, 0.0, 0.0), Vec3C(0.8, 0.0, 0.0), 10, Vec3C(0.1,  0.0, 0.0),  0));
+    uint32_t m4 = world.material(Material(muli(darkGray,0.4),  muli(darkGray,0.3), 100, muli(darkGray,0.3),    0.5));
+    uint32_t m5 = world.material(Material(muli(paleGreen,0.4), muli(paleGreen,0.4), 10, muli(paleGreen,0.2),   1.0));
+    uint32_t m6 = world.material(Material(muli(yellow,0.6),    Vec3C(0, 0, 0),        0, muli(yellow,0.4),      0));
+    uint32_t m7 = world.material(Material(muli(red,0.6),       Vec3C(0, 0, 0),        0, muli(red,0.4),         0));
+    uint32_t m8 = world.material(Material(muli(blue,0.6),      Vec3C(0, 0, 0),        0, muli(blue,0.4),        0));
+
+    if (g_mesh) {
+	// The mesh is added below, when it is not in the cache
+	rectangle(world, m4, Vec3C(-5,0,5), Vec3C(5,0,5), Vec3C(5,0,-40), Vec3C(-5,0,-40));
+    } else {
+	world.spheres.push_back(Sphere(m1, Vec3C(-1, 1, -9), 1));
+	world.spheres.push_back(Sphere(m2, Vec3C(1.5, 1, 0), 0.75));
+	triangle(world, m1, Vec3C(-1,0,0.75), Vec3C(-0.75,0,0), Vec3C(-0.75,1.5,0));
+	triangle(world, m3, Vec3C(-2,0,0), Vec3C(-0.5,0,0), Vec3C(-0.5,2,0));
+	rectangle(world, m4, Vec3C(-5,0,5), Vec3C(5,0,5), Vec3C(5,0,-40), Vec3C(-5,0,-40));
+	cube(world, m5, Vec3C(1, 1.5, 1.5), Vec3C(1.5, 1.5, 1.25), Vec3C(1.5, 1.75, 1.25), Vec3C(1, 1.75, 1.5),
+	     Vec3C(1.5, 1.5, 0.5), Vec3C(1, 1.5, 0.75), Vec3C(1, 1.75, 0.75), Vec3C(1.5, 1.75, 0.5));
+	for ( uint32_t i=0 ; i < 30 ; i++ )
+	    world.spheres.push_back(Sphere(m6, Vec3B((-0.6+(i*0.2)), (0.075+(i*0.05)), (1.5-(i*Cos(i/30.0)*0.5))), 0.075));
+	for ( uint32_t i=0 ; i < 60 ; i++ )
+	    world.spheres.push_back(Sphere(m7, Vec3B((1+0.3*Sin(i*(3.14/16))), (0.075+(i*0.025)), (1+0.3*Cos(i*(3.14/16)))), 0.025));
+	for ( uint32_t i=0 ; i < 60 ; i++ )
+	    world.spheres.push_back(Sphere(m8, Vec3B((1+0.3*Sin(i*(3.14/16))), (0.075+((i+8)*0.025)), (1+0.3*Cos(i*(3.14/16)))), 0.025));
+    }
 
     *eye        = Vec3C(0.5, 0.75, 5);
     *light      = Vec3B(g_left-1, g_top, 2);
     *background = colorFromRGB(25, 25, 112);
 
-    if (g_partitioning)
-	return partition(world, computeBounds(world), 0);
+    SceneCache* cache = nullptr;
+    if (g_cache) {
+	cache = new SceneCache(g_cache, world, g_mesh);
+	if (Scene* scene = cache->load()) {
+#ifdef RUNTIME
+	    printf("Scene cache: loaded %s\n", cache->filename());
+#endif
+	    delete cache;
+	    return scene;
+	}
+    }
+
+    if (g_mesh)
+	addMesh(world, m2, g_mesh);
+
+    Scene* scene = new Scene();
+    scene->materials.assign(world.materials);
+    if (g_partitioning) {
+	BVHBuilder(world).build(scene);
+    } else {
+	scene->spheres.reserve((world.spheres.size() + 3) & ~size_t(3));
+	scene->triangles.reserve((world.triangles.size() + 3) & ~size_t(3));
+	for ( const Sphere& s : world.spheres )
+	    scene->spheres.add(s);
+	scene->spheres.pad();
+	for ( const Triangle& t : world.triangles )
+	    scene->triangles.add(world, t);
+	scene->triangles.pad();
+    }
+    compact(scene);
 
-    return new Jumble(world);
+    if (cache) {
+#ifdef RUNTIME
+	if (cache->save(scene))
+	    printf("Scene cache: saved %s\n", cache->filename());
+#else
+	cache->save(scene);
+#endif
+	delete cache;
+    }
+    return scene;
 }
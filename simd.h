@@ -0,0 +1,298 @@
+/* -*- mode: c++ -*- */
+
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Portable 128-bit SIMD.  The benchmarks are written against the wasm SIMD
+ * intrinsics; when compiling for wasm this simply includes <wasm_simd128.h>,
+ * and when compiling natively for x86 it provides the same intrinsics on top
+ * of SSE4.1 so that the same kernels can be run natively.
+ *
+ * Only the operations that the benchmarks use are provided natively.  Their
+ * semantics follow wasm where the two differ and it matters: f32x4 min and max
+ * propagate NaN, and conversion from float to integer saturates.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__wasm_simd128__)
+
+#include <wasm_simd128.h>
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#ifndef __SSE4_1__
+#  error "Native SIMD requires SSE4.1, compile with -msse4.1 or better"
+#endif
+
+#include <stdint.h>
+#include <immintrin.h>
+
+typedef __m128i v128_t;
+
+#define SIMD_INLINE static inline __attribute__((always_inline))
+
+#define SIMD_F(v) _mm_castsi128_ps(v)
+#define SIMD_I(v) _mm_castps_si128(v)
+#define SIMD_D(v) _mm_castsi128_pd(v)
+#define SIMD_DI(v) _mm_castpd_si128(v)
+
+// Memory
+
+SIMD_INLINE v128_t wasm_v128_load(const void* p) {
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+SIMD_INLINE void wasm_v128_store(void* p, v128_t v) {
+    _mm_storeu_si128((__m128i*)p, v);
+}
+
+// Construction.  The lane arguments of the _const forms must be constant in
+// wasm; here they need not be.
+
+#define wasm_f32x4_const(a, b, c, d) _mm_castps_si128(_mm_setr_ps(a, b, c, d))
+#define wasm_i32x4_const(a, b, c, d) _mm_setr_epi32(a, b, c, d)
+
+SIMD_INLINE v128_t wasm_f32x4_make(float a, float b, float c, float d) {
+    return SIMD_I(_mm_setr_ps(a, b, c, d));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_splat(float a) {
+    return SIMD_I(_mm_set1_ps(a));
+}
+
+SIMD_INLINE v128_t wasm_i32x4_splat(int32_t a) {
+    return _mm_set1_epi32(a);
+}
+
+SIMD_INLINE v128_t wasm_f64x2_make(double a, double b) {
+    return SIMD_DI(_mm_setr_pd(a, b));
+}
+
+SIMD_INLINE v128_t wasm_f64x2_splat(double a) {
+    return SIMD_DI(_mm_set1_pd(a));
+}
+
+SIMD_INLINE v128_t wasm_i64x2_splat(int64_t a) {
+    return _mm_set1_epi64x(a);
+}
+
+// Lanes.  The lane index must be a constant.
+
+#define wasm_f32x4_extract_lane(v, i) \
+    _mm_cvtss_f32(_mm_shuffle_ps(_mm_castsi128_ps(v), _mm_castsi128_ps(v), _MM_SHUFFLE(i, i, i, i)))
+
+#define wasm_i32x4_extract_lane(v, i) _mm_extract_epi32(v, i)
+
+// _mm_extract_epi64 is not available on 32-bit x86.
+#define wasm_i64x2_extract_lane(v, i) ((int64_t)((__v2di)(v))[i])
+
+#define wasm_f64x2_extract_lane(v, i) ((double)((__v2df)(v))[i])
+
+// Lane indices 0-3 select from a, 4-7 from b.
+#define wasm_v32x4_shuffle(a, b, c0, c1, c2, c3) \
+    ((v128_t)__builtin_shufflevector((__v4si)(a), (__v4si)(b), c0, c1, c2, c3))
+
+// Byte i of the result is byte s[i] of a, or zero if s[i] is past 15.  pshufb
+// only zeroes for indices with the high bit set, so set it for 16-127 too.
+SIMD_INLINE v128_t wasm_v8x16_swizzle(v128_t a, v128_t s) {
+    return _mm_shuffle_epi8(a, _mm_or_si128(s, _mm_cmpgt_epi8(s, _mm_set1_epi8(15))));
+}
+
+// Bitwise
+
+SIMD_INLINE v128_t wasm_v128_and(v128_t a, v128_t b) {
+    return _mm_and_si128(a, b);
+}
+
+SIMD_INLINE v128_t wasm_v128_or(v128_t a, v128_t b) {
+    return _mm_or_si128(a, b);
+}
+
+SIMD_INLINE v128_t wasm_v128_xor(v128_t a, v128_t b) {
+    return _mm_xor_si128(a, b);
+}
+
+// a & ~b, note the operand order is the reverse of _mm_andnot_si128's.
+SIMD_INLINE v128_t wasm_v128_andnot(v128_t a, v128_t b) {
+    return _mm_andnot_si128(b, a);
+}
+
+// Bits from a where c is set, from b elsewhere.
+SIMD_INLINE v128_t wasm_v128_bitselect(v128_t a, v128_t b, v128_t c) {
+    return _mm_or_si128(_mm_and_si128(c, a), _mm_andnot_si128(c, b));
+}
+
+SIMD_INLINE bool wasm_i32x4_any_true(v128_t a) {
+    return !_mm_testz_si128(a, a);
+}
+
+SIMD_INLINE bool wasm_i32x4_all_true(v128_t a) {
+    return _mm_movemask_ps(SIMD_F(_mm_cmpeq_epi32(a, _mm_setzero_si128()))) == 0;
+}
+
+// f32x4 arithmetic
+
+SIMD_INLINE v128_t wasm_f32x4_add(v128_t a, v128_t b) {
+    return SIMD_I(_mm_add_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_sub(v128_t a, v128_t b) {
+    return SIMD_I(_mm_sub_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_mul(v128_t a, v128_t b) {
+    return SIMD_I(_mm_mul_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_div(v128_t a, v128_t b) {
+    return SIMD_I(_mm_div_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_neg(v128_t a) {
+    return _mm_xor_si128(a, _mm_set1_epi32(0x80000000));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_sqrt(v128_t a) {
+    return SIMD_I(_mm_sqrt_ps(SIMD_F(a)));
+}
+
+// minps and maxps return the second operand if either is NaN; wasm returns NaN.
+SIMD_INLINE v128_t wasm_f32x4_min(v128_t a, v128_t b) {
+    __m128 nan = _mm_cmpunord_ps(SIMD_F(a), SIMD_F(b));
+    return SIMD_I(_mm_or_ps(_mm_min_ps(SIMD_F(a), SIMD_F(b)), nan));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_max(v128_t a, v128_t b) {
+    __m128 nan = _mm_cmpunord_ps(SIMD_F(a), SIMD_F(b));
+    return SIMD_I(_mm_or_ps(_mm_max_ps(SIMD_F(a), SIMD_F(b)), nan));
+}
+
+// f32x4 comparisons
+
+SIMD_INLINE v128_t wasm_f32x4_eq(v128_t a, v128_t b) {
+    return SIMD_I(_mm_cmpeq_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_lt(v128_t a, v128_t b) {
+    return SIMD_I(_mm_cmplt_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_le(v128_t a, v128_t b) {
+    return SIMD_I(_mm_cmple_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_gt(v128_t a, v128_t b) {
+    return SIMD_I(_mm_cmpgt_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+SIMD_INLINE v128_t wasm_f32x4_ge(v128_t a, v128_t b) {
+    return SIMD_I(_mm_cmpge_ps(SIMD_F(a), SIMD_F(b)));
+}
+
+// i32x4
+
+SIMD_INLINE v128_t wasm_i32x4_add(v128_t a, v128_t b) {
+    return _mm_add_epi32(a, b);
+}
+
+SIMD_INLINE v128_t wasm_i32x4_sub(v128_t a, v128_t b) {
+    return _mm_sub_epi32(a, b);
+}
+
+SIMD_INLINE v128_t wasm_i32x4_eq(v128_t a, v128_t b) {
+    return _mm_cmpeq_epi32(a, b);
+}
+
+SIMD_INLINE v128_t wasm_i32x4_gt(v128_t a, v128_t b) {
+    return _mm_cmpgt_epi32(a, b);
+}
+
+// The shift count is taken modulo 32, as in wasm.
+
+SIMD_INLINE v128_t wasm_i32x4_shl(v128_t a, int32_t n) {
+    return _mm_sll_epi32(a, _mm_cvtsi32_si128(n & 31));
+}
+
+SIMD_INLINE v128_t wasm_i32x4_shr(v128_t a, int32_t n) {
+    return _mm_sra_epi32(a, _mm_cvtsi32_si128(n & 31));
+}
+
+SIMD_INLINE v128_t wasm_u32x4_shr(v128_t a, int32_t n) {
+    return _mm_srl_epi32(a, _mm_cvtsi32_si128(n & 31));
+}
+
+// f64x2
+
+SIMD_INLINE v128_t wasm_f64x2_add(v128_t a, v128_t b) {
+    return SIMD_DI(_mm_add_pd(SIMD_D(a), SIMD_D(b)));
+}
+
+SIMD_INLINE v128_t wasm_f64x2_sub(v128_t a, v128_t b) {
+    return SIMD_DI(_mm_sub_pd(SIMD_D(a), SIMD_D(b)));
+}
+
+SIMD_INLINE v128_t wasm_f64x2_mul(v128_t a, v128_t b) {
+    return SIMD_DI(_mm_mul_pd(SIMD_D(a), SIMD_D(b)));
+}
+
+SIMD_INLINE v128_t wasm_f64x2_eq(v128_t a, v128_t b) {
+    return SIMD_DI(_mm_cmpeq_pd(SIMD_D(a), SIMD_D(b)));
+}
+
+SIMD_INLINE v128_t wasm_f64x2_lt(v128_t a, v128_t b) {
+    return SIMD_DI(_mm_cmplt_pd(SIMD_D(a), SIMD_D(b)));
+}
+
+SIMD_INLINE v128_t wasm_f64x2_le(v128_t a, v128_t b) {
+    return SIMD_DI(_mm_cmple_pd(SIMD_D(a), SIMD_D(b)));
+}
+
+// i64x2
+
+SIMD_INLINE v128_t wasm_i64x2_sub(v128_t a, v128_t b) {
+    return _mm_sub_epi64(a, b);
+}
+
+// Conversions
+
+SIMD_INLINE v128_t wasm_f32x4_convert_i32x4(v128_t a) {
+    return SIMD_I(_mm_cvtepi32_ps(a));
+}
+
+// cvttps2dq returns 0x80000000 for NaN and for anything out of range; wasm
+// saturates, and NaN becomes zero.
+SIMD_INLINE v128_t wasm_i32x4_trunc_saturate_f32x4(v128_t a) {
+    __m128i r = _mm_cvttps_epi32(SIMD_F(a));
+    __m128i over = SIMD_I(_mm_cmpge_ps(SIMD_F(a), _mm_set1_ps(2147483648.0f)));
+    __m128i ordered = SIMD_I(_mm_cmpord_ps(SIMD_F(a), SIMD_F(a)));
+    return _mm_and_si128(_mm_xor_si128(r, over), ordered);
+}
+
+// Signed saturation of a and then b to half the width.
+SIMD_INLINE v128_t wasm_i16x8_narrow_i32x4(v128_t a, v128_t b) {
+    return _mm_packs_epi32(a, b);
+}
+
+// Unsigned saturation of signed a and then b to half the width.
+SIMD_INLINE v128_t wasm_u8x16_narrow_i16x8(v128_t a, v128_t b) {
+    return _mm_packus_epi16(a, b);
+}
+
+#undef SIMD_F
+#undef SIMD_I
+#undef SIMD_D
+#undef SIMD_DI
+#undef SIMD_INLINE
+
+#else
+
+#  error "No SIMD support for this target"
+
+#endif
+
+#endif // SIMD_H
@@ -1,64 +1,31 @@
 // Simplistic wasm benchmark: sum columns in a long array of v128, compare simd
 // and scalar, for a few widths
 
+load("bench.js");
+
 let bin = os.file.readFile("sumcols.wasm", "binary");
 let ins = new WebAssembly.Instance(new WebAssembly.Module(bin));
 
-let mem = new Float32Array(ins.exports.mem.buffer);
-for ( let i=0 ; i < 1000*4; i++ )
-    mem[i] = i;
-let then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumf32x4(16, 1000);
-print("f32 simd " + (Date.now() - then));
-let xs=get(mem, 4);
-then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumf32x4_scalar(16, 1000);
-print("f32 scalar " + (Date.now() - then));
-assertSame(xs, get(mem, 4));
-
-mem = new Float64Array(ins.exports.mem.buffer);
-for ( let i=0 ; i < 1000*2; i++ )
-    mem[i] = i;
-then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumf64x2(16, 1000);
-print("f64 simd " + (Date.now() - then));
-xs=get(mem, 2);
-then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumf64x2_scalar(16, 1000);
-print("f64 scalar " + (Date.now() - then));
-assertSame(xs, get(mem, 2));
-
-mem = new Int32Array(ins.exports.mem.buffer);
-for ( let i=0 ; i < 1000*4; i++ )
-    mem[i] = i;
-then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumi32x4(16, 1000);
-print("i32 simd " + (Date.now() - then));
-xs=get(mem, 4);
-then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumi32x4_scalar(16, 1000);
-print("i32 scalar " + (Date.now() - then));
-assertSame(xs, get(mem, 4));
-
-mem = new Int8Array(ins.exports.mem.buffer);
-for ( let i=0 ; i < 1000*16; i++ )
-    mem[i] = i;
-then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumi8x16(16, 1000);
-print("i8 simd " + (Date.now() - then));
-xs=get(mem, 16);
-then = Date.now();
-for ( let i=0 ; i < 30000 ; i++ )
-    ins.exports.sumi8x16_scalar(16, 1000);
-print("i8 scalar " + (Date.now() - then));
-assertSame(xs, get(mem, 16));
+for ( let [name, Type, lanes] of [["f32", Float32Array, 4],
+                                  ["f64", Float64Array, 2],
+                                  ["i32", Int32Array, 4],
+                                  ["i8", Int8Array, 16]] ) {
+    let mem = new Type(ins.exports.mem.buffer);
+    for ( let i=0 ; i < 1000*lanes; i++ )
+        mem[i] = i;
+    let simd = ins.exports["sum" + name + "x" + lanes];
+    let scalar = ins.exports["sum" + name + "x" + lanes + "_scalar"];
+    bench("sumcols-" + name, "simd", () => {
+        for ( let i=0 ; i < 30000 ; i++ )
+            simd(16, 1000);
+    });
+    let xs=get(mem, lanes);
+    bench("sumcols-" + name, "scalar", () => {
+        for ( let i=0 ; i < 30000 ; i++ )
+            scalar(16, 1000);
+    });
+    assertSame(xs, get(mem, lanes));
+}
 
 function assertSame(xs, ys) {
     assertEq(xs.length, ys.length);